@@ -0,0 +1,256 @@
+#ifndef ASYNC_WRITER_HPP
+#define ASYNC_WRITER_HPP
+
+#include "record_structure.hpp"
+#include "storage_backend.hpp"
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstring>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Size of each staging buffer handed from the gather to the writer
+constexpr size_t STAGING_BUFFER_SIZE = BUFFER_SIZE;
+
+// Staging buffers that may be queued at the writer before gather blocks
+constexpr size_t WRITER_QUEUE_DEPTH = 2;
+
+// How many records ahead the gather prefetches source bytes
+constexpr size_t GATHER_PREFETCH_DISTANCE = 16;
+
+// Copies shorter than this go through memcpy instead of streaming stores
+constexpr size_t STREAM_COPY_MIN = 128;
+
+// Contiguous buffer of back-to-back serialized records
+struct RecordBuffer {
+    std::unique_ptr<char[]> data;
+    size_t size = 0;
+    size_t capacity = 0;
+};
+
+/**
+ * Copies n bytes with non-temporal stores so the output does not evict the
+ * gather's working set from cache. Falls back to memcpy without SSE2.
+ */
+inline void streamCopy(char* dst, const char* src, size_t n) {
+#if defined(__SSE2__)
+    if (n >= STREAM_COPY_MIN) {
+        size_t head = (16 - (reinterpret_cast<uintptr_t>(dst) & 15)) & 15;
+        std::memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        n -= head;
+        for (; n >= 16; n -= 16, dst += 16, src += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+            _mm_stream_si128(reinterpret_cast<__m128i*>(dst), v);
+        }
+    }
+#endif
+    std::memcpy(dst, src, n);
+}
+
+// Orders this thread's streaming stores before the buffer changes hands
+inline void streamFence() {
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
+
+// Per-source accessors used by the gather
+inline size_t gatherSize(const RecordView& r) { return HEADER_SIZE + r.len; }
+inline size_t gatherSize(const RecordPtr& r) { return r.size(); }
+
+inline const void* gatherSource(const RecordView& r) { return r.payload; }
+inline const void* gatherSource(const RecordPtr& r) { return r.data(); }
+
+inline void gatherCopy(char* dst, const RecordView& r) {
+    std::memcpy(dst, &r.key, sizeof(uint64_t));
+    std::memcpy(dst + sizeof(uint64_t), &r.len, sizeof(uint32_t));
+    streamCopy(dst + HEADER_SIZE, r.payload, r.len);
+}
+
+inline void gatherCopy(char* dst, const RecordPtr& r) {
+    if (r.get()) streamCopy(dst, r.data(), r.size());
+}
+
+/**
+ * Consumer of the bytes an AsyncWriter stages, called on the writer thread
+ * in output order. Output encoders plug in here, laying the output out as
+ * it is produced instead of re-reading a raw file.
+ */
+class WriterSink {
+public:
+    virtual ~WriterSink() = default;
+    virtual void write(const char* data, size_t n) = 0;
+    virtual void finish() = 0;          // After the last write
+};
+
+/**
+ * Background writer fed with filled staging buffers. Buffers are recycled
+ * so steady-state output needs no allocation, and submit() blocks once
+ * WRITER_QUEUE_DEPTH buffers are waiting, bounding memory.
+ */
+class AsyncWriter {
+private:
+    std::unique_ptr<StorageFile> out_;
+    std::unique_ptr<WriterSink> sink_;  // Replaces out_ when set
+    uint64_t offset_ = 0;               // Bytes written so far
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<RecordBuffer> pending_;
+    std::vector<RecordBuffer> free_;
+    size_t buffer_capacity_;
+    bool closing_ = false;
+    std::exception_ptr error_;
+
+    void run() {
+        for (;;) {
+            RecordBuffer buffer;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return !pending_.empty() || closing_; });
+                if (pending_.empty()) return;
+                buffer = std::move(pending_.front());
+                pending_.pop_front();
+            }
+            cv_.notify_all();
+
+            if (!error_) {
+                try {
+                    if (sink_) {
+                        sink_->write(buffer.data.get(), buffer.size);
+                    } else {
+                        out_->pwrite(buffer.data.get(), buffer.size, offset_);
+                    }
+                    offset_ += buffer.size;
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    error_ = std::current_exception();
+                }
+            }
+
+            buffer.size = 0;
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_.push_back(std::move(buffer));
+        }
+    }
+
+public:
+    /**
+     * @param path File written with the staged bytes as they are
+     * @param buffer_capacity Bytes per staging buffer
+     * @param sink Consumer of the staged bytes instead of path, if set
+     */
+    AsyncWriter(const std::string& path, size_t buffer_capacity = STAGING_BUFFER_SIZE,
+                std::unique_ptr<WriterSink> sink = nullptr)
+        : out_(sink ? nullptr : storage().open(path, OpenMode::Write)), sink_(std::move(sink)),
+          buffer_capacity_(buffer_capacity) {
+        thread_ = std::thread(&AsyncWriter::run, this);
+    }
+
+    ~AsyncWriter() {
+        try {
+            close();
+        } catch (const std::exception& e) {
+            std::cerr << "Error closing async writer: " << e.what() << std::endl;
+        }
+    }
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    size_t bufferCapacity() const { return buffer_capacity_; }
+
+    // Returns an empty staging buffer of bufferCapacity() bytes
+    RecordBuffer acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                RecordBuffer buffer = std::move(free_.back());
+                free_.pop_back();
+                return buffer;
+            }
+        }
+        RecordBuffer buffer;
+        buffer.data.reset(new char[buffer_capacity_]);
+        buffer.capacity = buffer_capacity_;
+        return buffer;
+    }
+
+    // Queues a filled buffer for writing, blocking while the queue is full
+    void submit(RecordBuffer buffer) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return pending_.size() < WRITER_QUEUE_DEPTH; });
+        if (error_) std::rethrow_exception(error_);
+        pending_.push_back(std::move(buffer));
+        lock.unlock();
+        cv_.notify_all();
+    }
+
+    // Appends bytes to a staging buffer, submitting it first when full
+    void append(RecordBuffer& buffer, const char* data, size_t n) {
+        if (buffer.size + n > buffer.capacity) {
+            if (buffer.size > 0) submit(std::move(buffer));
+            buffer = acquire();
+        }
+        std::memcpy(buffer.data.get() + buffer.size, data, n);
+        buffer.size += n;
+    }
+
+    // Submits a partially filled staging buffer
+    void flush(RecordBuffer& buffer) {
+        if (buffer.size > 0) submit(std::move(buffer));
+        buffer = RecordBuffer();
+    }
+
+    // Drains queued buffers and closes the file; rethrows any write error
+    void close() {
+        if (!thread_.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closing_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+        out_.reset();
+        if (error_) std::rethrow_exception(error_);
+        if (sink_) {
+            std::unique_ptr<WriterSink> sink = std::move(sink_);
+            sink->finish();
+        }
+    }
+};
+
+/**
+ * Writes items in order through the writer from the calling thread, for
+ * callers that are themselves one of many parallel workers.
+ */
+template <typename Item>
+void gatherWrite(const std::vector<Item>& items, AsyncWriter& writer) {
+    RecordBuffer buffer = writer.acquire();
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (i + GATHER_PREFETCH_DISTANCE < items.size()) {
+            __builtin_prefetch(gatherSource(items[i + GATHER_PREFETCH_DISTANCE]));
+        }
+        size_t size = gatherSize(items[i]);
+        if (buffer.size + size > buffer.capacity) {
+            streamFence();
+            writer.submit(std::move(buffer));
+            buffer = writer.acquire();
+        }
+        gatherCopy(buffer.data.get() + buffer.size, items[i]);
+        buffer.size += size;
+    }
+    streamFence();
+    writer.flush(buffer);
+}
+
+#endif // ASYNC_WRITER_HPP
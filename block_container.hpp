@@ -0,0 +1,420 @@
+#ifndef BLOCK_CONTAINER_HPP
+#define BLOCK_CONTAINER_HPP
+
+#include "record_structure.hpp"
+#include "storage_backend.hpp"
+#include "async_writer.hpp"
+#include <array>
+#include <string>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/*
+ * Block container format. The file is a sequence of fixed-size blocks
+ * (only the last may be short); block b starts at b * block_size with a
+ * BlockHeader followed by up to block_size - sizeof(BlockHeader) bytes of
+ * the raw record stream. Records may span blocks. A block's header names
+ * the first record that starts inside it, so a reader can begin at any
+ * block without scanning what precedes it. A byte range [begin, end) of a
+ * container owns the records that start in the blocks beginning inside it.
+ */
+
+constexpr uint32_t BLOCK_MAGIC = 0x4B4C4252;           // "RBLK"
+constexpr uint32_t BLOCK_NO_RECORD = UINT32_MAX;        // No record starts in the block
+constexpr size_t CONTAINER_BLOCK_SIZE = 1 * MB;         // Default block size
+constexpr size_t CONTAINER_BLOCK_MIN = 4096;
+constexpr size_t CONTAINER_BLOCK_MAX = 256 * MB;
+
+struct BlockHeader {
+    uint32_t magic;
+    uint32_t block_size;        // Same in every block of a file
+    uint64_t block_index;
+    uint32_t first_record;      // Payload offset of the first record start, or BLOCK_NO_RECORD
+    uint32_t used;              // Payload bytes in this block
+    uint32_t record_count;      // Records starting in this block
+    uint32_t crc;               // CRC-32C of the header (crc = 0) and payload
+    uint64_t min_key;           // Key range of the records starting here
+    uint64_t max_key;
+};
+static_assert(sizeof(BlockHeader) == 48, "BlockHeader layout must not change");
+
+constexpr size_t BLOCK_HEADER_SIZE = sizeof(BlockHeader);
+
+inline const uint32_t* crc32cTable() {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint32_t crc32cHardware(uint32_t crc, const char* p, size_t n) {
+    uint64_t c = crc;
+    for (; n >= sizeof(uint64_t); p += sizeof(uint64_t), n -= sizeof(uint64_t)) {
+        uint64_t v;
+        std::memcpy(&v, p, sizeof(uint64_t));
+        c = _mm_crc32_u64(c, v);
+    }
+    uint32_t c32 = static_cast<uint32_t>(c);
+    for (; n > 0; ++p, --n) c32 = _mm_crc32_u8(c32, static_cast<uint8_t>(*p));
+    return c32;
+}
+#endif
+
+// CRC-32C (Castagnoli), continuing from crc; uses SSE4.2 when available
+inline uint32_t crc32c(const char* p, size_t n, uint32_t crc = 0) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) return ~crc32cHardware(crc, p, n);
+#endif
+    const uint32_t* table = crc32cTable();
+    for (; n > 0; ++p, --n) crc = table[(crc ^ static_cast<uint8_t>(*p)) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+inline uint32_t blockChecksum(BlockHeader header, const char* payload) {
+    header.crc = 0;
+    uint32_t crc = crc32c(reinterpret_cast<const char*>(&header), sizeof(header));
+    return crc32c(payload, header.used, crc);
+}
+
+struct ContainerInfo {
+    uint32_t block_size = 0;
+    uint64_t blocks = 0;
+    uint64_t file_size = 0;
+
+    size_t payloadCapacity() const { return block_size - BLOCK_HEADER_SIZE; }
+
+    // First block starting at or after a byte offset
+    uint64_t blockAtOrAfter(uint64_t offset) const {
+        if (offset >= file_size) return blocks;
+        return (offset + block_size - 1) / block_size;
+    }
+};
+
+/**
+ * Checks whether a file is a container by its first block header. A raw
+ * record file never matches: its bytes 8-11 are a payload length of at
+ * least PAYLOAD_MIN where a container has block index 0.
+ */
+inline bool probeContainer(StorageFile& file, ContainerInfo* info = nullptr) {
+    const uint64_t file_size = file.size();
+    if (file_size < BLOCK_HEADER_SIZE) return false;
+
+    BlockHeader header;
+    if (file.pread(&header, sizeof(header), 0) != sizeof(header)) return false;
+    if (header.magic != BLOCK_MAGIC || header.block_index != 0 ||
+        header.block_size < CONTAINER_BLOCK_MIN || header.block_size > CONTAINER_BLOCK_MAX ||
+        header.used > header.block_size - BLOCK_HEADER_SIZE) {
+        return false;
+    }
+
+    if (info) {
+        info->block_size = header.block_size;
+        info->file_size = file_size;
+        info->blocks = (file_size + header.block_size - 1) / header.block_size;
+    }
+    return true;
+}
+
+inline bool isContainerFile(const std::string& path, ContainerInfo* info = nullptr) {
+    if (!storage().exists(path)) return false;
+    std::unique_ptr<StorageFile> file = storage().open(path, OpenMode::Read);
+    return probeContainer(*file, info);
+}
+
+/**
+ * Reads and validates block b into buffer (block_size bytes)
+ * @return The block's header; throws on a damaged block
+ */
+inline BlockHeader readBlock(StorageFile& file, const ContainerInfo& info, uint64_t b, char* buffer) {
+    const uint64_t offset = b * info.block_size;
+    const size_t want = static_cast<size_t>(std::min<uint64_t>(info.block_size, info.file_size - offset));
+    if (want < BLOCK_HEADER_SIZE || file.pread(buffer, want, offset) != want) {
+        throw std::runtime_error("Truncated container block " + std::to_string(b));
+    }
+
+    BlockHeader header;
+    std::memcpy(&header, buffer, sizeof(header));
+    if (header.magic != BLOCK_MAGIC || header.block_index != b || header.block_size != info.block_size ||
+        header.used > want - BLOCK_HEADER_SIZE ||
+        (header.first_record != BLOCK_NO_RECORD && header.first_record >= header.used)) {
+        throw std::runtime_error("Corrupt container block header " + std::to_string(b));
+    }
+    if (blockChecksum(header, buffer + BLOCK_HEADER_SIZE) != header.crc) {
+        throw std::runtime_error("Checksum mismatch in container block " + std::to_string(b));
+    }
+    return header;
+}
+
+/**
+ * Sequential record reader over the blocks owned by a byte range of a
+ * container. Records spanning blocks are reassembled; the last record of
+ * the range may continue into blocks past its end.
+ */
+class BlockCursor {
+private:
+    StorageFile& file_;
+    ContainerInfo info_;
+    uint64_t block_;                    // Block loaded in block_buf_
+    uint64_t end_block_;                // First block not owned by the range
+    std::unique_ptr<char[]> block_buf_;
+    const char* payload_ = nullptr;
+    size_t used_ = 0;
+    size_t pos_ = 0;                    // Next unread payload byte
+    bool done_ = false;
+    std::unique_ptr<char[]> record_;    // Reassembled record
+
+    void load(uint64_t b) {
+        BlockHeader header = readBlock(file_, info_, b, block_buf_.get());
+        block_ = b;
+        payload_ = block_buf_.get() + BLOCK_HEADER_SIZE;
+        used_ = header.used;
+        pos_ = header.first_record == BLOCK_NO_RECORD ? used_ : header.first_record;
+    }
+
+    // Copies n bytes of the record stream, crossing into later blocks
+    void copy(char* dst, size_t n) {
+        while (n > 0) {
+            if (pos_ == used_) {
+                if (block_ + 1 >= info_.blocks) {
+                    throw std::runtime_error("Record truncated at end of container");
+                }
+                BlockHeader header = readBlock(file_, info_, block_ + 1, block_buf_.get());
+                block_++;
+                payload_ = block_buf_.get() + BLOCK_HEADER_SIZE;
+                used_ = header.used;
+                pos_ = 0;
+            }
+            size_t take = std::min(n, used_ - pos_);
+            std::memcpy(dst, payload_ + pos_, take);
+            dst += take;
+            n -= take;
+            pos_ += take;
+        }
+    }
+
+public:
+    BlockCursor(StorageFile& file, const ContainerInfo& info, uint64_t begin, uint64_t end)
+        : file_(file), info_(info), block_buf_(new char[info.block_size]),
+          record_(new char[HEADER_SIZE + PAYLOAD_MAX]) {
+        block_ = info_.blockAtOrAfter(begin);
+        end_block_ = info_.blockAtOrAfter(end);
+
+        // Skip blocks that lie wholly inside a record of an earlier range
+        for (; block_ < end_block_; ++block_) {
+            load(block_);
+            if (pos_ < used_) return;
+        }
+        done_ = true;
+    }
+
+    // Next record of the range, or an empty RecordPtr at its end
+    RecordPtr next() {
+        if (done_) return RecordPtr();
+        if (pos_ == used_) {
+            // The next record starts at the beginning of the following block
+            if (block_ + 1 >= end_block_) {
+                done_ = true;
+                return RecordPtr();
+            }
+            load(block_ + 1);
+        }
+        if (block_ >= end_block_) {
+            done_ = true;               // Starts in a block of the next range
+            return RecordPtr();
+        }
+
+        copy(record_.get(), HEADER_SIZE);
+        uint32_t len;
+        std::memcpy(&len, record_.get() + sizeof(uint64_t), sizeof(uint32_t));
+        if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
+            throw std::runtime_error("Invalid record length: " + std::to_string(len) +
+                                     " in container block " + std::to_string(block_));
+        }
+        copy(record_.get() + HEADER_SIZE, len);
+        return RecordPtr(record_.get(), HEADER_SIZE + len);
+    }
+};
+
+/**
+ * Splits [begin, end) of a container into `parts` block-aligned ranges of
+ * roughly equal size; no record data is read
+ * @return parts + 1 offsets, as recordAlignedSplits()
+ */
+inline std::vector<uint64_t> blockAlignedSplits(const ContainerInfo& info, uint64_t begin,
+                                                uint64_t end, size_t parts) {
+    const uint64_t first = info.blockAtOrAfter(begin);
+    const uint64_t last = info.blockAtOrAfter(end);
+    std::vector<uint64_t> splits(parts + 1);
+    for (size_t i = 0; i <= parts; ++i) {
+        uint64_t block = first + (last - first) * i / parts;
+        splits[i] = std::min<uint64_t>(block * info.block_size, info.file_size);
+    }
+    return splits;
+}
+
+/**
+ * Packs a raw record stream into container blocks written through an
+ * AsyncWriter. Bytes can be appended in pieces of any size; record
+ * boundaries are found from the headers as they pass.
+ */
+class ContainerEncoder {
+private:
+    AsyncWriter writer_;
+    size_t block_size_;
+    RecordBuffer block_;
+    BlockHeader header_;
+    uint64_t next_block_ = 0;
+    char record_header_[HEADER_SIZE];
+    size_t header_fill_ = 0;            // Bytes of a record header collected
+    size_t payload_left_ = 0;           // Payload bytes of the current record still to come
+
+    void startBlock() {
+        block_ = writer_.acquire();
+        block_.size = BLOCK_HEADER_SIZE;
+        header_ = BlockHeader{BLOCK_MAGIC, static_cast<uint32_t>(block_size_), next_block_++,
+                              BLOCK_NO_RECORD, 0, 0, 0, 0, 0};
+    }
+
+    void flushBlock() {
+        header_.used = static_cast<uint32_t>(block_.size - BLOCK_HEADER_SIZE);
+        header_.crc = blockChecksum(header_, block_.data.get() + BLOCK_HEADER_SIZE);
+        std::memcpy(block_.data.get(), &header_, sizeof(header_));
+        writer_.submit(std::move(block_));
+        startBlock();
+    }
+
+    void put(const char* data, size_t n) {
+        while (n > 0) {
+            size_t take = std::min(n, block_size_ - block_.size);
+            std::memcpy(block_.data.get() + block_.size, data, take);
+            block_.size += take;
+            data += take;
+            n -= take;
+            if (block_.size == block_size_) flushBlock();
+        }
+    }
+
+    // Called once a record header is complete; the record starts in the open block
+    void beginRecord() {
+        uint64_t key;
+        uint32_t len;
+        std::memcpy(&key, record_header_, sizeof(uint64_t));
+        std::memcpy(&len, record_header_ + sizeof(uint64_t), sizeof(uint32_t));
+        if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
+            throw std::runtime_error("Invalid record length while encoding: " + std::to_string(len));
+        }
+        if (header_.first_record == BLOCK_NO_RECORD) {
+            header_.first_record = static_cast<uint32_t>(block_.size - BLOCK_HEADER_SIZE);
+            header_.min_key = key;
+            header_.max_key = key;
+        }
+        header_.min_key = std::min(header_.min_key, key);
+        header_.max_key = std::max(header_.max_key, key);
+        header_.record_count++;
+        put(record_header_, HEADER_SIZE);
+        payload_left_ = len;
+        header_fill_ = 0;
+    }
+
+public:
+    ContainerEncoder(const std::string& path, size_t block_size = CONTAINER_BLOCK_SIZE)
+        : writer_(path, block_size), block_size_(block_size) {
+        if (block_size < CONTAINER_BLOCK_MIN || block_size > CONTAINER_BLOCK_MAX) {
+            throw std::runtime_error("Container block size out of range: " + std::to_string(block_size));
+        }
+        startBlock();
+    }
+
+    // Appends raw record bytes
+    void append(const char* data, size_t n) {
+        while (n > 0) {
+            if (payload_left_ > 0) {
+                size_t take = std::min(n, payload_left_);
+                put(data, take);
+                payload_left_ -= take;
+                data += take;
+                n -= take;
+                continue;
+            }
+            size_t take = std::min(n, HEADER_SIZE - header_fill_);
+            std::memcpy(record_header_ + header_fill_, data, take);
+            header_fill_ += take;
+            data += take;
+            n -= take;
+            if (header_fill_ == HEADER_SIZE) beginRecord();
+        }
+    }
+
+    // Writes the last partial block and closes the file
+    void finish() {
+        if (header_fill_ > 0 || payload_left_ > 0) {
+            throw std::runtime_error("Raw input ends inside a record");
+        }
+        if (block_.size > BLOCK_HEADER_SIZE) flushBlock();
+        writer_.close();
+    }
+
+    uint64_t blocks() const { return next_block_ - 1; }
+};
+
+/**
+ * Converts a raw record file to the container format
+ * @return Blocks written
+ */
+inline uint64_t encodeContainer(const std::string& raw_path, const std::string& container_path,
+                                size_t block_size = CONTAINER_BLOCK_SIZE) {
+    std::unique_ptr<StorageFile> in = storage().open(raw_path, OpenMode::Read);
+    in->readahead(0, 0, AccessHint::Sequential);
+    ContainerEncoder encoder(container_path, block_size);
+    std::unique_ptr<char[]> chunk(new char[STORAGE_COPY_BLOCK]);
+    for (uint64_t offset = 0;;) {
+        size_t got = in->pread(chunk.get(), STORAGE_COPY_BLOCK, offset);
+        if (got == 0) break;
+        encoder.append(chunk.get(), got);
+        offset += got;
+    }
+    encoder.finish();
+    return encoder.blocks();
+}
+
+/**
+ * Converts a container back to a raw record file
+ * @return Records written
+ */
+inline uint64_t decodeContainer(const std::string& container_path, const std::string& raw_path) {
+    std::unique_ptr<StorageFile> in = storage().open(container_path, OpenMode::Read);
+    ContainerInfo info;
+    if (!probeContainer(*in, &info)) {
+        throw std::runtime_error("Not a block container: " + container_path);
+    }
+    in->readahead(0, info.file_size, AccessHint::Sequential);
+
+    BlockCursor cursor(*in, info, 0, info.file_size);
+    AsyncWriter writer(raw_path);
+    RecordBuffer buffer;
+    uint64_t records = 0;
+    for (RecordPtr r = cursor.next(); r.get(); r = cursor.next()) {
+        writer.append(buffer, r.data(), r.size());
+        records++;
+    }
+    writer.flush(buffer);
+    writer.close();
+    return records;
+}
+
+#endif // BLOCK_CONTAINER_HPP
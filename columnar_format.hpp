@@ -0,0 +1,360 @@
+#ifndef COLUMNAR_FORMAT_HPP
+#define COLUMNAR_FORMAT_HPP
+
+#include "record_structure.hpp"
+#include "storage_backend.hpp"
+#include "mapped_range.hpp"
+#include "async_writer.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+
+/*
+ * Columnar format: a record file split in two. The key column `<path>`
+ * is a ColumnarHeader followed by one 12-byte entry per record, the key
+ * and payload length laid out exactly like a record header. The payload
+ * heap `<path>.heap` holds the payloads back to back in the same order,
+ * so a record's heap offset is the sum of the lengths before it.
+ * Key-only work reads 12 bytes per record instead of the whole record.
+ */
+
+constexpr uint64_t COLUMNAR_MAGIC = 0x314C4F4359454B52;    // "RKEYCOL1"
+constexpr size_t KEY_ENTRY_SIZE = HEADER_SIZE;
+
+// Key entries fetched by each read of the key column
+constexpr size_t KEY_COLUMN_BATCH = 64 * 1024;
+
+struct ColumnarHeader {
+    uint64_t magic;
+    uint64_t records;
+    uint64_t heap_bytes;
+    uint64_t reserved;
+};
+static_assert(sizeof(ColumnarHeader) == 32, "ColumnarHeader layout must not change");
+
+constexpr size_t COLUMNAR_HEADER_SIZE = sizeof(ColumnarHeader);
+
+inline std::string heapPath(const std::string& key_path) {
+    return key_path + ".heap";
+}
+
+struct ColumnarInfo {
+    uint64_t records = 0;
+    uint64_t heap_bytes = 0;
+
+    uint64_t entryOffset(uint64_t record) const {
+        return COLUMNAR_HEADER_SIZE + record * KEY_ENTRY_SIZE;
+    }
+
+    // First record whose entry starts at or after a key-column byte offset
+    uint64_t recordAtOrAfter(uint64_t offset) const {
+        if (offset <= COLUMNAR_HEADER_SIZE) return 0;
+        return std::min(records, (offset - COLUMNAR_HEADER_SIZE + KEY_ENTRY_SIZE - 1) / KEY_ENTRY_SIZE);
+    }
+};
+
+// A raw record file never matches: its bytes 8-11 would be a payload length
+inline bool probeColumnar(StorageFile& file, ColumnarInfo* info = nullptr) {
+    const uint64_t file_size = file.size();
+    if (file_size < COLUMNAR_HEADER_SIZE) return false;
+
+    ColumnarHeader header;
+    if (file.pread(&header, sizeof(header), 0) != sizeof(header)) return false;
+    if (header.magic != COLUMNAR_MAGIC ||
+        file_size != COLUMNAR_HEADER_SIZE + header.records * KEY_ENTRY_SIZE) {
+        return false;
+    }
+
+    if (info) {
+        info->records = header.records;
+        info->heap_bytes = header.heap_bytes;
+    }
+    return true;
+}
+
+inline bool isColumnarFile(const std::string& path, ColumnarInfo* info = nullptr) {
+    if (!storage().exists(path)) return false;
+    std::unique_ptr<StorageFile> file = storage().open(path, OpenMode::Read);
+    return probeColumnar(*file, info);
+}
+
+/**
+ * Reads the key entries of records [first, first + count) as views with
+ * no payload bound yet
+ */
+inline std::vector<RecordView> readKeyColumn(const std::string& key_path, const ColumnarInfo& info,
+                                             uint64_t first, uint64_t count) {
+    std::unique_ptr<StorageFile> file = storage().open(key_path, OpenMode::Read);
+    file->readahead(info.entryOffset(first), count * KEY_ENTRY_SIZE, AccessHint::Sequential);
+
+    std::vector<RecordView> views;
+    views.reserve(count);
+    std::unique_ptr<char[]> batch(new char[KEY_COLUMN_BATCH * KEY_ENTRY_SIZE]);
+    for (uint64_t done = 0; done < count;) {
+        const size_t n = static_cast<size_t>(std::min<uint64_t>(KEY_COLUMN_BATCH, count - done));
+        if (file->pread(batch.get(), n * KEY_ENTRY_SIZE, info.entryOffset(first + done)) != n * KEY_ENTRY_SIZE) {
+            throw std::runtime_error("Key column truncated: " + key_path);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t key;
+            uint32_t len;
+            std::memcpy(&key, batch.get() + i * KEY_ENTRY_SIZE, sizeof(uint64_t));
+            std::memcpy(&len, batch.get() + i * KEY_ENTRY_SIZE + sizeof(uint64_t), sizeof(uint32_t));
+            if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
+                throw std::runtime_error("Invalid record length: " + std::to_string(len) +
+                                         " in key column entry " + std::to_string(first + done + i));
+            }
+            views.emplace_back(key, nullptr, len);
+        }
+        done += n;
+    }
+    return views;
+}
+
+// Sum of the payload lengths of a run of views
+inline uint64_t payloadBytes(const std::vector<RecordView>& views) {
+    uint64_t bytes = 0;
+    for (const auto& v : views) bytes += v.len;
+    return bytes;
+}
+
+/**
+ * Heap offset of a record's payload: the lengths of every earlier record
+ * summed, reading only the key column
+ */
+inline uint64_t heapOffsetOf(const std::string& key_path, const ColumnarInfo& info, uint64_t record) {
+    uint64_t offset = 0;
+    for (uint64_t first = 0; first < record; first += KEY_COLUMN_BATCH) {
+        offset += payloadBytes(readKeyColumn(key_path, info, first,
+                                             std::min<uint64_t>(KEY_COLUMN_BATCH, record - first)));
+    }
+    return offset;
+}
+
+/**
+ * Key index of a run of records with payloads left in the mapped heap.
+ * Sorting the index and gathering through it reads every payload once.
+ */
+struct ColumnarIndex {
+    std::unique_ptr<MappedRange> heap;
+    std::vector<RecordView> views;
+};
+
+/**
+ * Loads the key entries of records [first, first + count) and binds them
+ * to a mapping of their heap range
+ * @param heap_base Heap offset of record `first` (see heapOffsetOf)
+ */
+inline ColumnarIndex loadColumnarIndex(const std::string& key_path, const ColumnarInfo& info,
+                                       uint64_t first, uint64_t count, uint64_t heap_base) {
+    ColumnarIndex index;
+    index.views = readKeyColumn(key_path, info, first, count);
+    const uint64_t bytes = payloadBytes(index.views);
+    if (heap_base + bytes > info.heap_bytes) {
+        throw std::runtime_error("Payload heap shorter than its key column: " + heapPath(key_path));
+    }
+
+    index.heap = std::make_unique<MappedRange>(heapPath(key_path), heap_base, heap_base + bytes);
+    if (index.heap->end() - index.heap->begin() != bytes) {
+        throw std::runtime_error("Payload heap truncated: " + heapPath(key_path));
+    }
+    uint64_t offset = heap_base;
+    for (auto& v : index.views) {
+        v.bind(index.heap->at(offset));
+        offset += v.len;
+    }
+    return index;
+}
+
+/**
+ * Sequential record reader over the records whose key entries start in a
+ * byte range of the key column, rebuilding full records from the heap
+ */
+class ColumnarCursor {
+private:
+    std::string key_path_;
+    ColumnarInfo info_;
+    std::unique_ptr<StorageFile> heap_;
+    uint64_t next_;                     // Next record
+    uint64_t end_;                      // One past the last record
+    uint64_t heap_pos_;                 // Heap offset of next_'s payload
+    std::vector<RecordView> batch_;     // Key entries of upcoming records
+    size_t batch_pos_ = 0;
+    std::unique_ptr<char[]> heap_buf_;
+    uint64_t heap_buf_start_ = 0;       // Heap offset of heap_buf_[0]
+    size_t heap_buf_len_ = 0;
+    size_t heap_buf_cap_;
+    std::unique_ptr<char[]> record_;
+
+    const char* payload(uint64_t offset, uint32_t len) {
+        if (offset < heap_buf_start_ || offset + len > heap_buf_start_ + heap_buf_len_) {
+            heap_buf_start_ = offset;
+            heap_buf_len_ = heap_->pread(heap_buf_.get(), heap_buf_cap_, offset);
+            if (heap_buf_len_ < len) {
+                throw std::runtime_error("Payload heap truncated: " + heapPath(key_path_));
+            }
+        }
+        return heap_buf_.get() + (offset - heap_buf_start_);
+    }
+
+public:
+    ColumnarCursor(const std::string& key_path, const ColumnarInfo& info, uint64_t begin, uint64_t end,
+                   size_t buffer_size)
+        : key_path_(key_path), info_(info), heap_(storage().open(heapPath(key_path), OpenMode::Read)),
+          heap_buf_(new char[std::max<size_t>(buffer_size, PAYLOAD_MAX)]),
+          heap_buf_cap_(std::max<size_t>(buffer_size, PAYLOAD_MAX)),
+          record_(new char[HEADER_SIZE + PAYLOAD_MAX]) {
+        next_ = info_.recordAtOrAfter(begin);
+        end_ = std::max(next_, end >= info_.entryOffset(info_.records) ? info_.records : info_.recordAtOrAfter(end));
+        heap_pos_ = heapOffsetOf(key_path_, info_, next_);
+        heap_->readahead(heap_pos_, 0, AccessHint::Sequential);
+    }
+
+    RecordPtr next() {
+        if (next_ >= end_) return RecordPtr();
+        if (batch_pos_ == batch_.size()) {
+            batch_ = readKeyColumn(key_path_, info_, next_, std::min<uint64_t>(KEY_COLUMN_BATCH, end_ - next_));
+            batch_pos_ = 0;
+        }
+        const RecordView& entry = batch_[batch_pos_++];
+        std::memcpy(record_.get(), &entry.key, sizeof(uint64_t));
+        std::memcpy(record_.get() + sizeof(uint64_t), &entry.len, sizeof(uint32_t));
+        std::memcpy(record_.get() + HEADER_SIZE, payload(heap_pos_, entry.len), entry.len);
+        heap_pos_ += entry.len;
+        next_++;
+        return RecordPtr(record_.get(), HEADER_SIZE + entry.len);
+    }
+};
+
+/**
+ * Splits [begin, end) of a key column into `parts` ranges on entry
+ * boundaries; the split is arithmetic, nothing is read
+ */
+inline std::vector<uint64_t> entryAlignedSplits(const ColumnarInfo& info, uint64_t begin,
+                                                uint64_t end, size_t parts) {
+    const uint64_t first = info.recordAtOrAfter(begin);
+    const uint64_t last = end >= info.entryOffset(info.records) ? info.records : info.recordAtOrAfter(end);
+    std::vector<uint64_t> splits(parts + 1);
+    for (size_t i = 0; i <= parts; ++i) {
+        splits[i] = info.entryOffset(first + (last - first) * i / parts);
+    }
+    return splits;
+}
+
+/**
+ * Splits a raw record stream into a key column and payload heap. Bytes can
+ * be appended in pieces of any size; the header goes in last.
+ */
+class ColumnarEncoder {
+private:
+    std::string key_path_;
+    AsyncWriter keys_;
+    AsyncWriter heap_;
+    RecordBuffer key_buffer_;
+    RecordBuffer heap_buffer_;
+    ColumnarHeader header_{COLUMNAR_MAGIC, 0, 0, 0};
+    char record_header_[HEADER_SIZE];
+    size_t header_fill_ = 0;            // Bytes of a record header collected
+    size_t payload_left_ = 0;           // Payload bytes of the current record still to come
+
+    void beginRecord() {
+        uint32_t len;
+        std::memcpy(&len, record_header_ + sizeof(uint64_t), sizeof(uint32_t));
+        if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
+            throw std::runtime_error("Invalid record length while encoding: " + std::to_string(len));
+        }
+        keys_.append(key_buffer_, record_header_, KEY_ENTRY_SIZE);
+        header_.records++;
+        header_.heap_bytes += len;
+        payload_left_ = len;
+        header_fill_ = 0;
+    }
+
+public:
+    explicit ColumnarEncoder(const std::string& key_path)
+        : key_path_(key_path), keys_(key_path), heap_(heapPath(key_path)) {
+        // Placeholder until the counts are known
+        keys_.append(key_buffer_, reinterpret_cast<const char*>(&header_), sizeof(header_));
+    }
+
+    // Appends raw record bytes
+    void append(const char* data, size_t n) {
+        while (n > 0) {
+            if (payload_left_ > 0) {
+                size_t take = std::min(n, payload_left_);
+                heap_.append(heap_buffer_, data, take);
+                payload_left_ -= take;
+                data += take;
+                n -= take;
+                continue;
+            }
+            size_t take = std::min(n, HEADER_SIZE - header_fill_);
+            std::memcpy(record_header_ + header_fill_, data, take);
+            header_fill_ += take;
+            data += take;
+            n -= take;
+            if (header_fill_ == HEADER_SIZE) beginRecord();
+        }
+    }
+
+    // Closes both files and writes the final header
+    void finish() {
+        if (header_fill_ > 0 || payload_left_ > 0) {
+            throw std::runtime_error("Raw input ends inside a record");
+        }
+        keys_.flush(key_buffer_);
+        heap_.flush(heap_buffer_);
+        keys_.close();
+        heap_.close();
+        std::unique_ptr<StorageFile> keys = storage().open(key_path_, OpenMode::ReadWrite);
+        keys->pwrite(&header_, sizeof(header_), 0);
+    }
+
+    uint64_t records() const { return header_.records; }
+};
+
+/**
+ * Converts a raw record file to the columnar format
+ * @return Records written
+ */
+inline uint64_t encodeColumnar(const std::string& raw_path, const std::string& key_path) {
+    std::unique_ptr<StorageFile> in = storage().open(raw_path, OpenMode::Read);
+    in->readahead(0, 0, AccessHint::Sequential);
+    ColumnarEncoder encoder(key_path);
+    std::unique_ptr<char[]> chunk(new char[STORAGE_COPY_BLOCK]);
+    for (uint64_t offset = 0;;) {
+        size_t got = in->pread(chunk.get(), STORAGE_COPY_BLOCK, offset);
+        if (got == 0) break;
+        encoder.append(chunk.get(), got);
+        offset += got;
+    }
+    encoder.finish();
+    return encoder.records();
+}
+
+/**
+ * Joins a key column and its heap back into a raw record file
+ * @return Records written
+ */
+inline uint64_t decodeColumnar(const std::string& key_path, const std::string& raw_path) {
+    ColumnarInfo info;
+    if (!isColumnarFile(key_path, &info)) {
+        throw std::runtime_error("Not a columnar key file: " + key_path);
+    }
+    ColumnarCursor cursor(key_path, info, 0, info.entryOffset(info.records), STORAGE_COPY_BLOCK);
+    AsyncWriter writer(raw_path);
+    RecordBuffer buffer;
+    uint64_t records = 0;
+    for (RecordPtr r = cursor.next(); r.get(); r = cursor.next()) {
+        writer.append(buffer, r.data(), r.size());
+        records++;
+    }
+    writer.flush(buffer);
+    writer.close();
+    return records;
+}
+
+#endif // COLUMNAR_FORMAT_HPP
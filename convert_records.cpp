@@ -0,0 +1,46 @@
+#include "block_container.hpp"
+#include "columnar_format.hpp"
+#include "permutation_output.hpp"
+#include <iostream>
+#include <string>
+
+int main(int argc, char* argv[]) {
+    if (argc < 4 || argc > 5) {
+        std::cerr << "Usage: " << argv[0] << " <to-container|to-columnar|to-raw> <input_file> <output_file> [block_kb]\n";
+        std::cerr << "       " << argv[0] << " materialize <input_file> <output_file> <permutation_file>\n";
+        return 1;
+    }
+
+    std::string mode = argv[1];
+    std::string input_file = argv[2];
+    std::string output_file = argv[3];
+    size_t block_size = (argc == 5 && mode != "materialize") ? std::stoull(argv[4]) * 1024 : CONTAINER_BLOCK_SIZE;
+
+    try {
+        if (mode == "to-container") {
+            uint64_t blocks = encodeContainer(input_file, output_file, block_size);
+            std::cout << "Wrote " << blocks << " blocks of " << block_size / 1024 << " KB" << std::endl;
+        } else if (mode == "to-columnar") {
+            uint64_t records = encodeColumnar(input_file, output_file);
+            std::cout << "Wrote " << records << " key entries and payload heap " << heapPath(output_file) << std::endl;
+            storage().persist(heapPath(output_file));
+        } else if (mode == "to-raw") {
+            uint64_t records = isColumnarFile(input_file) ? decodeColumnar(input_file, output_file)
+                                                          : decodeContainer(input_file, output_file);
+            std::cout << "Wrote " << records << " records" << std::endl;
+        } else if (mode == "materialize" && argc == 5) {
+            // Records of the input in the order of a permutation output
+            uint64_t records = materializePermutation(argv[4], input_file, output_file);
+            std::cout << "Wrote " << records << " records" << std::endl;
+        } else {
+            std::cerr << "Unknown mode: " << mode << "\n";
+            return 1;
+        }
+        storage().persist(output_file);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -3,10 +3,15 @@
 #define FASTFLOW_SORT_HPP
 
 #include "record_structure.hpp"
+#include "range_reader.hpp"
+#include "async_writer.hpp"
+#include "permutation_output.hpp"
+#include "input_set.hpp"
+#include "output_format.hpp"
 #include <ff/ff.hpp>
 #include <ff/farm.hpp>
 #include <ff/pipeline.hpp>
-#include <mutex>
+#include <ff/all2all.hpp>
 #include <vector>
 #include <string>
 #include <fstream>
@@ -18,18 +23,118 @@
 #include <utility>
 #include <cmath>
 #include <functional>
+#include <chrono>
+#include <deque>
+#include <iomanip>
 
 namespace fs = std::filesystem;
 
+// How FastFlowMergeSort distributes the work
+enum class FastFlowStrategy {
+    FarmMerge,  // Farm generates runs, tiered and hierarchical merging
+    KeyRange    // All-to-all routes records by key range; output is concatenated
+};
+
+// Every SPLITTER_SAMPLE_STRIDE-th record is sampled to choose key splitters
+constexpr size_t SPLITTER_SAMPLE_STRIDE = 64;
+
+// Windows of a raw input read to sample key splitters, and their size;
+// smaller inputs are sampled whole
+constexpr uint64_t RAW_SAMPLE_WINDOWS = 256;
+constexpr size_t RAW_SAMPLE_WINDOW_BYTES = 64 * 1024;
+
+// Records routed to one key range are shipped in batches of this many bytes
+constexpr size_t ROUTE_BATCH_BYTES = 1 * MB;
+
+// Staging buffer of each worker gathering a mapped slice into its run
+constexpr size_t RUN_STAGING_BYTES = 8 * MB;
+
+// Read buffer per input of a k-way merge
+constexpr size_t MERGE_READ_BYTES = 1 * MB;
+
+// Blocks of a container input decoded to sample key splitters
+constexpr uint64_t CONTAINER_SAMPLE_BLOCKS = 256;
+
+// Size of the first chunk, so a worker starts sorting almost immediately
+constexpr size_t CHUNK_MIN_BYTES = 4 * MB;
+
+// Chunks of full size a worker keeps resident before writing them as one run
+constexpr size_t RESIDENT_CHUNKS = 2;
+
+// Chunks per worker that may be read but not yet sorted: one being sorted
+// while the next waits, so no worker idles on the reader
+constexpr size_t IN_FLIGHT_CHUNKS = 2;
+
+// Seconds between two reports of the farm's queue occupancy
+constexpr double QUEUE_REPORT_INTERVAL = 1.0;
+
+// Memory a chunked record costs beyond its bytes: vector slot plus heap header
+constexpr size_t CHUNK_RECORD_OVERHEAD = sizeof(RecordPtr) + 16;
+
 /**
  * FastFlowMergeSort - Out-of-core parallel merge sort implementation using FastFlow
+ *
+ * A single FastFlow farm in accelerator mode lives as long as the sorter.
+ * The calling thread reads chunks and offloads them as sort tasks. Finished
+ * runs are kept in size tiers, LSM style: as soon as a tier holds
+ * MERGE_FAN_IN runs they are merged in the background into one run of the
+ * next tier, so merging overlaps run generation and only a small final
+ * merge remains when the input is exhausted. In zero-copy mode the input is
+ * mapped and the farm receives record-aligned byte ranges instead of
+ * records; workers sort a key index over the mapping and gather the
+ * payloads straight into their run.
+ *
+ * With FastFlowStrategy::KeyRange an ff_a2a is used instead: readers route
+ * each record by sampled splitters to the worker owning its key range, and
+ * the output is the concatenation of the workers' sorted ranges.
  */
 class FastFlowMergeSort {
 private:
+    // Maximum number of files merged by one merge task
+    static constexpr size_t MERGE_FAN_IN = 10;
+
+    /**
+     * Unit of work offloaded to the accelerator farm
+     */
+    struct FarmTask {
+        enum class Kind { Sort, SortSlice, SortColumns, Merge };
+
+        Kind kind;
+        std::vector<RecordPtr>* records = nullptr;  // Sort: chunk to sort and spill
+        uint64_t begin = 0, end = 0;                // SortSlice: byte range of the mapped input;
+                                                    // SortColumns: entries of input_columns_
+        std::vector<std::string> inputs;            // Merge: sorted files to combine
+        bool keep_inputs = false;                   // Merge: inputs belong to the caller
+        OutputFormat format = OutputFormat::Raw;    // Merge: layout of the output
+        std::string output;                         // File produced by the task
+        uint64_t bytes = 0;                         // Size of the produced run, if any
+        uint64_t sorted_bytes = 0;                  // Sort: bytes of the chunk sorted
+        size_t charge = 0;                          // Sort: memory reserved while in flight
+        std::string error;                          // Set by the worker on failure
+        double seconds = 0.0;                       // Time the worker spent on it
+
+        explicit FarmTask(Kind k) : kind(k) {}
+    };
+
     unsigned num_workers_;              // Number of FastFlow workers
     std::string temp_dir_;              // Directory for temporary files
     int file_id_;                       // Counter for generating unique file names
     size_t memory_limit_;               // Memory limit per worker
+    size_t chunk_limit_;                // Largest chunk handed to a worker
+    size_t resident_limit_;             // Sorted chunks a worker may hold
+    size_t in_flight_limit_;            // Chunk memory read but not yet sorted
+    size_t task_limit_;                 // Tasks offloaded at once; bounds the channels
+    FastFlowStrategy strategy_;         // Farm plus merge, or key-range a2a
+    bool zero_copy_;                    // Emit mapped slices instead of records
+    std::unique_ptr<MappedRange> input_map_;    // Input mapping during a zero-copy sort
+    std::unique_ptr<ColumnarIndex> input_columns_; // Key column of a columnar input, heap mapped
+    std::string permutation_input_;     // Input a permutation sort's entries point into, if any
+    std::vector<InputPiece> input_pieces_;  // Files read in turn instead of one input range
+    bool discard_resident_ = false;     // Workers drop resident chunks at EOS (abort)
+
+    std::unique_ptr<ff::ff_farm> farm_; // Accelerator shared by all phases
+    std::vector<std::unique_ptr<ff::ff_node>> farm_nodes_;
+    size_t outstanding_ = 0;            // Tasks offloaded but not yet collected
 
     /**
      * Generates a unique temporary file name
@@ -43,242 +148,699 @@ private:
      * Sorts records in memory using std::sort
      * @param records Vector of record pointers
      */
-    void inMemorySort(std::vector<RecordPtr>& records) {
-        Timer timer("In-memory sort");
-        std::sort(records.begin(), records.end(), 
+    static void inMemorySort(std::vector<RecordPtr>& records) {
+        Timer timer("Worker in-memory sort");
+        std::sort(records.begin(), records.end(),
                   [](const RecordPtr& a, const RecordPtr& b) {
-                      return a.get()->key < b.get()->key;
+                      return recordLess(a.get(), b.get());
                   });
     }
 
     /**
-     * FastFlow Emitter for reading and distributing chunks of data to workers
+     * Chooses the size of each chunk from what has been observed so far.
+     * The first round of chunks starts at CHUNK_MIN_BYTES and doubles, so
+     * every worker gets busy quickly; afterwards chunks are as large as the
+     * memory limit allows, which gives the fewest runs. Once the reader
+     * would finish the rest of the input before a worker sorts one full
+     * chunk, the remainder is split evenly so the workers finish together.
      */
-    class ReaderEmitter : public ff::ff_node {
+    class ChunkSizer {
     private:
-        std::ifstream& inFile_;
-        size_t memory_limit_;
-        std::atomic<bool>& eof_reached_;
-        std::mutex file_mutex_;
+        size_t min_bytes_;
+        size_t max_bytes_;
+        unsigned workers_;
+        uint64_t remaining_;                // Input bytes not yet emitted
+        size_t chunks_ = 0;
+        double read_rate_ = 0.0;            // Bytes per second at the emitter
+        double sort_rate_ = 0.0;            // Bytes per second of one worker
+
+        static void blend(double& rate, double sample) {
+            rate = rate == 0.0 ? sample : 0.7 * rate + 0.3 * sample;
+        }
 
     public:
-        ReaderEmitter(std::ifstream& inFile, size_t memory_limit, std::atomic<bool>& eof_reached)
-            : inFile_(inFile), memory_limit_(memory_limit), eof_reached_(eof_reached) {}
+        ChunkSizer(size_t max_bytes, unsigned workers, uint64_t input_bytes)
+            : min_bytes_(std::min(max_bytes, CHUNK_MIN_BYTES)), max_bytes_(max_bytes),
+              workers_(workers), remaining_(input_bytes) {}
+
+        /**
+         * @param queued Chunks offloaded but not yet finished
+         * @return Memory budget of the next chunk
+         */
+        size_t next(size_t queued) const {
+            if (chunks_ < workers_ && queued < workers_) {
+                // Ramp up: double per chunk of the first round
+                return std::min<size_t>(max_bytes_, min_bytes_ << std::min<size_t>(chunks_, 20));
+            }
 
-        void* svc(void*) override {
-            if (eof_reached_) {
-                return nullptr; // End of stream
+            size_t target = max_bytes_;
+            if (read_rate_ > 0.0 && sort_rate_ > 0.0 &&
+                remaining_ / read_rate_ < max_bytes_ / sort_rate_) {
+                // Last wave: spread what is left across the workers
+                size_t share = static_cast<size_t>(remaining_ / workers_);
+                target = std::max(min_bytes_, std::min(target, share));
             }
+            return target;
+        }
+
+        // Records a chunk of `bytes` that took `seconds` to read
+        void observeRead(uint64_t bytes, double seconds) {
+            chunks_++;
+            remaining_ -= std::min(remaining_, bytes);
+            if (seconds > 0.0) blend(read_rate_, bytes / seconds);
+        }
+
+        // Records a worker sorting and spilling `bytes` in `seconds`
+        void observeSort(uint64_t bytes, double seconds) {
+            if (seconds > 0.0) blend(sort_rate_, bytes / seconds);
+        }
+
+        size_t chunks() const { return chunks_; }
+        double readRate() const { return read_rate_; }
+        double sortRate() const { return sort_rate_; }
+    };
+
+    /**
+     * Reads the input in chunks of records that are emitted to the farm as
+     * sort tasks. Each record is charged with its bytes plus the measured
+     * per-record cost of holding it in a chunk.
+     */
+    class ReaderEmitter {
+    private:
+        PieceReader& reader_;
+        bool eof_reached_ = false;
+        RecordPtr carry_;                   // Record that did not fit the last chunk
+
+    public:
+        ReaderEmitter(PieceReader& reader) : reader_(reader) {}
 
-            std::vector<RecordPtr>* records = new std::vector<RecordPtr>();
+        /**
+         * Reads the next chunk
+         * @param chunk_limit Memory the chunk may use
+         * @return Records of the chunk, or nullptr once the input is exhausted
+         */
+        std::vector<RecordPtr>* nextChunk(size_t chunk_limit) {
+            auto* records = new std::vector<RecordPtr>();
             size_t memory_used = 0;
-            bool continue_reading = true;
-
-            while (continue_reading) {
-                RecordPtr record;
-                bool read_success = false;
-
-                {
-                    std::lock_guard<std::mutex> lock(file_mutex_);
-                    try {
-                        if (!inFile_.eof()) {
-                            record = readRecord(inFile_);
-                            read_success = record.get() != nullptr;
-                        }
-
-                        if (inFile_.eof() || !read_success) {
-                            eof_reached_ = true;
-                            continue_reading = false;
-                        }
-                    } catch (const std::exception& e) {
-                        if (inFile_.eof()) {
-                            eof_reached_ = true;
-                            continue_reading = false;
-                        } else {
-                            std::cerr << "Error reading record: " << e.what() << std::endl;
-                            // Try to recover by seeking one byte forward
-                            inFile_.clear();
-                            inFile_.seekg(1, std::ios::cur);
-                        }
-                    }
-                }
 
-                if (read_success) {
-                    size_t record_size = record.size();
+            if (carry_.get()) {
+                memory_used += carry_.size() + CHUNK_RECORD_OVERHEAD;
+                records->push_back(std::move(carry_));
+            }
 
-                    // Check if adding this record would exceed memory limit
-                    if (memory_used + record_size > memory_limit_) {
-                        continue_reading = false;
-                    } else {
-                        records->push_back(std::move(record));
-                        memory_used += record_size;
-                    }
+            while (!eof_reached_) {
+                RecordPtr record = reader_.next();
+                if (!record.get()) {
+                    eof_reached_ = true;
+                    break;
                 }
-            }
 
-            // If we have no records but EOF is not reached, try again
-            if (records->empty() && !eof_reached_) {
-                delete records;
-                return GO_ON;
+                // A record that would exceed the limit starts the next chunk
+                size_t cost = record.size() + CHUNK_RECORD_OVERHEAD;
+                if (memory_used + cost > chunk_limit && !records->empty()) {
+                    carry_ = std::move(record);
+                    break;
+                }
+                memory_used += cost;
+                records->push_back(std::move(record));
             }
 
-            // If we have no records and EOF is reached, end the stream
             if (records->empty()) {
                 delete records;
                 return nullptr;
             }
-
             return records;
         }
     };
 
     /**
-     * FastFlow Worker for sorting chunks of data
+     * Cuts the mapped input into record-aligned slices that are emitted to
+     * the farm as sort tasks; a slice is charged with its bytes plus the
+     * key index the worker builds over it
      */
-    class SorterWorker : public ff::ff_node {
+    class SliceEmitter {
     private:
-        std::function<std::string()> getTempFileName_;
+        const MappedRange& mapped_;
+        uint64_t offset_;
 
     public:
-        SorterWorker(std::function<std::string()> getTempFileName) : getTempFileName_(getTempFileName) {}
+        SliceEmitter(const MappedRange& mapped)
+            : mapped_(mapped), offset_(mapped.begin()) {}
 
-        void* svc(void* task) override {
-            std::vector<RecordPtr>* records = static_cast<std::vector<RecordPtr>*>(task);
-            
-            // Sort the chunk in memory
-            if (!records->empty()) {
-                Timer timer("Worker in-memory sort");
-                std::sort(records->begin(), records->end(), 
-                          [](const RecordPtr& a, const RecordPtr& b) {
-                              return a.get()->key < b.get()->key;
-                          });
-                
-                // Write sorted chunk to a temporary file
-                std::string chunk_file = getTempFileName_();
-                std::ofstream outFile(chunk_file, std::ios::binary);
-                
-                if (!outFile) {
-                    std::cerr << "Cannot create temp file: " << chunk_file << std::endl;
-                    delete records;
-                    return nullptr;
-                }
-                
-                for (const auto& record : *records) {
-                    writeRecord(outFile, record);
+        /**
+         * Finds the next slice by walking record headers
+         * @param chunk_limit Memory the slice may use
+         * @return false once the input is exhausted
+         */
+        bool nextSlice(uint64_t& begin, uint64_t& end, size_t chunk_limit) {
+            begin = offset_;
+            size_t memory_used = 0;
+            while (offset_ + HEADER_SIZE <= mapped_.end()) {
+                uint32_t len;
+                std::memcpy(&len, mapped_.at(offset_) + sizeof(uint64_t), sizeof(uint32_t));
+                if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
+                    throw std::runtime_error("Invalid record length: " + std::to_string(len) +
+                                             " at offset " + std::to_string(offset_));
                 }
-                
-                outFile.close();
-                
-                // Return the chunk file name
-                delete records;
-                return new std::string(chunk_file);
+                uint64_t next = offset_ + HEADER_SIZE + len;
+                if (next > mapped_.end()) break;    // Truncated last record
+                size_t cost = HEADER_SIZE + len + sizeof(RecordView);
+                if (memory_used + cost > chunk_limit && offset_ > begin) break;
+                memory_used += cost;
+                offset_ = next;
             }
-            
-            delete records;
-            return nullptr;
+            end = offset_;
+            return end > begin;
         }
     };
+
+    /**
+     * Builds a key index over a record-aligned slice of the mapped input;
+     * nothing is copied to the heap
+     * @param mapped Input mapping
+     * @param begin First byte of the slice
+     * @param end One past the last byte of the slice
+     * @return Views of the slice's records in file order
+     */
+    static std::vector<RecordView> indexSlice(const MappedRange& mapped, uint64_t begin, uint64_t end) {
+        std::vector<RecordView> index;
+        for (uint64_t offset = begin; offset < end;) {
+            const char* header = mapped.at(offset);
+            uint64_t key;
+            uint32_t len;
+            std::memcpy(&key, header, sizeof(uint64_t));
+            std::memcpy(&len, header + sizeof(uint64_t), sizeof(uint32_t));
+            index.emplace_back(key, header + HEADER_SIZE, len);
+            offset += HEADER_SIZE + len;
+        }
+        return index;
+    }
+
+    /**
+     * Merges sorted key indexes pairwise, in log2(k) rounds
+     * @param indexes Sorted indexes (consumed)
+     * @return One sorted index
+     */
+    static std::vector<RecordView> mergeIndexes(std::vector<std::vector<RecordView>>& indexes) {
+        while (indexes.size() > 1) {
+            std::vector<std::vector<RecordView>> next;
+            for (size_t i = 0; i + 1 < indexes.size(); i += 2) {
+                std::vector<RecordView> merged;
+                merged.reserve(indexes[i].size() + indexes[i + 1].size());
+                std::merge(indexes[i].begin(), indexes[i].end(),
+                           indexes[i + 1].begin(), indexes[i + 1].end(), std::back_inserter(merged));
+                next.push_back(std::move(merged));
+            }
+            if (indexes.size() % 2 == 1) next.push_back(std::move(indexes.back()));
+            indexes = std::move(next);
+        }
+        return indexes.empty() ? std::vector<RecordView>() : std::move(indexes.front());
+    }
+
     /**
-     * FastFlow Collector for gathering sorted chunk filenames
+     * FastFlow Worker executing sort and merge tasks. Sorted chunks stay
+     * resident up to the worker's memory limit and are written as one
+     * pre-merged run, so the run count follows the memory limit rather
+     * than the number of chunks.
      */
-    class FilenameCollector : public ff::ff_node {
+    class TaskWorker : public ff::ff_node {
     private:
-        std::vector<std::string>& chunk_files_;
+        FastFlowMergeSort* sorter_;
+
+        // Sorted chunks held by this worker; records are null for mapped slices
+        std::vector<std::unique_ptr<std::vector<RecordPtr>>> resident_records_;
+        std::vector<std::vector<RecordView>> resident_indexes_;
+        uint64_t resident_bytes_ = 0;
+        size_t flushes_ = 0;
+
+        /**
+         * Writes the resident chunks as one merged run
+         * @param run_file Output run path
+         * @return Bytes written
+         */
+        uint64_t flushResident(const std::string& run_file) {
+            std::vector<RecordView> merged = mergeIndexes(resident_indexes_);
+            AsyncWriter writer(run_file, RUN_STAGING_BYTES);
+            if (sorter_->permutation_input_.empty()) {
+                gatherWrite(merged, writer);
+            } else {
+                writePermutation(merged, *sorter_->input_map_, writer);
+            }
+            writer.close();
+
+            uint64_t bytes = resident_bytes_;
+            resident_indexes_.clear();
+            resident_records_.clear();
+            resident_bytes_ = 0;
+            return bytes;
+        }
+
+        // Sorts a chunk into a key index that keeps its records alive
+        void sortChunk(FarmTask* task, std::vector<RecordView>& index, uint64_t& bytes) {
+            if (task->kind == FarmTask::Kind::Sort) {
+                inMemorySort(*task->records);
+                index.reserve(task->records->size());
+                for (const auto& record : *task->records) {
+                    index.emplace_back(record.get()->key, record.data() + HEADER_SIZE, record.get()->len);
+                    bytes += record.size();
+                }
+            } else if (task->kind == FarmTask::Kind::SortColumns) {
+                const std::vector<RecordView>& views = sorter_->input_columns_->views;
+                index.assign(views.begin() + task->begin, views.begin() + task->end);
+                std::sort(index.begin(), index.end());
+                for (const auto& v : index) bytes += HEADER_SIZE + v.len;
+            } else {
+                index = indexSlice(*sorter_->input_map_, task->begin, task->end);
+                Timer timer("Worker key-index sort");
+                std::sort(index.begin(), index.end());
+                bytes = task->end - task->begin;
+            }
+        }
 
     public:
-        FilenameCollector(std::vector<std::string>& chunk_files) : chunk_files_(chunk_files) {}
+        TaskWorker(FastFlowMergeSort* sorter) : sorter_(sorter) {}
 
-        void* svc(void* task) override {
-            std::string* filename = static_cast<std::string*>(task);
-            if (filename) {
-                chunk_files_.push_back(*filename);
-                delete filename;
+        void* svc(void* t) override {
+            FarmTask* task = static_cast<FarmTask*>(t);
+            auto start = std::chrono::high_resolution_clock::now();
+
+            try {
+                if (task->kind == FarmTask::Kind::Merge) {
+                    sorter_->kWayMerge(task->inputs, task->output, task->format);
+                    for (const auto& file : task->inputs) {
+                        task->bytes += storage().fileSize(file);
+                        if (!task->keep_inputs) storage().remove(file);
+                    }
+                } else {
+                    std::vector<RecordView> index;
+                    uint64_t bytes = 0;
+                    sortChunk(task, index, bytes);
+
+                    // A chunk that does not fit next to the resident ones
+                    // pushes them out as a run under this task's name
+                    if (resident_bytes_ + bytes > sorter_->resident_limit_ && !resident_indexes_.empty()) {
+                        task->bytes = flushResident(task->output);
+                    } else {
+                        task->output.clear();
+                    }
+
+                    resident_indexes_.push_back(std::move(index));
+                    resident_records_.emplace_back(task->records);
+                    task->records = nullptr;
+                    resident_bytes_ += bytes;
+                    task->sorted_bytes = bytes;
+                }
+            } catch (const std::exception& e) {
+                task->error = e.what();
+            }
+
+            delete task->records;
+            task->records = nullptr;
+            task->seconds = std::chrono::duration<double>(
+                std::chrono::high_resolution_clock::now() - start).count();
+            return task;
+        }
+
+        // End of a run generation phase: the resident chunks become a run
+        void eosnotify(ssize_t) override {
+            if (sorter_->discard_resident_) {
+                resident_indexes_.clear();
+                resident_records_.clear();
+                resident_bytes_ = 0;
+            }
+            if (resident_indexes_.empty()) return;
+
+            FarmTask* task = new FarmTask(FarmTask::Kind::Sort);
+            task->output = sorter_->temp_dir_ + "/resident_" + std::to_string(get_my_id()) +
+                           "_" + std::to_string(flushes_++) + ".tmp";
+            try {
+                task->bytes = flushResident(task->output);
+            } catch (const std::exception& e) {
+                task->error = e.what();
             }
-            return GO_ON;
+            ff_send_out(task);
         }
     };
 
     /**
-     * Partitions the input file into sorted chunks that fit in memory using FastFlow farm
-     * @param input_file Input file path
-     * @return Vector of paths to sorted chunk files
+     * FastFlow Collector returning finished tasks to the offloading thread
      */
-    std::vector<std::string> partitionIntoSortedChunks(const std::string& input_file) {
-        Timer timer("FastFlow partitioning into sorted chunks");
-        
-        std::vector<std::string> chunk_files;
-        
-        // Calculate maximum records per chunk based on memory limit
-        size_t avg_record_size = sizeof(Record) + 128; // Assume average payload of 128 bytes initially
-        size_t max_records_per_chunk = memory_limit_ / avg_record_size / 2; // Conservative allocation
-        
-        // Open input file
-        std::ifstream inFile(input_file, std::ios::binary);
-        if (!inFile) {
-            throw std::runtime_error("Cannot open input file: " + input_file);
+    class ResultCollector : public ff::ff_node {
+    public:
+        void* svc(void* task) override {
+            return task;
         }
-        
-        // Set up FastFlow farm
-        std::atomic<bool> eof_reached(false);
-        
-        // Use a lambda to capture this pointer for getNextTempFileName
-        auto getTempFileNameWrapper = [this]() { return this->getNextTempFileName(); };
-        
-        ReaderEmitter emitter(inFile, memory_limit_, eof_reached);
-        FilenameCollector collector(chunk_files);
-        
+    };
+
+    /**
+     * Builds the accelerator farm once; it is started and frozen per sort
+     */
+    void buildFarm() {
+        farm_ = std::make_unique<ff::ff_farm>(true);   // accelerator mode
+
         std::vector<ff::ff_node*> workers;
         for (unsigned i = 0; i < num_workers_; ++i) {
-            workers.push_back(new SorterWorker(getTempFileNameWrapper));
+            farm_nodes_.push_back(std::make_unique<TaskWorker>(this));
+            workers.push_back(farm_nodes_.back().get());
         }
-        
-        ff::ff_farm farm;
-        farm.add_emitter(&emitter);
-        farm.add_workers(workers);
-        farm.add_collector(&collector);
-        
-        if (farm.run_and_wait_end() < 0) {
+        farm_nodes_.push_back(std::make_unique<ResultCollector>());
+
+        farm_->add_workers(workers);
+        farm_->add_collector(farm_nodes_.back().get());
+        farm_->set_scheduling_ondemand();
+
+        // Bounded channels: the offloading thread never has more than
+        // task_limit_ tasks out, plus one resident run per worker at EOS
+        const int entries = static_cast<int>(task_limit_ + num_workers_);
+        farm_->setFixedSize(true);
+        farm_->setInputQueueLength(entries, true);
+        farm_->setOutputQueueLength(entries, true);
+    }
+
+    void startFarm() {
+        if (farm_->run_then_freeze() < 0) {
             throw std::runtime_error("FastFlow farm execution failed");
         }
-        
-        // Cleanup workers
-        for (auto worker : workers) {
-            delete worker;
+    }
+
+    void stopFarm() {
+        discard_resident_ = true;
+        farm_->offload(FF_EOS);
+        void* result = nullptr;
+        while (farm_->load_result(&result)) {
+            delete static_cast<FarmTask*>(result);
         }
-        
-        inFile.close();
-        return chunk_files;
+        farm_->wait_freezing();
+        outstanding_ = 0;
+    }
+
+    /**
+     * Ends run generation: an EOS makes every worker write its resident
+     * chunks as a final run, then the farm is restarted for merging
+     * @return Paths and sizes of the runs the workers wrote
+     */
+    std::vector<std::pair<std::string, uint64_t>> flushResidentRuns() {
+        std::vector<std::pair<std::string, uint64_t>> runs;
+        std::string error;
+
+        discard_resident_ = false;
+        farm_->offload(FF_EOS);
+        void* result = nullptr;
+        while (farm_->load_result(&result)) {
+            FarmTask* task = static_cast<FarmTask*>(result);
+            if (!task->error.empty()) error = task->error;
+            else runs.emplace_back(task->output, task->bytes);
+            delete task;
+        }
+        farm_->wait_freezing();
+        startFarm();
+
+        if (!error.empty()) throw std::runtime_error(error);
+        return runs;
+    }
+
+    void offload(FarmTask* task) {
+        farm_->offload(task);
+        outstanding_++;
+    }
+
+    /**
+     * Collects one finished task from the farm
+     * @param block Wait for a result if none is ready
+     * @return The finished task, or nullptr if none was ready
+     */
+    FarmTask* collect(bool block) {
+        void* result = nullptr;
+        bool got = block ? farm_->load_result(&result) : farm_->load_result_nb(&result);
+        if (!got) return nullptr;
+        outstanding_--;
+
+        FarmTask* task = static_cast<FarmTask*>(result);
+        if (!task->error.empty()) {
+            std::string error = task->error;
+            delete task;
+            throw std::runtime_error(error);
+        }
+        return task;
+    }
+
+    FarmTask* makeMergeTask(std::vector<std::string> inputs, const std::string& output,
+                            bool keep_inputs = false) {
+        FarmTask* task = new FarmTask(FarmTask::Kind::Merge);
+        task->inputs = std::move(inputs);
+        task->output = output;
+        task->keep_inputs = keep_inputs;
+        return task;
+    }
+
+    /**
+     * Size tier of a run: tier t holds runs of up to memory_limit * K^t bytes,
+     * so merging K runs of one tier yields roughly a run of the next
+     * @param bytes Size of the run
+     * @return Tier index
+     */
+    size_t tierOf(uint64_t bytes) const {
+        size_t tier = 0;
+        for (uint64_t cap = memory_limit_; bytes > cap && tier < 32; cap *= MERGE_FAN_IN) {
+            tier++;
+        }
+        return tier;
+    }
+
+    /**
+     * Generates sorted runs by offloading chunks to the farm. A tier that
+     * collects MERGE_FAN_IN finished runs is immediately offloaded as a merge
+     * whose result lands in a higher tier, possibly cascading further
+     * @param input_file Input file path
+     * @param begin First byte read when neither input_map_ nor input_columns_ is set
+     * @param end End of the bytes read when neither input_map_ nor input_columns_ is set
+     * @return Paths of the remaining sorted runs once all tasks finished
+     */
+    std::vector<std::string> partitionIntoSortedChunks(const std::string& input_file, uint64_t begin,
+                                                       uint64_t end) {
+        Timer timer("FastFlow partitioning into sorted chunks");
+
+        // Finished runs not being merged, by size tier
+        std::vector<std::vector<std::string>> tiers;
+        size_t early_merges = 0;
+
+        std::vector<InputPiece> pieces = input_pieces_;
+        if (pieces.empty()) {
+            end = std::min<uint64_t>(end, storage().fileSize(input_file));
+            pieces.push_back({input_file, begin, std::max(begin, end)});
+        }
+        uint64_t input_bytes = pieceBytes(pieces);
+        if (input_map_) input_bytes = input_map_->end() - input_map_->begin();
+        if (input_columns_) {
+            input_bytes = input_columns_->views.size() * HEADER_SIZE + payloadBytes(input_columns_->views);
+        }
+        ChunkSizer sizer(chunk_limit_, num_workers_, input_bytes);
+        size_t sorts_in_flight = 0;
+        size_t in_flight_bytes = 0;
+        std::deque<FarmTask*> pending_merges;   // Waiting for a free task slot
+
+        // Occupancy statistics reported over time
+        auto phase_start = std::chrono::high_resolution_clock::now();
+        double next_report = QUEUE_REPORT_INTERVAL;
+        double blocked_seconds = 0.0;
+        size_t peak_chunks = 0, peak_bytes = 0;
+
+        auto elapsed = [&] {
+            return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - phase_start).count();
+        };
+
+        auto onFinished = [&](FarmTask* task) {
+            if (task->kind != FarmTask::Kind::Merge) {
+                sizer.observeSort(task->sorted_bytes, task->seconds);
+                sorts_in_flight--;
+                in_flight_bytes -= task->charge;
+            }
+            if (task->output.empty()) {
+                // Chunk kept resident by its worker
+                delete task;
+                return;
+            }
+
+            size_t tier = tierOf(task->bytes);
+            if (tier >= tiers.size()) tiers.resize(tier + 1);
+            tiers[tier].push_back(task->output);
+
+            if (tiers[tier].size() >= MERGE_FAN_IN) {
+                pending_merges.push_back(makeMergeTask(std::move(tiers[tier]), getNextTempFileName()));
+                tiers[tier].clear();
+                early_merges++;
+            }
+            delete task;
+        };
+
+        auto dispatchMerges = [&] {
+            while (!pending_merges.empty() && outstanding_ < task_limit_) {
+                offload(pending_merges.front());
+                pending_merges.pop_front();
+            }
+        };
+
+        // Backpressure: wait for sorted chunks until the next one fits in flight
+        auto reserve = [&](size_t chunk_bytes) {
+            auto start = std::chrono::high_resolution_clock::now();
+            while (sorts_in_flight > 0 &&
+                   (in_flight_bytes + chunk_bytes > in_flight_limit_ ||
+                    sorts_in_flight >= IN_FLIGHT_CHUNKS * num_workers_ ||
+                    outstanding_ >= task_limit_)) {
+                onFinished(collect(true));
+                dispatchMerges();
+            }
+            blocked_seconds += std::chrono::duration<double>(
+                std::chrono::high_resolution_clock::now() - start).count();
+        };
+
+        auto emit = [&](FarmTask* task, uint64_t bytes, double read_seconds, size_t charge) {
+            sizer.observeRead(bytes, read_seconds);
+            task->output = getNextTempFileName();
+            task->charge = charge;
+            offload(task);
+            sorts_in_flight++;
+            in_flight_bytes += charge;
+            peak_chunks = std::max(peak_chunks, sorts_in_flight);
+            peak_bytes = std::max(peak_bytes, in_flight_bytes);
+
+            // Pick up whatever finished meanwhile without stalling the reader
+            while (FarmTask* done = collect(false)) {
+                onFinished(done);
+            }
+            dispatchMerges();
+
+            if (elapsed() >= next_report) {
+                std::cout << "[" << std::fixed << std::setprecision(1) << elapsed() << "s] in flight: "
+                          << sorts_in_flight << " chunks, " << in_flight_bytes / MB << " MB; farm tasks: "
+                          << outstanding_ << "/" << task_limit_ << "; merges waiting: "
+                          << pending_merges.size() << std::endl;
+                next_report += QUEUE_REPORT_INTERVAL;
+            }
+        };
+
+        if (input_columns_) {
+            // Slices of the key index; the cost counts the payloads gathered later
+            const std::vector<RecordView>& views = input_columns_->views;
+            for (size_t next = 0; next < views.size();) {
+                size_t chunk_bytes = sizer.next(sorts_in_flight);
+                reserve(chunk_bytes);
+
+                FarmTask* task = new FarmTask(FarmTask::Kind::SortColumns);
+                task->begin = next;
+                uint64_t bytes = 0;
+                size_t memory_used = 0;
+                for (; next < views.size(); ++next) {
+                    size_t cost = HEADER_SIZE + views[next].len + sizeof(RecordView);
+                    if (memory_used + cost > chunk_bytes && next > task->begin) break;
+                    memory_used += cost;
+                    bytes += HEADER_SIZE + views[next].len;
+                }
+                task->end = next;
+                emit(task, bytes, 0.0, chunk_bytes);
+            }
+        } else if (input_map_) {
+            SliceEmitter slices(*input_map_);
+            for (;;) {
+                size_t chunk_bytes = sizer.next(sorts_in_flight);
+                reserve(chunk_bytes);
+
+                auto start = std::chrono::high_resolution_clock::now();
+                FarmTask* task = new FarmTask(FarmTask::Kind::SortSlice);
+                if (!slices.nextSlice(task->begin, task->end, chunk_bytes)) {
+                    delete task;
+                    break;
+                }
+                emit(task, task->end - task->begin, std::chrono::duration<double>(
+                    std::chrono::high_resolution_clock::now() - start).count(), chunk_bytes);
+            }
+        } else {
+            PieceReader input(std::move(pieces));
+            ReaderEmitter reader(input);
+            for (;;) {
+                size_t chunk_bytes = sizer.next(sorts_in_flight);
+                reserve(chunk_bytes);
+
+                auto start = std::chrono::high_resolution_clock::now();
+                std::vector<RecordPtr>* chunk = reader.nextChunk(chunk_bytes);
+                if (!chunk) break;
+
+                uint64_t bytes = 0;
+                for (const auto& record : *chunk) bytes += record.size();
+                FarmTask* task = new FarmTask(FarmTask::Kind::Sort);
+                task->records = chunk;
+                emit(task, bytes, std::chrono::duration<double>(
+                    std::chrono::high_resolution_clock::now() - start).count(), chunk_bytes);
+            }
+        }
+
+        while (outstanding_ > 0 || !pending_merges.empty()) {
+            dispatchMerges();
+            onFinished(collect(true));
+        }
+
+        for (const auto& run : flushResidentRuns()) {
+            size_t tier = tierOf(run.second);
+            if (tier >= tiers.size()) tiers.resize(tier + 1);
+            tiers[tier].push_back(run.first);
+        }
+
+        // Largest runs first so the final merge reads them in tier order
+        std::vector<std::string> runs;
+        for (size_t t = tiers.size(); t-- > 0;) {
+            runs.insert(runs.end(), tiers[t].begin(), tiers[t].end());
+        }
+        std::cout << "Generated " << sizer.chunks() << " chunks (read "
+                  << static_cast<uint64_t>(sizer.readRate() / MB) << " MB/s, sort "
+                  << static_cast<uint64_t>(sizer.sortRate() / MB) << " MB/s per worker)" << std::endl;
+        std::cout << "Backpressure: reader blocked " << static_cast<uint64_t>(blocked_seconds * 1000)
+                  << " ms; peak in flight " << peak_chunks << " chunks, " << peak_bytes / MB
+                  << " MB of " << in_flight_limit_ / MB << " MB" << std::endl;
+        std::cout << "Merged " << early_merges << " groups during run generation, "
+                  << runs.size() << " runs left for the final merge" << std::endl;
+        return runs;
     }
 
     /**
      * Merge k sorted files using a priority queue
      * @param input_files Vector of paths to sorted input files
      * @param output_file Path to the output file to write merged results
+     * @param format Layout of the output, encoded as it is merged
      */
-    void kWayMerge(const std::vector<std::string>& input_files, const std::string& output_file) {
-        if (input_files.empty()) {
-            std::ofstream empty_out(output_file, std::ios::binary);
+    void kWayMerge(const std::vector<std::string>& input_files, const std::string& output_file,
+                   OutputFormat format = OutputFormat::Raw) {
+        if (input_files.empty() && format == OutputFormat::Raw) {
+            storage().open(output_file, OpenMode::Write);
             return;
         }
         
-        if (input_files.size() == 1) {
+        if (input_files.size() == 1 && format == OutputFormat::Raw) {
             // If only one file, just copy it
-            fs::copy_file(input_files[0], output_file, fs::copy_options::overwrite_existing);
+            copyFile(input_files[0], output_file);
             return;
         }
         
         Timer timer("K-way merge of " + std::to_string(input_files.size()) + " files");
         
+        if (!permutation_input_.empty()) {
+            mergePermutations(input_files, output_file, permutation_input_);
+            return;
+        }
+
         // Structure to keep track of records from different files
  struct FileRecord {
     RecordPtr record;
     size_t file_index;
+    uint64_t prefix;    // sortPrefix() of the record; full records compared only on ties
 
     // Constructor for inserting into the priority queue
-    FileRecord(RecordPtr rec, size_t idx) : record(std::move(rec)), file_index(idx) {}
+    FileRecord(RecordPtr rec, size_t idx)
+        : record(std::move(rec)), file_index(idx),
+          prefix(sortPrefix(record.get()->key, record.get()->payload)) {}
 
     bool operator>(const FileRecord& other) const {
-        return record.get()->key > other.record.get()->key;
+        if (prefix != other.prefix) return prefix > other.prefix;
+        return wideKeyBytes() && recordLess(other.record.get(), record.get());
     }
 
     FileRecord(const FileRecord&) = default;
@@ -291,177 +853,494 @@ private:
         std::priority_queue<FileRecord, std::vector<FileRecord>, std::greater<FileRecord>> pq;
         
         // Open all input files
-        std::vector<std::unique_ptr<std::ifstream>> input_streams;
+        std::vector<std::unique_ptr<RangeReader>> readers;
         for (const auto& file : input_files) {
-            auto stream = std::make_unique<std::ifstream>(file, std::ios::binary);
-            if (!*stream) {
-                throw std::runtime_error("Cannot open input file for merging: " + file);
-            }
-            input_streams.push_back(std::move(stream));
+            readers.push_back(std::make_unique<RangeReader>(file, 0, UINT64_MAX, MERGE_READ_BYTES));
         }
         
         // Initialize priority queue with first record from each file
-        for (size_t i = 0; i < input_streams.size(); ++i) {
-            try {
-                RecordPtr record = readRecord(*input_streams[i]);
-                if (record.get() != nullptr) {
-                    pq.push(FileRecord(std::move(record), i));
-                }
-            } catch (const std::exception& e) {
-                std::cerr << "Error reading initial record from file " << i << ": " << e.what() << std::endl;
+        for (size_t i = 0; i < readers.size(); ++i) {
+            RecordPtr record = readers[i]->next();
+            if (record.get() != nullptr) {
+                pq.push(FileRecord(std::move(record), i));
             }
         }
         
-        // Open output file
-        std::ofstream outFile(output_file, std::ios::binary);
-        if (!outFile) {
-            throw std::runtime_error("Cannot create output file for merging: " + output_file);
-        }
+        AsyncWriter writer(output_file, RUN_STAGING_BYTES, outputSink(output_file, format));
+        RecordBuffer buffer;
         
         // Merge records
         while (!pq.empty()) {
             FileRecord fr = std::move(const_cast<FileRecord&>(pq.top()));
             pq.pop();
             
-            // Write the smallest record to output
-            writeRecord(outFile, fr.record);
+            // Stage the smallest record for the writer
+            writer.append(buffer, fr.record.data(), fr.record.size());
             
             // Read next record from the same file
-            try {
-                RecordPtr next_record = readRecord(*input_streams[fr.file_index]);
-                if (next_record.get() != nullptr) {
-                    pq.push(FileRecord(std::move(next_record), fr.file_index));
+            RecordPtr next_record = readers[fr.file_index]->next();
+            if (next_record.get() != nullptr) {
+                pq.push(FileRecord(std::move(next_record), fr.file_index));
+            }
+        }
+        
+        writer.flush(buffer);
+        writer.close();
+    }
+
+    /**
+     * Merges multiple sorted chunks level by level on the accelerator farm
+     * @param chunk_files Vector of paths to sorted chunk files
+     * @param output_file Path to the output file for the merged result
+     * @param keep_inputs Leave chunk_files in place; only the intermediate
+     *                    runs created here are consumed
+     * @param format Layout of the output file
+     */
+    void fastflowHierarchicalMerge(std::vector<std::string> chunk_files, const std::string& output_file,
+                                   bool keep_inputs = false, OutputFormat format = OutputFormat::Raw) {
+        Timer timer("FastFlow hierarchical merge");
+
+        // Each level merges groups of at most MERGE_FAN_IN files in parallel
+        while (chunk_files.size() > MERGE_FAN_IN) {
+            size_t num_groups = std::ceil(static_cast<double>(chunk_files.size()) / MERGE_FAN_IN);
+
+            std::vector<std::string> merged;
+            for (size_t i = 0; i < num_groups; ++i) {
+                size_t start_idx = i * MERGE_FAN_IN;
+                size_t end_idx = std::min((i + 1) * MERGE_FAN_IN, chunk_files.size());
+                std::vector<std::string> group(chunk_files.begin() + start_idx,
+                                               chunk_files.begin() + end_idx);
+
+                // Stay within the bounded channels
+                while (outstanding_ >= task_limit_) {
+                    FarmTask* done = collect(true);
+                    merged.push_back(done->output);
+                    delete done;
                 }
-            } catch (const std::exception& e) {
-                if (!input_streams[fr.file_index]->eof()) {
-                    std::cerr << "Error reading next record: " << e.what() << std::endl;
+                offload(makeMergeTask(std::move(group), getNextTempFileName(), keep_inputs));
+            }
+
+            while (outstanding_ > 0) {
+                FarmTask* done = collect(true);
+                merged.push_back(done->output);
+                delete done;
+            }
+            chunk_files = std::move(merged);
+            keep_inputs = false;
+        }
+
+        // Last level writes straight to the output file
+        FarmTask* last = makeMergeTask(std::move(chunk_files), output_file, keep_inputs);
+        last->format = format;
+        offload(last);
+        delete collect(true);
+    }
+
+    /**
+     * Runs the farm strategy: run generation with early merging, then the
+     * final merge; uses input_map_ or input_columns_ for zero-copy run
+     * generation when set
+     * @param input_file Input file path
+     * @param output_file Output file path
+     * @param begin First byte of the input read when input_map_ is not set
+     * @param end End of the input read when input_map_ is not set
+     * @param format Layout of the output file
+     */
+    void farmSort(const std::string& input_file, const std::string& output_file,
+                  uint64_t begin = 0, uint64_t end = UINT64_MAX, OutputFormat format = OutputFormat::Raw) {
+        startFarm();
+        try {
+            // Partition the input file into sorted chunks (early merges included)
+            std::vector<std::string> sorted_chunks = partitionIntoSortedChunks(input_file, begin, end);
+            input_map_.reset();
+            input_columns_.reset();
+
+            // Merge all remaining chunks into the final output
+            {
+                Timer merge_timer("Merging chunks");
+                fastflowHierarchicalMerge(sorted_chunks, output_file, false, format);
+            }
+
+            // Clean up sorted chunks
+            for (const auto& chunk : sorted_chunks) {
+                storage().remove(chunk);
+            }
+        } catch (...) {
+            // Workers may still read the mapping until the farm is drained
+            stopFarm();
+            input_map_.reset();
+            input_columns_.reset();
+            throw;
+        }
+        stopFarm();
+    }
+
+    /**
+     * Runs the farm over a mapped byte range writing {key, input offset}
+     * entries instead of records; payloads never leave the mapping
+     * @param input_file Raw input file path
+     * @param begin First byte of the range
+     * @param end One past the last byte of the range
+     * @param output_file Path of the permutation
+     */
+    void permutationSort(const std::string& input_file, uint64_t begin, uint64_t end,
+                         const std::string& output_file) {
+        requirePermutableInput(input_file);
+        input_map_ = std::make_unique<MappedRange>(input_file, begin, end);
+        permutation_input_ = input_file;
+        try {
+            farmSort(input_file, output_file);
+        } catch (...) {
+            permutation_input_.clear();
+            throw;
+        }
+        permutation_input_.clear();
+    }
+
+    // Reader splits and key splitters for the key-range strategy
+    struct RangePlan {
+        std::vector<uint64_t> reader_splits;    // readers + 1 record-aligned offsets
+        std::vector<uint64_t> key_splitters;    // ranges - 1 sort prefixes; range i holds prefixes <= splitter i
+    };
+
+    /**
+     * Finds record-aligned reader ranges and samples keys from up to
+     * RAW_SAMPLE_WINDOWS windows spread over the file, choosing splitters
+     * that balance the sampled bytes. Only the windows are read.
+     * @param input_file Input file path
+     * @param readers Number of reader ranges
+     * @param ranges Number of key ranges
+     * @param split How reader ranges are cut (see withRecordSplits)
+     * @return Reader splits and key splitters
+     */
+    static RangePlan planKeyRanges(const std::string& input_file, size_t readers, size_t ranges,
+                                   RecordSplitter split) {
+        Timer timer("Sampling key splitters");
+
+        ContainerInfo info;
+        if (isContainerFile(input_file, &info)) {
+            return planContainerKeyRanges(input_file, info, readers, ranges);
+        }
+        ColumnarInfo columnar;
+        if (isColumnarFile(input_file, &columnar)) {
+            return planColumnarKeyRanges(input_file, columnar, readers, ranges);
+        }
+
+        RangePlan plan;
+        plan.reader_splits = split(input_file, 0, UINT64_MAX, readers);
+
+        std::unique_ptr<StorageFile> file = storage().open(input_file, OpenMode::Read);
+        const uint64_t file_size = file->size();
+        const uint64_t windows = std::max<uint64_t>(1, std::min<uint64_t>(RAW_SAMPLE_WINDOWS,
+                                                                          file_size / RAW_SAMPLE_WINDOW_BYTES));
+        const bool whole_file = windows == 1;
+        std::vector<char> window(static_cast<size_t>(whole_file ? file_size : RAW_SAMPLE_WINDOW_BYTES));
+
+        // A window starting off a record boundary only skews the sample
+        std::vector<std::pair<uint64_t, uint32_t>> sample;
+        for (uint64_t w = 0; w < windows; ++w) {
+            const uint64_t begin = whole_file ? 0 : resyncRecordBoundary(*file, file_size * w / windows, file_size);
+            const size_t got = file->pread(window.data(), window.size(), begin);
+            for (size_t offset = 0; offset + HEADER_SIZE <= got; ) {
+                uint64_t key;
+                uint32_t len;
+                std::memcpy(&key, window.data() + offset, sizeof(uint64_t));
+                std::memcpy(&len, window.data() + offset + sizeof(uint64_t), sizeof(uint32_t));
+                if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
+                    if (!whole_file) break;
+                    throw std::runtime_error("Invalid record length: " + std::to_string(len) +
+                                             " at offset " + std::to_string(offset));
                 }
+                if (offset + HEADER_SIZE + len > got) break;
+                sample.emplace_back(sortPrefix(key, window.data() + offset + HEADER_SIZE), HEADER_SIZE + len);
+                offset += HEADER_SIZE + len;
             }
         }
-        
-        outFile.close();
+
+        chooseSplitters(sample, ranges, plan);
+        return plan;
+    }
+
+    /**
+     * Plans a block container: readers get block-aligned ranges and keys are
+     * sampled from up to CONTAINER_SAMPLE_BLOCKS blocks spread over the file
+     */
+    static RangePlan planContainerKeyRanges(const std::string& input_file, const ContainerInfo& info,
+                                            size_t readers, size_t ranges) {
+        RangePlan plan;
+        plan.reader_splits = blockAlignedSplits(info, 0, info.file_size, readers);
+
+        std::vector<std::pair<uint64_t, uint32_t>> sample;
+        const uint64_t picks = std::min<uint64_t>(info.blocks, CONTAINER_SAMPLE_BLOCKS);
+        for (uint64_t i = 0; i < picks; ++i) {
+            const uint64_t block = info.blocks * i / picks;
+            RangeReader reader(input_file, block * info.block_size, (block + 1) * info.block_size,
+                               info.block_size);
+            for (RecordPtr r = reader.next(); r.get(); r = reader.next()) {
+                sample.emplace_back(sortPrefix(r.get()->key, r.get()->payload), static_cast<uint32_t>(r.size()));
+            }
+        }
+        chooseSplitters(sample, ranges, plan);
+        return plan;
+    }
+
+    /**
+     * Plans a columnar input from its key column alone: reader ranges are
+     * entry-aligned and every SPLITTER_SAMPLE_STRIDE-th key is sampled.
+     * Wide keys are read from the heap batch by batch.
+     */
+    static RangePlan planColumnarKeyRanges(const std::string& input_file, const ColumnarInfo& info,
+                                           size_t readers, size_t ranges) {
+        RangePlan plan;
+        plan.reader_splits = entryAlignedSplits(info, 0, info.entryOffset(info.records), readers);
+
+        std::vector<std::pair<uint64_t, uint32_t>> sample;
+        uint64_t heap_offset = 0;
+        for (uint64_t first = 0; first < info.records; first += KEY_COLUMN_BATCH) {
+            const uint64_t count = std::min<uint64_t>(KEY_COLUMN_BATCH, info.records - first);
+            if (wideKeyBytes()) {
+                // Wide keys live in the payloads: map this batch's heap range
+                ColumnarIndex batch = loadColumnarIndex(input_file, info, first, count, heap_offset);
+                heap_offset += payloadBytes(batch.views);
+                for (size_t i = 0; i < batch.views.size(); i += SPLITTER_SAMPLE_STRIDE) {
+                    sample.emplace_back(batch.views[i].prefix, HEADER_SIZE + batch.views[i].len);
+                }
+                continue;
+            }
+            std::vector<RecordView> keys = readKeyColumn(input_file, info, first, count);
+            for (size_t i = 0; i < keys.size(); i += SPLITTER_SAMPLE_STRIDE) {
+                sample.emplace_back(keys[i].key, HEADER_SIZE + keys[i].len);
+            }
+        }
+        chooseSplitters(sample, ranges, plan);
+        return plan;
+    }
+
+    /**
+     * Picks ranges - 1 splitters at equal shares of the sampled bytes
+     * @param sample (key, record bytes) pairs; sorted in place
+     */
+    static void chooseSplitters(std::vector<std::pair<uint64_t, uint32_t>>& sample, size_t ranges,
+                                RangePlan& plan) {
+        std::sort(sample.begin(), sample.end());
+        uint64_t sampled_bytes = 0;
+        for (const auto& s : sample) sampled_bytes += s.second;
+
+        uint64_t seen = 0;
+        size_t s = 0;
+        for (size_t r = 1; r < ranges && !sample.empty(); ++r) {
+            const uint64_t target = sampled_bytes * r / ranges;
+            while (s + 1 < sample.size() && seen + sample[s].second <= target) {
+                seen += sample[s++].second;
+            }
+            plan.key_splitters.push_back(sample[s].first);
+        }
     }
 
     /**
-     * FastFlow Worker for chunk merging tasks
+     * Writes records to a run file
+     * @param path Output path
+     * @param records Sorted records
      */
-    class MergeWorker : public ff::ff_node {
+    static void writeRun(const std::string& path, const std::vector<RecordPtr>& records) {
+        AsyncWriter writer(path, RUN_STAGING_BYTES);
+        gatherWrite(records, writer);
+        writer.close();
+    }
+
+    /**
+     * FastFlow a2a left node: reads a record-aligned byte range and routes
+     * each record to the worker owning its key range
+     */
+    class KeyRouter : public ff::ff_monode_t<std::vector<RecordPtr>> {
     private:
-        std::function<std::string()> getTempFileName_;
-        FastFlowMergeSort* sorter_;
+        const std::string& input_file_;
+        uint64_t begin_, end_;
+        const std::vector<uint64_t>& splitters_;
+        std::string error_;
+        bool misaligned_ = false;           // The range ended off a record boundary
 
     public:
-        MergeWorker(std::function<std::string()> getTempFileName, FastFlowMergeSort* sorter) 
-            : getTempFileName_(getTempFileName), sorter_(sorter) {}
+        KeyRouter(const std::string& input_file, uint64_t begin, uint64_t end,
+                  const std::vector<uint64_t>& splitters)
+            : input_file_(input_file), begin_(begin), end_(end), splitters_(splitters) {}
 
-        void* svc(void* task) override {
-            auto* chunk_group = static_cast<std::vector<std::string>*>(task);
-            std::string merged_file = getTempFileName_();
-            
-            // Merge the chunk group
-            sorter_->kWayMerge(*chunk_group, merged_file);
-            
-            // Return the merged file name
-            delete chunk_group;
-            return new std::string(merged_file);
+        const std::string& error() const { return error_; }
+        bool misaligned() const { return misaligned_; }
+
+        std::vector<RecordPtr>* svc(std::vector<RecordPtr>*) override {
+            const size_t ranges = get_num_outchannels();
+            std::vector<std::vector<RecordPtr>*> batches(ranges, nullptr);
+            std::vector<size_t> batch_bytes(ranges, 0);
+
+            try {
+                RangeReader reader(input_file_, begin_, end_);
+                for (RecordPtr record = reader.next(); record.get(); record = reader.next()) {
+                    size_t r = std::lower_bound(splitters_.begin(), splitters_.end(),
+                                                sortPrefix(record.get()->key, record.get()->payload)) -
+                                splitters_.begin();
+                    if (!batches[r]) batches[r] = new std::vector<RecordPtr>();
+                    batch_bytes[r] += record.size();
+                    batches[r]->push_back(std::move(record));
+
+                    if (batch_bytes[r] >= ROUTE_BATCH_BYTES) {
+                        ff_send_out_to(batches[r], r);
+                        batches[r] = nullptr;
+                        batch_bytes[r] = 0;
+                    }
+                }
+            } catch (const MisalignedSplit& e) {
+                misaligned_ = true;
+                error_ = e.what();
+            } catch (const std::exception& e) {
+                error_ = e.what();
+            }
+
+            for (size_t r = 0; r < ranges; ++r) {
+                if (batches[r]) ff_send_out_to(batches[r], r);
+            }
+            return this->EOS;
         }
     };
 
     /**
-     * Merges multiple sorted chunks using FastFlow
-     * @param chunk_files Vector of paths to sorted chunk files
-     * @param output_file Path to the output file for the merged result
+     * FastFlow a2a right node: owns one key range, spills sorted runs when
+     * its memory limit is reached and writes the range's sorted part
      */
-    void fastflowHierarchicalMerge(const std::vector<std::string>& chunk_files, const std::string& output_file) {
-        Timer timer("FastFlow hierarchical merge");
-        
-        if (chunk_files.empty()) {
-            std::ofstream empty_out(output_file, std::ios::binary);
-            return;
+    class RangeSorter : public ff::ff_minode_t<std::vector<RecordPtr>> {
+    private:
+        FastFlowMergeSort* sorter_;
+        std::string part_file_;
+        size_t memory_limit_;
+        std::vector<RecordPtr> records_;
+        size_t bytes_ = 0;
+        std::vector<std::string> runs_;
+        std::string error_;
+
+        void spill() {
+            inMemorySort(records_);
+            std::string run = part_file_ + ".run" + std::to_string(runs_.size());
+            writeRun(run, records_);
+            runs_.push_back(run);
+            records_.clear();
+            bytes_ = 0;
         }
-        
-        if (chunk_files.size() == 1) {
-            fs::copy_file(chunk_files[0], output_file, fs::copy_options::overwrite_existing);
-            return;
+
+    public:
+        RangeSorter(FastFlowMergeSort* sorter, const std::string& part_file, size_t memory_limit)
+            : sorter_(sorter), part_file_(part_file), memory_limit_(memory_limit) {}
+
+        const std::string& error() const { return error_; }
+
+        std::vector<RecordPtr>* svc(std::vector<RecordPtr>* batch) override {
+            try {
+                for (auto& record : *batch) {
+                    if (bytes_ + record.size() > memory_limit_ && !records_.empty()) {
+                        spill();
+                    }
+                    bytes_ += record.size();
+                    records_.push_back(std::move(record));
+                }
+            } catch (const std::exception& e) {
+                error_ = e.what();
+            }
+            delete batch;
+            return this->GO_ON;
         }
-        
-        // Calculate maximum number of files to merge at once
-        const size_t K = 10; // Can be adjusted
-        
-        // If we have fewer chunks than K, merge them directly
-        if (chunk_files.size() <= K) {
-            kWayMerge(chunk_files, output_file);
-            return;
+
+        void svc_end() override {
+            try {
+                if (runs_.empty()) {
+                    // The whole range fit in memory: no merge needed
+                    inMemorySort(records_);
+                    writeRun(part_file_, records_);
+                } else {
+                    if (!records_.empty()) spill();
+                    sorter_->kWayMerge(runs_, part_file_);
+                    for (const auto& run : runs_) {
+                        storage().remove(run);
+                    }
+                }
+            } catch (const std::exception& e) {
+                error_ = e.what();
+            }
+            records_.clear();
+            records_.shrink_to_fit();
         }
-        
-        // Create groups of at most K files
-        size_t num_groups = std::ceil(static_cast<double>(chunk_files.size()) / K);
-        std::vector<std::vector<std::string>*> chunk_groups;
-        
-        for (size_t i = 0; i < num_groups; ++i) {
-            size_t start_idx = i * K;
-            size_t end_idx = std::min((i + 1) * K, chunk_files.size());
-            
-            auto* group = new std::vector<std::string>(
-                chunk_files.begin() + start_idx, 
-                chunk_files.begin() + end_idx
-            );
-            
-            chunk_groups.push_back(group);
+    };
+
+    /**
+     * Sorts by key-range partitioning on an ff_a2a: no global merge, the
+     * output is the concatenation of the ranges in key order
+     * @param input_file Input file path
+     * @param output_file Output file path
+     * @param format Layout of the output, encoded as the ranges are concatenated
+     */
+    void keyRangeSort(const std::string& input_file, const std::string& output_file, OutputFormat format) {
+        withRecordSplits([&](RecordSplitter split) {
+            keyRangeSort(input_file, output_file, split, format);
+        });
+    }
+
+    void keyRangeSort(const std::string& input_file, const std::string& output_file, RecordSplitter split,
+                      OutputFormat format) {
+        const size_t ranges = num_workers_;
+        const size_t readers = std::max(1u, num_workers_ / 4);
+        RangePlan plan = planKeyRanges(input_file, readers, ranges, split);
+
+        std::vector<std::unique_ptr<KeyRouter>> routers;
+        std::vector<std::unique_ptr<RangeSorter>> sorters;
+        std::vector<KeyRouter*> left;
+        std::vector<RangeSorter*> right;
+        std::vector<std::string> parts;
+
+        for (size_t i = 0; i < readers; ++i) {
+            routers.push_back(std::make_unique<KeyRouter>(input_file, plan.reader_splits[i],
+                                                          plan.reader_splits[i + 1], plan.key_splitters));
+            left.push_back(routers.back().get());
         }
-        
-        // Set up FastFlow farm for parallel merging
-        std::vector<std::string> intermediate_files;
-        
-        // Use a lambda to capture this pointer for getNextTempFileName
-        auto getTempFileNameWrapper = [this]() { return this->getNextTempFileName(); };
-        
-        // Custom emitter to distribute chunk groups
-        class GroupEmitter : public ff::ff_node {
-        private:
-            std::vector<std::vector<std::string>*>& groups_;
-            size_t current_idx_ = 0;
-            
-        public:
-            GroupEmitter(std::vector<std::vector<std::string>*>& groups) : groups_(groups) {}
-            
-            void* svc(void*) override {
-                if (current_idx_ >= groups_.size()) {
-                    return nullptr; // End of stream
-                }
-                return groups_[current_idx_++];
+        for (size_t r = 0; r < ranges; ++r) {
+            parts.push_back(temp_dir_ + "/range_" + std::to_string(r) + ".part");
+            sorters.push_back(std::make_unique<RangeSorter>(this, parts.back(), memory_limit_));
+            right.push_back(sorters.back().get());
+        }
+
+        {
+            Timer timer("FastFlow key-range partition and sort");
+            ff::ff_a2a a2a;
+            a2a.add_firstset(left);
+            a2a.add_secondset(right);
+            if (a2a.run_and_wait_end() < 0) {
+                throw std::runtime_error("FastFlow all-to-all execution failed");
             }
-        };
-        
-        // Set up FastFlow farm
-        GroupEmitter emitter(chunk_groups);
-        FilenameCollector collector(intermediate_files);
-        
-        std::vector<ff::ff_node*> workers;
-        for (unsigned i = 0; i < std::min(num_workers_, (unsigned)num_groups); ++i) {
-            workers.push_back(new MergeWorker(getTempFileNameWrapper, this));
         }
-        
-        ff::ff_farm farm;
-        farm.add_emitter(&emitter);
-        farm.add_workers(workers);
-        farm.add_collector(&collector);
-        
-        if (farm.run_and_wait_end() < 0) {
-            throw std::runtime_error("FastFlow merge farm execution failed");
+
+        for (size_t i = 0; i < readers; ++i) {
+            if (routers[i]->misaligned()) throw MisalignedSplit(plan.reader_splits[i + 1]);
         }
-        
-        // Cleanup workers
-        for (auto worker : workers) {
-            delete worker;
+        for (const auto& router : routers) {
+            if (!router->error().empty()) throw std::runtime_error(router->error());
         }
-        
-        // Recursively merge the intermediate files
-        fastflowHierarchicalMerge(intermediate_files, output_file);
-        
-        // Clean up intermediate files
-        for (const auto& file : intermediate_files) {
-            fs::remove(file);
+        for (const auto& sorter : sorters) {
+            if (!sorter->error().empty()) throw std::runtime_error(sorter->error());
+        }
+
+        Timer timer("Concatenating key ranges");
+        if (format != OutputFormat::Raw) {
+            // The ranges are encoded as they are concatenated
+            AsyncWriter writer(output_file, RUN_STAGING_BYTES, outputSink(output_file, format));
+            for (const auto& part : parts) {
+                streamFile(part, writer);
+                storage().remove(part);
+            }
+            writer.close();
+            return;
+        }
+        std::unique_ptr<StorageFile> outFile = storage().open(output_file, OpenMode::Write);
+        uint64_t offset = 0;
+        for (const auto& part : parts) {
+            offset += appendFile(part, *outFile, offset);
+            storage().remove(part);
         }
     }
 
@@ -469,19 +1348,34 @@ public:
     /**
      * Constructor
      * @param num_workers Number of FastFlow workers to use
+     * @param memory_budget Bytes of records held in memory across all workers
+     * @param strategy Farm plus merge, or key-range all-to-all
+     * @param zero_copy Generate runs from the mapped input (farm strategy)
+     * @param temp_dir Directory for temporary files, removed on destruction
      */
-    FastFlowMergeSort(unsigned num_workers)
-        : num_workers_(num_workers), 
-          temp_dir_("./ff_tmp"), 
-          file_id_(0) {
-        
-        // Calculate memory limit per worker
-        memory_limit_ = MAX_MEMORY_USAGE / num_workers_;
-        
+    FastFlowMergeSort(unsigned num_workers, size_t memory_budget = MAX_MEMORY_USAGE,
+                      FastFlowStrategy strategy = FastFlowStrategy::FarmMerge,
+                      bool zero_copy = false, const std::string& temp_dir = "./ff_tmp")
+        : num_workers_(num_workers),
+          temp_dir_(temp_dir),
+          file_id_(0),
+          strategy_(strategy),
+          zero_copy_(zero_copy) {
+
+        // Calculate memory limit per worker, split between sorted chunks it
+        // holds and chunks read for it but not yet sorted
+        memory_limit_ = memory_budget / num_workers_;
+        chunk_limit_ = memory_limit_ / (RESIDENT_CHUNKS + IN_FLIGHT_CHUNKS);
+        resident_limit_ = chunk_limit_ * RESIDENT_CHUNKS;
+        in_flight_limit_ = chunk_limit_ * IN_FLIGHT_CHUNKS * num_workers_;
+        task_limit_ = (IN_FLIGHT_CHUNKS + 1) * num_workers_;
+
         // Create temporary directory
         fs::create_directories(temp_dir_);
+
+        buildFarm();
     }
-    
+
     /**
      * Destructor - Clean up temporary files
      */
@@ -492,27 +1386,138 @@ public:
             std::cerr << "Error cleaning up temporary directory: " << e.what() << std::endl;
         }
     }
-    
+
     /**
      * Sort an input file using FastFlow parallelism
      * @param input_file Path to input file
      * @param output_file Path to output file where sorted data will be written
+     * @param format Layout of the output, written by the final merge
      */
-    void sort(const std::string& input_file, const std::string& output_file) {
+    void sort(const std::string& input_file, const std::string& output_file,
+              OutputFormat format = OutputFormat::Raw) {
         Timer timer("FastFlow sort total time");
-        
-        // Partition the input file into sorted chunks
-        std::vector<std::string> sorted_chunks = partitionIntoSortedChunks(input_file);
-        
-        // Merge all chunks into the final output
-        mergeChunks(sorted_chunks, output_file);
-        
-        // Clean up sorted chunks
-        for (const auto& chunk : sorted_chunks) {
-            fs::remove(chunk);
+
+        if (permutationOutputRequested()) {
+            // Entries are produced by the farm's zero-copy run generation
+            permutationSort(input_file, 0, UINT64_MAX, output_file);
+            return;
+        }
+        if (strategy_ == FastFlowStrategy::KeyRange) {
+            keyRangeSort(input_file, output_file, format);
+            return;
+        }
+
+        ColumnarInfo columnar;
+        if (isColumnarFile(input_file, &columnar)) {
+            sortColumns(input_file, columnar, 0, columnar.records, 0, output_file, format);
+            return;
+        }
+        if (zero_copy_ && isContainerFile(input_file)) {
+            std::cout << "Block container input: records are decoded, not mapped" << std::endl;
+        } else if (zero_copy_) {
+            input_map_ = std::make_unique<MappedRange>(input_file, 0, UINT64_MAX);
+        }
+        farmSort(input_file, output_file, 0, UINT64_MAX, format);
+    }
+
+    /**
+     * Sort records [first, first + count) of a columnar input: workers sort
+     * slices of the key column and payloads are only read from the mapped
+     * heap when runs are gathered
+     * @param input_file Path to the key column
+     * @param info Columnar layout of the input
+     * @param first First record of the range
+     * @param count Records in the range
+     * @param heap_base Heap offset of record `first`
+     * @param output_file Path to output file where sorted data will be written
+     * @param format Layout of the output
+     */
+    void sortColumns(const std::string& input_file, const ColumnarInfo& info, uint64_t first,
+                     uint64_t count, uint64_t heap_base, const std::string& output_file,
+                     OutputFormat format = OutputFormat::Raw) {
+        {
+            Timer timer("Loading key column");
+            input_columns_ = std::make_unique<ColumnarIndex>(
+                loadColumnarIndex(input_file, info, first, count, heap_base));
         }
+        farmSort(input_file, output_file, 0, UINT64_MAX, format);
     }
-    
+
+    /**
+     * Sort the record-aligned byte range [begin, end) of an input file with
+     * zero-copy run generation and the farm's merge, e.g. one MPI rank's slice.
+     * Block containers are decoded instead, the range owning whole blocks;
+     * for a columnar input the range is a byte range of the key column.
+     * @param input_file Path to input file
+     * @param begin First byte of the range
+     * @param end One past the last byte of the range (clamped to the file size)
+     * @param output_file Path to output file where sorted data will be written
+     */
+    void sortRange(const std::string& input_file, uint64_t begin, uint64_t end,
+                   const std::string& output_file) {
+        Timer timer("FastFlow range sort total time");
+
+        if (permutationOutputRequested()) {
+            permutationSort(input_file, begin, end, output_file);
+            return;
+        }
+        if (isContainerFile(input_file)) {
+            farmSort(input_file, output_file, begin, end);
+            return;
+        }
+        ColumnarInfo columnar;
+        if (isColumnarFile(input_file, &columnar)) {
+            const uint64_t first = columnar.recordAtOrAfter(begin);
+            const uint64_t last = std::max(first, end >= columnar.entryOffset(columnar.records)
+                                                      ? columnar.records : columnar.recordAtOrAfter(end));
+            sortColumns(input_file, columnar, first, last - first, heapOffsetOf(input_file, columnar, first),
+                        output_file);
+            return;
+        }
+        input_map_ = std::make_unique<MappedRange>(input_file, begin, end);
+        farmSort(input_file, output_file);
+    }
+
+    /**
+     * Sort the virtual concatenation of several raw record files with the
+     * farm strategy; the emitter reads them in turn and workers sort chunks
+     * @param input_files Paths of the input files
+     * @param output_file Path to output file where sorted data will be written
+     * @param format Layout of the output
+     */
+    void sortFiles(const std::vector<std::string>& input_files, const std::string& output_file,
+                   OutputFormat format = OutputFormat::Raw) {
+        Timer timer("FastFlow multi-file sort total time");
+        requireRawInputs(input_files);
+        if (permutationOutputRequested()) {
+            throw std::runtime_error("Permutation output needs a single input file");
+        }
+        sortPieces(wholeFiles(input_files), output_file, format);
+    }
+
+    /**
+     * Sort a list of record-aligned input pieces as one input, e.g. one MPI
+     * rank's bin of a multi-file input
+     * @param pieces Pieces read in order
+     * @param output_file Path to output file where sorted data will be written
+     * @param format Layout of the output
+     */
+    void sortPieces(const std::vector<InputPiece>& pieces, const std::string& output_file,
+                    OutputFormat format = OutputFormat::Raw) {
+        if (pieces.empty()) {
+            AsyncWriter(output_file, STAGING_BUFFER_SIZE, outputSink(output_file, format)).close();
+            return;
+        }
+        input_pieces_ = pieces;
+        try {
+            farmSort(pieces.front().path, output_file, 0, UINT64_MAX, format);
+        } catch (...) {
+            input_pieces_.clear();
+            throw;
+        }
+        input_pieces_.clear();
+    }
+
     /**
      * Merge a set of pre-sorted chunks
      * @param chunk_files Vector of paths to pre-sorted chunk files
@@ -520,10 +1525,17 @@ public:
      */
     void mergeChunks(const std::vector<std::string>& chunk_files, const std::string& output_file) {
         Timer timer("Merging chunks");
-        
-        // Use hierarchical merging to handle large numbers of chunks efficiently
-        fastflowHierarchicalMerge(chunk_files, output_file);
+
+        // The chunks belong to the caller; only intermediate runs are consumed
+        startFarm();
+        try {
+            fastflowHierarchicalMerge(chunk_files, output_file, true);
+        } catch (...) {
+            stopFarm();
+            throw;
+        }
+        stopFarm();
     }
 };
 
-#endif // FASTFLOW_SORT_HPP
\ No newline at end of file
+#endif // FASTFLOW_SORT_HPP
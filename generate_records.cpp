@@ -3,18 +3,78 @@
 #include <random>
 #include <vector>
 #include <cstdint>
+#include <cstring>
+#include <string>
 
 constexpr uint32_t PAYLOAD_MIN = 8;
 constexpr uint32_t PAYLOAD_MAX = 4096;
 
+// SortBenchmark layout: 10-byte random binary key, then the gensort filler
+// (0x00 0x11, 32 hex digits of the record number, 0x88 0x99 0xAA 0xBB,
+// 48 filler bytes, 0xCC 0xDD 0xEE 0xFF)
+constexpr size_t GENSORT_RECORD_SIZE = 100;
+constexpr size_t GENSORT_KEY_SIZE = 10;
+
+int generateGensort(const std::string& output_file, size_t num_records) {
+    std::ofstream out(output_file, std::ios::binary);
+    if (!out) {
+        std::cerr << "Failed to open output file: " << output_file << "\n";
+        return 1;
+    }
+
+    static const char hex[] = "0123456789ABCDEF";
+    std::mt19937_64 rng(42);  // fixed seed for reproducibility
+    std::vector<char> batch;
+    batch.reserve(4096 * GENSORT_RECORD_SIZE);
+
+    for (size_t i = 0; i < num_records; ++i) {
+        char record[GENSORT_RECORD_SIZE];
+        uint64_t bits = rng();
+        uint16_t more = static_cast<uint16_t>(rng());
+        std::memcpy(record, &bits, sizeof(bits));
+        std::memcpy(record + sizeof(bits), &more, sizeof(more));
+
+        char* p = record + GENSORT_KEY_SIZE;
+        *p++ = 0x00;
+        *p++ = 0x11;
+        for (int d = 31; d >= 0; --d) {
+            *p++ = d >= 16 ? '0' : hex[(i >> (4 * d)) & 0xF];
+        }
+        *p++ = static_cast<char>(0x88);
+        *p++ = static_cast<char>(0x99);
+        *p++ = static_cast<char>(0xAA);
+        *p++ = static_cast<char>(0xBB);
+        for (int f = 0; f < 48; ++f) {
+            *p++ = hex[(i + f / 4) & 0xF];
+        }
+        *p++ = static_cast<char>(0xCC);
+        *p++ = static_cast<char>(0xDD);
+        *p++ = static_cast<char>(0xEE);
+        *p++ = static_cast<char>(0xFF);
+
+        batch.insert(batch.end(), record, record + GENSORT_RECORD_SIZE);
+        if (batch.size() == batch.capacity()) {
+            out.write(batch.data(), batch.size());
+            batch.clear();
+        }
+    }
+    out.write(batch.data(), batch.size());
+
+    std::cout << " Generated " << num_records << " gensort records (100B, 10-byte keys).\n";
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     if (argc < 3 || argc > 4) {
-        std::cerr << "Usage: " << argv[0] << " <output_file> <num_records> [payload_size]\n";
+        std::cerr << "Usage: " << argv[0] << " <output_file> <num_records> [payload_size|gensort]\n";
         return 1;
     }
 
     std::string output_file = argv[1];
     size_t num_records = std::stoull(argv[2]);
+    if (argc == 4 && std::string(argv[3]) == "gensort") {
+        return generateGensort(output_file, num_records);
+    }
     bool fixed_size = (argc == 4);
     uint32_t payload_size = fixed_size ? std::stoul(argv[3]) : 0;
 
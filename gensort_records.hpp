@@ -0,0 +1,224 @@
+#ifndef GENSORT_RECORDS_HPP
+#define GENSORT_RECORDS_HPP
+
+#include "record_structure.hpp"
+#include "storage_backend.hpp"
+#include "async_writer.hpp"
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
+#include <queue>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+/*
+ * SortBenchmark (gensort) records: fixed 100-byte records whose first 10
+ * bytes are a binary key compared lexicographically. There are no length
+ * fields; record i starts at byte 100 * i.
+ */
+
+constexpr size_t GENSORT_RECORD_SIZE = 100;
+constexpr size_t GENSORT_KEY_SIZE = 10;
+
+// Records fetched by each pread of a GensortReader
+constexpr size_t GENSORT_READ_RECORDS = 80 * 1024;
+
+// Record layout selected with SORT_RECORD_FORMAT=gensort (default raw)
+inline bool gensortRecordsRequested() {
+    const char* format = std::getenv("SORT_RECORD_FORMAT");
+    if (!format || std::string(format) == "raw") return false;
+    if (std::string(format) == "gensort") return true;
+    throw std::runtime_error(std::string("Unknown record format: ") + format);
+}
+
+inline uint64_t gensortRecordCount(const std::string& path) {
+    const uint64_t bytes = storage().fileSize(path);
+    if (bytes % GENSORT_RECORD_SIZE != 0) {
+        throw std::runtime_error("Not a gensort file (size not a multiple of 100): " + path);
+    }
+    return bytes / GENSORT_RECORD_SIZE;
+}
+
+inline bool gensortKeyLess(const char* a, const char* b) {
+    return std::memcmp(a, b, GENSORT_KEY_SIZE) < 0;
+}
+
+/**
+ * 16-byte sort entry: the first 8 key bytes big-endian, then the last two
+ * key bytes above a 48-bit record index. Comparing the two words orders by
+ * the full key with ties broken by input position, so no key bytes are
+ * touched while sorting.
+ */
+struct GensortEntry {
+    uint64_t prefix;
+    uint64_t tail;
+
+    static constexpr uint64_t INDEX_MASK = (uint64_t(1) << 48) - 1;
+
+    static GensortEntry make(const char* record, uint64_t index) {
+        uint64_t prefix;
+        uint16_t rest;
+        std::memcpy(&prefix, record, sizeof(prefix));
+        std::memcpy(&rest, record + sizeof(prefix), sizeof(rest));
+        return {__builtin_bswap64(prefix), (uint64_t(__builtin_bswap16(rest)) << 48) | index};
+    }
+
+    uint64_t index() const { return tail & INDEX_MASK; }
+
+    bool operator<(const GensortEntry& other) const {
+        return prefix != other.prefix ? prefix < other.prefix : tail < other.tail;
+    }
+};
+static_assert(sizeof(GensortEntry) == 16, "GensortEntry must stay 16 bytes");
+
+// A 100-byte record gathered into the output
+struct GensortRecordRef {
+    const char* data;
+};
+
+inline size_t gatherSize(const GensortRecordRef&) { return GENSORT_RECORD_SIZE; }
+inline const void* gatherSource(const GensortRecordRef& r) { return r.data; }
+inline void gatherCopy(char* dst, const GensortRecordRef& r) {
+    std::memcpy(dst, r.data, GENSORT_RECORD_SIZE);
+}
+
+/**
+ * Sequential reader over records [first, first + count) of a gensort file;
+ * the stride is fixed, so a range needs no boundary search
+ */
+class GensortReader {
+private:
+    std::unique_ptr<StorageFile> file_;
+    uint64_t next_;                     // Next record to fetch
+    uint64_t end_;                      // One past the last record
+    std::unique_ptr<char[]> buffer_;
+    size_t buffered_ = 0;               // Records in buffer_
+    size_t pos_ = 0;                    // Next record in buffer_
+
+public:
+    GensortReader(const std::string& path, uint64_t first, uint64_t count)
+        : file_(storage().open(path, OpenMode::Read)), next_(first), end_(first + count),
+          buffer_(new char[GENSORT_READ_RECORDS * GENSORT_RECORD_SIZE]) {
+        file_->readahead(first * GENSORT_RECORD_SIZE, count * GENSORT_RECORD_SIZE, AccessHint::Sequential);
+    }
+
+    // Next record, valid until the following call; null at the end
+    const char* next() {
+        if (pos_ == buffered_) {
+            if (next_ >= end_) return nullptr;
+            size_t want = static_cast<size_t>(std::min<uint64_t>(GENSORT_READ_RECORDS, end_ - next_));
+            size_t got = file_->pread(buffer_.get(), want * GENSORT_RECORD_SIZE, next_ * GENSORT_RECORD_SIZE);
+            buffered_ = got / GENSORT_RECORD_SIZE;
+            pos_ = 0;
+            next_ += buffered_;
+            if (buffered_ == 0) {
+                end_ = next_;       // File shorter than the range
+                return nullptr;
+            }
+        }
+        return buffer_.get() + GENSORT_RECORD_SIZE * pos_++;
+    }
+};
+
+/**
+ * Merges sorted gensort files by full key; equal keys keep the order of
+ * the inputs
+ */
+inline void gensortMerge(const std::vector<std::string>& inputs, const std::string& output) {
+    std::vector<std::unique_ptr<GensortReader>> readers;
+    std::vector<const char*> current;
+    for (const auto& input : inputs) {
+        readers.push_back(std::make_unique<GensortReader>(input, 0, gensortRecordCount(input)));
+        current.push_back(readers.back()->next());
+    }
+
+    auto cmp = [&](size_t a, size_t b) {
+        int c = std::memcmp(current[a], current[b], GENSORT_KEY_SIZE);
+        return c != 0 ? c > 0 : a > b;      // min-heap
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> heap(cmp);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (current[i]) heap.push(i);
+    }
+
+    AsyncWriter writer(output);
+    RecordBuffer buffer;
+    while (!heap.empty()) {
+        size_t i = heap.top();
+        heap.pop();
+        writer.append(buffer, current[i], GENSORT_RECORD_SIZE);
+        current[i] = readers[i]->next();
+        if (current[i]) heap.push(i);
+    }
+    writer.flush(buffer);
+    writer.close();
+}
+
+// zlib-compatible CRC-32, the per-record checksum valsort sums
+inline uint32_t crc32Zlib(const char* p, size_t n) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < n; ++i) {
+        crc = table[(crc ^ static_cast<uint8_t>(p[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+/**
+ * valsort-style summary of a gensort file. The checksum is the 128-bit
+ * sum of every record's CRC-32, so it is independent of record order and
+ * an input and its sorted output must match.
+ */
+struct GensortSummary {
+    uint64_t records = 0;
+    uint64_t duplicates = 0;            // Records whose key equals the previous one
+    uint64_t unordered = 0;             // Records whose key is below the previous one
+    uint64_t first_unordered = 0;       // Index of the first such record
+    uint64_t checksum_hi = 0;
+    uint64_t checksum_lo = 0;
+
+    void add(uint32_t crc) {
+        checksum_lo += crc;
+        if (checksum_lo < crc) checksum_hi++;
+    }
+
+    std::string checksum() const {
+        std::ostringstream out;
+        out << std::hex;
+        if (checksum_hi) out << checksum_hi << std::setw(16) << std::setfill('0');
+        out << checksum_lo;
+        return out.str();
+    }
+};
+
+inline GensortSummary summarizeGensort(const std::string& path) {
+    GensortSummary summary;
+    GensortReader reader(path, 0, gensortRecordCount(path));
+    char previous[GENSORT_KEY_SIZE];
+    for (const char* r = reader.next(); r; r = reader.next()) {
+        if (summary.records > 0) {
+            int c = std::memcmp(previous, r, GENSORT_KEY_SIZE);
+            if (c == 0) summary.duplicates++;
+            if (c > 0 && summary.unordered++ == 0) summary.first_unordered = summary.records;
+        }
+        std::memcpy(previous, r, GENSORT_KEY_SIZE);
+        summary.add(crc32Zlib(r, GENSORT_RECORD_SIZE));
+        summary.records++;
+    }
+    return summary;
+}
+
+#endif // GENSORT_RECORDS_HPP
@@ -0,0 +1,127 @@
+#ifndef GENSORT_SORT_HPP
+#define GENSORT_SORT_HPP
+
+#include "gensort_records.hpp"
+#include "mapped_range.hpp"
+#include "parallel_gather.hpp"
+#include "omp_mergesort.hpp"
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <filesystem>
+#include <omp.h>
+
+/**
+ * OpenMP sort specialised for gensort records. A run is sorted as an
+ * array of 16-byte GensortEntry values built at a fixed stride over the
+ * mapped input, then gathered into the output once. Inputs larger than
+ * the memory budget become runs that are merged by full key.
+ */
+class GensortSort {
+private:
+    int num_threads_;
+    size_t memory_budget_;
+    std::string temp_dir_;
+    int file_id_ = 0;
+
+    std::string nextRunFileName() {
+        return spillDir() + "/gensort_run_" + std::to_string(file_id_++) + ".tmp";
+    }
+
+    // This instance's spill directory (under TMPDIR), created on first use
+    const std::string& spillDir() {
+        if (temp_dir_.empty()) temp_dir_ = makeTempDir("gensort_tmp");
+        return temp_dir_;
+    }
+
+    // Removes the spill directory, if this instance created one
+    void removeSpillDir() noexcept {
+        if (temp_dir_.empty()) return;
+        std::error_code ignored;
+        std::filesystem::remove_all(temp_dir_, ignored);
+        temp_dir_.clear();
+    }
+
+public:
+    GensortSort(int threads, size_t memory_budget = MAX_MEMORY_USAGE)
+        : num_threads_(threads), memory_budget_(memory_budget) {
+        omp_set_num_threads(threads);
+    }
+
+    ~GensortSort() {
+        removeSpillDir();
+    }
+
+    GensortSort(const GensortSort&) = delete;
+    GensortSort& operator=(const GensortSort&) = delete;
+
+    void sort(const std::string& input, const std::string& output) {
+        Timer timer("Gensort sort total time");
+        sortRange(input, 0, gensortRecordCount(input), output);
+    }
+
+    /**
+     * Sorts records [first, first + count) of a gensort file
+     * @param input Path to the input file
+     * @param first First record of the range
+     * @param count Records in the range
+     * @param output Path of the sorted output
+     */
+    void sortRange(const std::string& input, uint64_t first, uint64_t count, const std::string& output) {
+        const uint64_t run_records = std::max<uint64_t>(1, memory_budget_ / 2 / GENSORT_RECORD_SIZE);
+        if (count <= run_records) {
+            sortRun(input, first, count, output);
+            return;
+        }
+
+        Timer timer("Gensort external sort");
+        std::vector<std::string> runs;
+        try {
+            for (uint64_t done = 0; done < count; done += run_records) {
+                runs.push_back(nextRunFileName());
+                sortRun(input, first + done, std::min(run_records, count - done), runs.back());
+            }
+            {
+                Timer merge_timer("Gensort merge of " + std::to_string(runs.size()) + " runs");
+                gensortMerge(runs, output);
+            }
+        } catch (...) {
+            removeSpillDir();
+            throw;
+        }
+        removeSpillDir();
+    }
+
+private:
+    // Sorts one range that fits in memory straight into `output`
+    void sortRun(const std::string& input, uint64_t first, uint64_t count, const std::string& output) {
+        Timer timer("Gensort run of " + std::to_string(count) + " records");
+        MappedRange mapped(input, first * GENSORT_RECORD_SIZE, (first + count) * GENSORT_RECORD_SIZE);
+        if (mapped.end() - mapped.begin() != count * GENSORT_RECORD_SIZE) {
+            throw std::runtime_error("Gensort input truncated: " + input);
+        }
+        const char* base = mapped.at(mapped.begin());
+        const long long n = static_cast<long long>(count);
+
+        std::vector<GensortEntry> entries(count);
+        #pragma omp parallel for num_threads(num_threads_) schedule(static)
+        for (long long i = 0; i < n; ++i) {
+            entries[i] = GensortEntry::make(base + i * GENSORT_RECORD_SIZE, i);
+        }
+
+        parallelMergeSort(entries, std::less<GensortEntry>(), num_threads_);
+
+        std::vector<GensortRecordRef> order(count);
+        #pragma omp parallel for num_threads(num_threads_) schedule(static)
+        for (long long i = 0; i < n; ++i) {
+            order[i].data = base + entries[i].index() * GENSORT_RECORD_SIZE;
+        }
+        std::vector<GensortEntry>().swap(entries);
+
+        AsyncWriter writer(output);
+        parallelGatherWrite(order, writer);
+        writer.close();
+    }
+};
+
+#endif // GENSORT_SORT_HPP
@@ -0,0 +1,185 @@
+#ifndef INPUT_SET_HPP
+#define INPUT_SET_HPP
+
+#include "record_structure.hpp"
+#include "storage_backend.hpp"
+#include "range_reader.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <queue>
+#include <numeric>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+#include <stdexcept>
+#include <glob.h>
+
+/*
+ * Multi-file input: a comma-separated list, a directory or a glob names a
+ * set of raw record files sorted as their virtual concatenation. Each file
+ * ends on a record boundary, so files (or record-aligned pieces of large
+ * ones) are the units handed to threads, FastFlow tasks and ranks.
+ */
+
+// Byte range [begin, end) of one input file
+struct InputPiece {
+    std::string path;
+    uint64_t begin;
+    uint64_t end;
+
+    uint64_t bytes() const { return end - begin; }
+};
+
+/**
+ * Expands an input argument into the files it names: each comma-separated
+ * element is a directory (its regular, non-hidden files by name), a glob,
+ * or a single path taken as is
+ */
+inline std::vector<std::string> resolveInputs(const std::string& spec) {
+    std::vector<std::string> files;
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t comma = spec.find(',', start);
+        std::string element = spec.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        start = comma == std::string::npos ? spec.size() + 1 : comma + 1;
+        if (element.empty()) continue;
+
+        if (std::filesystem::is_directory(element)) {
+            std::vector<std::string> entries;
+            for (const auto& entry : std::filesystem::directory_iterator(element)) {
+                if (entry.is_regular_file() && entry.path().filename().string()[0] != '.') {
+                    entries.push_back(entry.path().string());
+                }
+            }
+            std::sort(entries.begin(), entries.end());
+            if (entries.empty()) throw std::runtime_error("No input files in directory " + element);
+            files.insert(files.end(), entries.begin(), entries.end());
+        } else if (element.find_first_of("*?[") != std::string::npos) {
+            glob_t matches;
+            int rc = ::glob(element.c_str(), 0, nullptr, &matches);
+            if (rc != 0) {
+                if (rc != GLOB_NOMATCH) globfree(&matches);
+                throw std::runtime_error("No input files match " + element);
+            }
+            for (size_t i = 0; i < matches.gl_pathc; ++i) {
+                if (std::filesystem::is_regular_file(matches.gl_pathv[i])) files.push_back(matches.gl_pathv[i]);
+            }
+            globfree(&matches);
+        } else {
+            files.push_back(element);
+        }
+    }
+    if (files.empty()) throw std::runtime_error("No input files given");
+    return files;
+}
+
+// Pieces are byte ranges of raw record files
+inline void requireRawInputs(const std::vector<std::string>& files) {
+    for (const auto& file : files) {
+        if (isContainerFile(file) || isColumnarFile(file)) {
+            throw std::runtime_error("Multi-file input takes raw record files; convert " + file +
+                                     " with convert_records to-raw first");
+        }
+    }
+}
+
+// Every file as one piece, in order
+inline std::vector<InputPiece> wholeFiles(const std::vector<std::string>& files) {
+    std::vector<InputPiece> pieces;
+    for (const auto& file : files) {
+        const uint64_t size = storage().fileSize(file);
+        if (size > 0) pieces.push_back({file, 0, size});
+    }
+    return pieces;
+}
+
+inline uint64_t pieceBytes(const std::vector<InputPiece>& pieces) {
+    uint64_t bytes = 0;
+    for (const auto& piece : pieces) bytes += piece.bytes();
+    return bytes;
+}
+
+/**
+ * Byte-balanced bin packing of input files. Files larger than a bin's
+ * share are split at record boundaries, then pieces go largest first to
+ * the least loaded bin. Every caller computes the same packing.
+ * @param split How large files are split (see withRecordSplits)
+ * @return `bins` piece lists, each in input order
+ */
+inline std::vector<std::vector<InputPiece>> packInputs(const std::vector<std::string>& files, size_t bins,
+                                                       RecordSplitter split = recordAlignedSplits) {
+    std::vector<InputPiece> whole = wholeFiles(files);
+    const uint64_t target = std::max<uint64_t>(1, (pieceBytes(whole) + bins - 1) / bins);
+
+    std::vector<InputPiece> pieces;
+    for (const auto& file : whole) {
+        const size_t parts = static_cast<size_t>((file.bytes() + target - 1) / target);
+        if (parts <= 1) {
+            pieces.push_back(file);
+            continue;
+        }
+        std::vector<uint64_t> splits = split(file.path, 0, file.end, parts);
+        for (size_t p = 0; p < parts; ++p) {
+            if (splits[p] < splits[p + 1]) pieces.push_back({file.path, splits[p], splits[p + 1]});
+        }
+    }
+
+    std::vector<size_t> order(pieces.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&](size_t a, size_t b) { return pieces[a].bytes() > pieces[b].bytes(); });
+
+    using Load = std::pair<uint64_t, size_t>;   // bytes assigned, bin
+    std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+    for (size_t b = 0; b < bins; ++b) loads.emplace(0, b);
+    std::vector<std::vector<size_t>> assigned(bins);
+    for (size_t i : order) {
+        Load least = loads.top();
+        loads.pop();
+        assigned[least.second].push_back(i);
+        loads.emplace(least.first + pieces[i].bytes(), least.second);
+    }
+
+    std::vector<std::vector<InputPiece>> packed(bins);
+    for (size_t b = 0; b < bins; ++b) {
+        std::sort(assigned[b].begin(), assigned[b].end());
+        for (size_t i : assigned[b]) packed[b].push_back(pieces[i]);
+    }
+    return packed;
+}
+
+/**
+ * Sequential reader over a list of pieces, one RangeReader at a time: the
+ * records of a virtual concatenation
+ */
+class PieceReader {
+private:
+    std::vector<InputPiece> pieces_;
+    size_t next_ = 0;                   // Next piece to open
+    std::unique_ptr<RangeReader> reader_;
+    size_t buffer_size_;
+
+public:
+    explicit PieceReader(std::vector<InputPiece> pieces, size_t buffer_size = PREAD_BLOCK_SIZE)
+        : pieces_(std::move(pieces)), buffer_size_(buffer_size) {}
+
+    // Reads the next record; returns an empty RecordPtr after the last piece
+    RecordPtr next() {
+        for (;;) {
+            if (reader_) {
+                RecordPtr record = reader_->next();
+                if (record.get()) return record;
+                reader_.reset();
+            }
+            if (next_ == pieces_.size()) return RecordPtr();
+            // Small shards get buffers of their own size
+            const InputPiece& piece = pieces_[next_++];
+            size_t buffer = static_cast<size_t>(std::min<uint64_t>(buffer_size_, piece.bytes()));
+            reader_ = std::make_unique<RangeReader>(piece.path, piece.begin, piece.end,
+                                                    std::max(buffer, HEADER_SIZE + PAYLOAD_MAX));
+        }
+    }
+};
+
+#endif // INPUT_SET_HPP
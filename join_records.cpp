@@ -0,0 +1,33 @@
+#include "merge_join.hpp"
+#include <iostream>
+#include <string>
+
+int main(int argc, char* argv[]) {
+    if (argc < 5) {
+        std::cerr << "Usage: " << argv[0] << " <inner|left|semi> <left_input> <right_input> <output_file>"
+                  << " [num_threads] [memory_budget_mb] [sorted]\n";
+        std::cerr << "  Inputs may be files, comma-separated lists, directories or globs; pass 'sorted'\n";
+        std::cerr << "  when both inputs are single files already sorted by key to skip sorting them\n";
+        return 1;
+    }
+
+    std::string left = argv[2];
+    std::string right = argv[3];
+    std::string output_file = argv[4];
+    int num_threads = (argc > 5) ? std::stoi(argv[5]) : omp_get_max_threads();
+    size_t memory_budget = (argc > 6) ? std::stoull(argv[6]) * MB : MAX_MEMORY_USAGE;
+    bool presorted = (argc > 7) && std::string(argv[7]) == "sorted";
+
+    try {
+        MergeJoin joiner(parseJoinType(argv[1]), num_threads, memory_budget);
+        uint64_t records = presorted ? joiner.join(left, right, output_file)
+                                     : joiner.sortAndJoin(left, right, output_file);
+        std::cout << "Wrote " << records << " records" << std::endl;
+        storage().persist(output_file);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
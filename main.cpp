@@ -2,10 +2,12 @@
 #include <string>
 #include <stdexcept>
 #include "mpi_openmp_sort.hpp"
+#include "output_format.hpp"
+#include "input_set.hpp"
 
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        std::cerr << "Usage: " << argv[0] << " <input_file> <output_file> <threads_per_process>\n";
+    if (argc < 4 || argc > 5) {
+        std::cerr << "Usage: " << argv[0] << " <input_file> <output_file> <threads_per_process> [openmp|fastflow]\n";
         return 1;
     }
 
@@ -18,8 +20,21 @@ int main(int argc, char* argv[]) {
     try {
         {  // Scope for HybridOpenMPSort
             int num_threads = std::stoi(argv[3]);
-            HybridOpenMPSort sorter(num_threads);
-            sorter.sort(argv[1], argv[2]);
+            IntraRankEngine engine = (argc > 4 && std::string(argv[4]) == "fastflow")
+                                         ? IntraRankEngine::FastFlow : IntraRankEngine::OpenMP;
+            if (gensortRecordsRequested() && requestedOutputFormat() != OutputFormat::Raw) {
+                throw std::runtime_error("Gensort records are only written in gensort layout");
+            }
+            std::vector<std::string> inputs = resolveInputs(argv[1]);
+            HybridOpenMPSort sorter(num_threads, engine);
+            if (inputs.size() > 1) {
+                sorter.sortFiles(inputs, argv[2], requestedOutputFormat());
+            } else {
+                sorter.sort(inputs[0], argv[2], requestedOutputFormat());
+            }
+            if (rank == 0) {
+                persistOutput(argv[2]);
+            }
         }  // sorter is destroyed here, before MPI_Finalize
 
         // Sync point before finalizing
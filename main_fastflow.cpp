@@ -1,20 +1,40 @@
 #include "fastflow_sort.hpp"
+#include "output_format.hpp"
+#include "gensort_records.hpp"
+#include "input_set.hpp"
 #include <iostream>
 #include <string>
 
 int main(int argc, char* argv[]) {
     if (argc < 4) {
-        std::cerr << "Usage: ./fastflow_sort <input_file> <output_file> <num_threads>" << std::endl;
+        std::cerr << "Usage: ./fastflow_sort <input_file> <output_file> <num_threads> [memory_budget_mb] [range] [mmap]" << std::endl;
         return 1;
     }
 
     std::string input_file = argv[1];
     std::string output_file = argv[2];
     int num_threads = std::stoi(argv[3]);
+    size_t memory_budget = (argc > 4) ? std::stoull(argv[4]) * MB : MAX_MEMORY_USAGE;
+    FastFlowStrategy strategy = FastFlowStrategy::FarmMerge;
+    bool zero_copy = false;
+    for (int i = 5; i < argc; ++i) {
+        std::string mode = argv[i];
+        if (mode == "range") strategy = FastFlowStrategy::KeyRange;
+        else if (mode == "mmap") zero_copy = true;
+    }
 
     try {
-        FastFlowMergeSort sorter(num_threads);
-        sorter.sort(input_file, output_file);
+        if (gensortRecordsRequested()) {
+            throw std::runtime_error("Gensort records are sorted by openmp_sort and hybrid_sort");
+        }
+        std::vector<std::string> inputs = resolveInputs(input_file);
+        FastFlowMergeSort sorter(num_threads, memory_budget, strategy, zero_copy);
+        if (inputs.size() > 1) {
+            sorter.sortFiles(inputs, output_file, requestedOutputFormat());
+        } else {
+            sorter.sort(inputs[0], output_file, requestedOutputFormat());
+        }
+        persistOutput(output_file);
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
@@ -1,12 +1,28 @@
 #include "omp_mergesort.hpp"
+#include "output_format.hpp"
+#include "gensort_sort.hpp"
+#include "input_set.hpp"
+#include "windowed_sort.hpp"
 #include <iostream>
 #include <string>
 
 void print_usage() {
-    std::cout << "Usage: ./openmp_sort <input_file> <output_file> <num_threads>" << std::endl;
-    std::cout << "  <input_file>: Path to input file to sort" << std::endl;
+    std::cout << "Usage: ./openmp_sort <input_file> <output_file> <num_threads> [memory_budget_mb]" << std::endl;
+    std::cout << "  <input_file>: Path to input file to sort, or a comma-separated list, directory" << std::endl;
+    std::cout << "    or glob of raw record files sorted as one input" << std::endl;
     std::cout << "  <output_file>: Path to output file for sorted data" << std::endl;
     std::cout << "  <num_threads>: Number of OpenMP threads to use" << std::endl;
+    std::cout << "  [memory_budget_mb]: Memory for records; larger inputs are sorted out of core" << std::endl;
+    std::cout << "Set SORT_STORAGE=posix|mmap|io_uring|memory to choose the storage backend" << std::endl;
+    std::cout << "Set SORT_THROTTLE=hdd|nfs|ssd|nvme or read_mb_s:write_mb_s:latency_us:queue_depth" << std::endl;
+    std::cout << "  to run the storage as a simulated slower device" << std::endl;
+    std::cout << "Set SORT_OUTPUT_FORMAT=container|columnar to write a block container or a key column" << std::endl;
+    std::cout << "  with a payload heap; inputs are detected" << std::endl;
+    std::cout << "Set SORT_OUTPUT_FORMAT=permutation to write only sorted {key, input offset} entries" << std::endl;
+    std::cout << "Set SORT_KEY_BYTES=16..64 to order records by that many leading payload bytes" << std::endl;
+    std::cout << "Set SORT_RECORD_FORMAT=gensort to sort 100-byte SortBenchmark records (10-byte keys)" << std::endl;
+    std::cout << "Set SORT_WINDOW=W to sort in one pass an input whose records are displaced by at most" << std::endl;
+    std::cout << "  W positions; farther records are spilled and merged in at the end" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
@@ -19,20 +35,45 @@ int main(int argc, char* argv[]) {
     std::string input_file = argv[1];
     std::string output_file = argv[2];
     unsigned num_threads = std::stoi(argv[3]);
+    size_t memory_budget = (argc > 4) ? std::stoull(argv[4]) * MB : MAX_MEMORY_USAGE;
 
     try {
-        // Create and run the OpenMP sorter
-        OpenMPMergeSort sorter(num_threads);
-        
         auto start_time = std::chrono::high_resolution_clock::now();
+        std::vector<std::string> inputs = resolveInputs(input_file);
         
-        sorter.sort(input_file, output_file);
+        if (gensortRecordsRequested()) {
+            // Fixed 100-byte records have their own engine and stay in gensort layout
+            if (requestedOutputFormat() != OutputFormat::Raw) {
+                throw std::runtime_error("Gensort records are only written in gensort layout");
+            }
+            if (inputs.size() > 1) throw std::runtime_error("Gensort records are sorted from a single file");
+            GensortSort sorter(num_threads, memory_budget);
+            sorter.sort(inputs[0], output_file);
+        } else if (size_t window = disorderWindowRequested()) {
+            // Nearly ordered input: one pass through a W-record heap
+            if (requestedOutputFormat() == OutputFormat::Permutation) {
+                throw std::runtime_error("The windowed sort writes records, not permutations");
+            }
+            WindowedSort sorter(window, num_threads, memory_budget);
+            sorter.sort(inputs, output_file, requestedOutputFormat());
+        } else {
+            // Create and run the OpenMP sorter
+            OpenMPMergeSort sorter(num_threads, memory_budget);
+            
+            if (inputs.size() > 1) {
+                sorter.sortFiles(inputs, output_file, requestedOutputFormat());
+            } else {
+                sorter.sort(inputs[0], output_file, requestedOutputFormat());
+            }
+        }
         
         auto end_time = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time);
         
         std::cout << "OpenMP sorting completed in " << duration.count() << " ms" << std::endl;
-        std::cout << "Used " << num_threads << " threads" << std::endl;
+        std::cout << "Used " << num_threads << " threads, " << storage().name() << " storage" << std::endl;
+
+        persistOutput(output_file);
         
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
@@ -0,0 +1,172 @@
+#ifndef MAPPED_RANGE_HPP
+#define MAPPED_RANGE_HPP
+
+#include "record_structure.hpp"
+#include "storage_backend.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+
+// Granularity at which a mapped range is handed back to the kernel
+constexpr size_t RELEASE_WINDOW_SIZE = 64 * MB;
+
+/**
+ * Raised when the last record of a range runs past the range's end while
+ * the file goes on: the range was cut at a resynchronised offset that is
+ * not a record boundary. Callers redo the work with exact splits.
+ */
+class MisalignedSplit : public std::runtime_error {
+public:
+    explicit MisalignedSplit(uint64_t end)
+        : std::runtime_error("Split at offset " + std::to_string(end) + " is not a record boundary") {}
+};
+
+/**
+ * Read-only mapping of the page-aligned byte range [begin, end) of a file.
+ * Pages can be prefaulted by several OpenMP threads, and the mapping is
+ * released window by window once every record that references a window
+ * has been written out.
+ */
+class MappedRange {
+private:
+    std::unique_ptr<StorageFile> file_;
+    const char* base_ = nullptr;    // Start of the mapping (page aligned)
+    size_t length_ = 0;             // Bytes mapped
+    uint64_t map_offset_ = 0;       // File offset of base_
+    uint64_t begin_ = 0;            // First valid file offset
+    uint64_t end_ = 0;              // One past the last valid file offset
+    uint64_t file_size_ = 0;
+    size_t page_size_ = 4096;
+    std::vector<uint32_t> window_refs_;
+    std::vector<bool> released_;
+
+    size_t windowOf(const char* p) const {
+        return static_cast<size_t>(p - base_) / RELEASE_WINDOW_SIZE;
+    }
+
+    void releaseWindow(size_t w) {
+        if (released_[w]) return;
+        size_t offset = w * RELEASE_WINDOW_SIZE;
+        size_t bytes = std::min(RELEASE_WINDOW_SIZE, length_ - offset);
+        file_->unmap(base_ + offset, bytes);
+        released_[w] = true;
+    }
+
+public:
+    MappedRange(const std::string& path, uint64_t begin, uint64_t end) {
+        file_ = storage().open(path, OpenMode::Read);
+
+        page_size_ = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        file_size_ = file_->size();
+        end_ = std::min<uint64_t>(end, file_size_);
+        begin_ = std::min(begin, end_);
+        map_offset_ = begin_ - begin_ % page_size_;
+        length_ = end_ - map_offset_;
+
+        if (length_ > 0) {
+            base_ = file_->map(map_offset_, length_);
+            file_->readahead(map_offset_, length_, AccessHint::WillNeed);
+        }
+
+        size_t windows = (length_ + RELEASE_WINDOW_SIZE - 1) / RELEASE_WINDOW_SIZE;
+        window_refs_.assign(windows, 0);
+        released_.assign(windows, false);
+    }
+
+    ~MappedRange() {
+        for (size_t w = 0; w < released_.size(); ++w) {
+            releaseWindow(w);
+        }
+    }
+
+    MappedRange(const MappedRange&) = delete;
+    MappedRange& operator=(const MappedRange&) = delete;
+
+    uint64_t begin() const { return begin_; }
+    uint64_t end() const { return end_; }
+    uint64_t fileSize() const { return file_size_; }
+
+    // Address of a file offset inside [begin(), end())
+    const char* at(uint64_t file_offset) const {
+        return base_ + (file_offset - map_offset_);
+    }
+
+    // File offset of an address inside the mapping
+    uint64_t offsetOf(const char* p) const {
+        return map_offset_ + static_cast<uint64_t>(p - base_);
+    }
+
+    bool contains(const char* p) const {
+        return p >= base_ && p < base_ + length_;
+    }
+
+    /**
+     * Touches the pages of window slots assigned to this thread. Meant to be
+     * called by the helper threads of a parallel region, thread `slot` of
+     * `slots`, so page faults are taken concurrently ahead of a reader.
+     */
+    void prefault(int slot, int slots) const {
+        const size_t stride = RELEASE_WINDOW_SIZE;
+        for (size_t start = slot * stride; start < length_; start += slots * stride) {
+            size_t stop = std::min(start + stride, length_);
+            for (size_t off = start; off < stop; off += page_size_) {
+                (void)*static_cast<volatile const char*>(base_ + off);
+            }
+        }
+    }
+
+    // Counts a record against the windows its bytes fall in
+    void retain(const char* p, size_t n) {
+        if (!contains(p)) return;
+        window_refs_[windowOf(p)]++;
+        if (windowOf(p + n - 1) != windowOf(p)) window_refs_[windowOf(p + n - 1)]++;
+    }
+
+    // Unmaps every window no retained record refers to
+    void releaseUnreferenced() {
+        for (size_t w = 0; w < window_refs_.size(); ++w) {
+            if (window_refs_[w] == 0) releaseWindow(w);
+        }
+    }
+
+    // Drops a record's references, unmapping windows that become unused
+    void release(const char* p, size_t n) {
+        if (!contains(p)) return;
+        size_t first = windowOf(p);
+        size_t last = windowOf(p + n - 1);
+        if (--window_refs_[first] == 0) releaseWindow(first);
+        if (last != first && --window_refs_[last] == 0) releaseWindow(last);
+    }
+};
+
+/**
+ * Appends views of the records in the record-aligned range [begin, end) of
+ * a mapping; payloads point into the mapping. Throws MisalignedSplit if
+ * the last record runs past an end that is not the end of the file.
+ */
+inline void indexMappedRecords(const MappedRange& mapped, uint64_t begin, uint64_t end,
+                               std::vector<RecordView>& index) {
+    uint64_t offset = begin;
+    while (offset + HEADER_SIZE <= end) {
+        const char* record = mapped.at(offset);
+        uint64_t key;
+        uint32_t len;
+        std::memcpy(&key, record, sizeof(uint64_t));
+        std::memcpy(&len, record + sizeof(uint64_t), sizeof(uint32_t));
+        if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
+            throw std::runtime_error("Invalid record at offset " + std::to_string(offset));
+        }
+        if (offset + HEADER_SIZE + len > end) break;
+        index.emplace_back(key, record + HEADER_SIZE, len);
+        offset += HEADER_SIZE + len;
+    }
+    if (offset != end && end < mapped.fileSize()) throw MisalignedSplit(end);
+    if (offset + HEADER_SIZE <= end) {
+        throw std::runtime_error("Invalid record at offset " + std::to_string(offset));   // Truncated
+    }
+}
+
+#endif // MAPPED_RANGE_HPP
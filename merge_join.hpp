@@ -0,0 +1,306 @@
+#ifndef MERGE_JOIN_HPP
+#define MERGE_JOIN_HPP
+
+#include "record_structure.hpp"
+#include "omp_mergesort.hpp"
+#include "input_set.hpp"
+#include "mapped_range.hpp"
+#include "range_reader.hpp"
+#include "async_writer.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <stdexcept>
+#include <omp.h>
+
+/*
+ * Sort-merge join of two record files on the sort key (the header key, or
+ * the wide key with SORT_KEY_BYTES). A joined record keeps the key and
+ * carries the payload of the left record followed by the right one's.
+ */
+
+enum class JoinType {
+    Inner,      // Every matching (left, right) pair
+    LeftOuter,  // Matching pairs, plus unmatched left records as they are
+    Semi        // Each left record with at least one match, once
+};
+
+inline JoinType parseJoinType(const std::string& name) {
+    if (name == "inner") return JoinType::Inner;
+    if (name == "left") return JoinType::LeftOuter;
+    if (name == "semi") return JoinType::Semi;
+    throw std::runtime_error("Unknown join type: " + name);
+}
+
+inline bool sameSortKey(const Record* a, const Record* b) {
+    return !recordLess(a, b) && !recordLess(b, a);
+}
+
+// Key-range partitions per thread, for balance under skew
+constexpr size_t JOIN_PARTITIONS_PER_THREAD = 4;
+
+/**
+ * Joins two inputs ordered by key. Unsorted inputs are first sorted with
+ * OpenMPMergeSort. The key space is then cut at the left keys found at
+ * byte-offset splits of the left input, located in both inputs by
+ * bisection. Each key range is joined in parallel by its own pair of
+ * RangeReader cursors into a temporary part, and the parts are
+ * concatenated. A matching pair whose payloads together exceed PAYLOAD_MAX
+ * cannot be represented: it fails the join, and the output is then never
+ * created.
+ */
+class MergeJoin {
+private:
+    JoinType type_;
+    int num_threads_;
+    size_t memory_budget_;
+    std::string temp_dir_;
+
+    // This instance's temporary directory (under TMPDIR), created on first use
+    const std::string& tempDir() {
+        if (temp_dir_.empty()) temp_dir_ = makeTempDir("join_tmp");
+        return temp_dir_;
+    }
+
+    /**
+     * Offset of the first record of [lo, hi) not below `key`, or hi. lo is a
+     * record boundary, and so is hi unless it ends the file. Bisects on byte
+     * offsets, moving each midpoint to the record boundary
+     * resyncRecordBoundary() finds there, then scans the last window.
+     */
+    static uint64_t searchBound(const std::string& path, uint64_t lo, uint64_t hi, const Record* key) {
+        while (hi - lo > RESYNC_WINDOW) {
+            const uint64_t mid = recordAlignedSplits(path, lo, hi, 2)[1];
+            if (mid >= hi) break;
+            RangeReader probe(path, mid, hi, HEADER_SIZE + PAYLOAD_MAX);
+            RecordPtr record = probe.next();
+            if (!record.get()) break;
+            if (recordLess(record.get(), key)) lo = mid;
+            else hi = mid;
+        }
+        RangeReader scan(path, lo, hi, MERGE_READ_BUFFER);
+        uint64_t offset = lo;
+        for (RecordPtr record = scan.next(); record.get() && recordLess(record.get(), key); record = scan.next()) {
+            offset += record.size();
+        }
+        return offset;
+    }
+
+    /**
+     * Offsets of the first records not below each of the ascending `keys`
+     * in [begin, end) of a file. Bisects per key after recordAlignedSplits;
+     * after exactRecordSplits, walks the range once instead.
+     */
+    static std::vector<uint64_t> lowerBounds(const std::string& path, uint64_t begin, uint64_t end,
+                                             const std::vector<RecordPtr>& keys, RecordSplitter split) {
+        std::vector<uint64_t> bounds;
+        if (split == exactRecordSplits) {
+            RangeReader reader(path, begin, end, MERGE_READ_BUFFER);
+            uint64_t offset = begin;
+            for (RecordPtr record = reader.next(); record.get() && bounds.size() < keys.size(); record = reader.next()) {
+                while (bounds.size() < keys.size() && !recordLess(record.get(), keys[bounds.size()].get())) {
+                    bounds.push_back(offset);
+                }
+                offset += record.size();
+            }
+            bounds.resize(keys.size(), end);
+            return bounds;
+        }
+        uint64_t lo = begin;
+        for (const RecordPtr& key : keys) {
+            lo = searchBound(path, lo, end, key.get());
+            bounds.push_back(lo);
+        }
+        return bounds;
+    }
+
+    // Records the first exception raised inside a parallel region. A
+    // MisalignedSplit wins: errors of other readers may follow from it.
+    static void captureError(std::exception_ptr& error) {
+        std::exception_ptr current = std::current_exception();
+        bool misaligned = false;
+        try {
+            throw;
+        } catch (const MisalignedSplit&) {
+            misaligned = true;
+        } catch (...) {
+        }
+        #pragma omp critical(join_error)
+        if (!error || misaligned) error = current;
+    }
+
+    // Next record of a cursor, checking the input is in key order
+    static RecordPtr advance(RangeReader& reader, const RecordPtr& current, const char* side) {
+        RecordPtr next = reader.next();
+        if (next.get() && current.get() && recordLess(next.get(), current.get())) {
+            throw std::runtime_error(std::string(side) + " join input is not sorted by key");
+        }
+        return next;
+    }
+
+    // Throws if the joined payload exceeds PAYLOAD_MAX
+    void emitJoined(AsyncWriter& writer, RecordBuffer& buffer, const Record* left, const Record* right) {
+        const uint64_t len = uint64_t(left->len) + right->len;
+        if (len > PAYLOAD_MAX) {
+            throw std::runtime_error("Joined payload of key " + std::to_string(left->key) + " exceeds " +
+                                     std::to_string(PAYLOAD_MAX) + " bytes");
+        }
+        const uint32_t joined_len = static_cast<uint32_t>(len);
+        writer.append(buffer, reinterpret_cast<const char*>(&left->key), sizeof(uint64_t));
+        writer.append(buffer, reinterpret_cast<const char*>(&joined_len), sizeof(uint32_t));
+        writer.append(buffer, left->payload, left->len);
+        writer.append(buffer, right->payload, right->len);
+    }
+
+    /**
+     * Streams the merge join of [a_begin, a_end) of the left input with
+     * [b_begin, b_end) of the right one. The right records of the current
+     * key are buffered so that runs of equal left keys can reuse them.
+     * @return Records written
+     */
+    uint64_t joinRange(const std::string& a, uint64_t a_begin, uint64_t a_end,
+                       const std::string& b, uint64_t b_begin, uint64_t b_end, const std::string& output) {
+        RangeReader left(a, a_begin, a_end, MERGE_READ_BUFFER);
+        RangeReader right(b, b_begin, b_end, MERGE_READ_BUFFER);
+        AsyncWriter writer(output);
+        RecordBuffer buffer;
+        uint64_t written = 0;
+
+        std::vector<RecordPtr> group;       // Right records sharing the current key
+        RecordPtr y = advance(right, RecordPtr(), "Right");
+        for (RecordPtr x = advance(left, RecordPtr(), "Left"); x.get(); x = advance(left, x, "Left")) {
+            if (!group.empty() && !sameSortKey(group.front().get(), x.get())) group.clear();
+            if (group.empty()) {
+                while (y.get() && recordLess(y.get(), x.get())) y = advance(right, y, "Right");
+                while (y.get() && !recordLess(x.get(), y.get())) {
+                    group.push_back(std::move(y));
+                    y = advance(right, group.back(), "Right");
+                }
+            }
+
+            if (group.empty()) {
+                if (type_ == JoinType::LeftOuter) {
+                    writer.append(buffer, x.data(), x.size());
+                    written++;
+                }
+            } else if (type_ == JoinType::Semi) {
+                writer.append(buffer, x.data(), x.size());
+                written++;
+            } else {
+                for (const auto& match : group) {
+                    emitJoined(writer, buffer, x.get(), match.get());
+                }
+                written += group.size();
+            }
+        }
+
+        writer.flush(buffer);
+        writer.close();
+        return written;
+    }
+
+public:
+    MergeJoin(JoinType type, int threads, size_t memory_budget = MAX_MEMORY_USAGE)
+        : type_(type), num_threads_(threads), memory_budget_(memory_budget) {}
+
+    // Removes the temporary directory, if this instance created one
+    ~MergeJoin() {
+        if (temp_dir_.empty()) return;
+        std::error_code ignored;
+        std::filesystem::remove_all(temp_dir_, ignored);
+    }
+
+    MergeJoin(const MergeJoin&) = delete;
+    MergeJoin& operator=(const MergeJoin&) = delete;
+
+    /**
+     * Sorts both inputs into temporary files, then joins them
+     * @param left Left input: a file, or a list, directory or glob of files
+     * @param right Right input, in the same forms
+     * @param output Path of the joined records
+     * @return Records written
+     */
+    uint64_t sortAndJoin(const std::string& left, const std::string& right, const std::string& output) {
+        const std::string sorted[2] = {tempDir() + "/left.sorted", tempDir() + "/right.sorted"};
+        const std::string specs[2] = {left, right};
+        for (int side = 0; side < 2; ++side) {
+            std::vector<std::string> inputs = resolveInputs(specs[side]);
+            OpenMPMergeSort sorter(num_threads_, memory_budget_);
+            if (inputs.size() > 1) {
+                sorter.sortFiles(inputs, sorted[side]);
+            } else {
+                sorter.sort(inputs[0], sorted[side]);
+            }
+        }
+        uint64_t written = join(sorted[0], sorted[1], output);
+        storage().remove(sorted[0]);
+        storage().remove(sorted[1]);
+        return written;
+    }
+
+    /**
+     * Joins two raw record files that are already sorted by key. The
+     * output is written only once every key range has been joined.
+     * @param a Left input
+     * @param b Right input
+     * @param output Path of the joined records
+     * @return Records written
+     * @throws std::runtime_error if a joined payload exceeds PAYLOAD_MAX
+     */
+    uint64_t join(const std::string& a, const std::string& b, const std::string& output) {
+        Timer timer("Merge join");
+        requireRawInputs({a, b});
+        const std::string& temp_dir = tempDir();
+
+        const size_t partitions = std::max<size_t>(1, num_threads_ * JOIN_PARTITIONS_PER_THREAD);
+        const uint64_t b_size = storage().fileSize(b);
+        std::vector<std::string> parts;
+        std::vector<uint64_t> written;
+        withRecordSplits([&](RecordSplitter split) {
+            // Partition boundaries: lower bounds, in both inputs, of the left
+            // keys at byte-offset splits of the left input
+            std::vector<uint64_t> a_splits = split(a, 0, UINT64_MAX, partitions);
+            std::vector<RecordPtr> keys;
+            for (size_t p = 1; p < partitions && a_splits[p] < a_splits.back(); ++p) {
+                RangeReader reader(a, a_splits[p], a_splits.back(), HEADER_SIZE + PAYLOAD_MAX);
+                keys.push_back(reader.next());
+            }
+            std::vector<uint64_t> a_bounds = lowerBounds(a, a_splits.front(), a_splits.back(), keys, split);
+            std::vector<uint64_t> b_bounds = lowerBounds(b, 0, b_size, keys, split);
+            a_bounds.insert(a_bounds.begin(), a_splits.front());
+            a_bounds.push_back(a_splits.back());
+            b_bounds.insert(b_bounds.begin(), 0);
+            b_bounds.push_back(b_size);
+
+            const size_t ranges = keys.size() + 1;
+            parts.assign(ranges, std::string());
+            written.assign(ranges, 0);
+            std::exception_ptr error;
+            #pragma omp parallel for num_threads(num_threads_) schedule(dynamic, 1)
+            for (long long p = 0; p < static_cast<long long>(ranges); ++p) {
+                try {
+                    parts[p] = temp_dir + "/join_part_" + std::to_string(p) + ".tmp";
+                    written[p] = joinRange(a, a_bounds[p], a_bounds[p + 1], b, b_bounds[p], b_bounds[p + 1], parts[p]);
+                } catch (...) {
+                    captureError(error);
+                }
+            }
+            if (error) std::rethrow_exception(error);
+        });
+
+        std::unique_ptr<StorageFile> out = storage().open(output, OpenMode::Write);
+        uint64_t offset = 0, records = 0;
+        for (size_t p = 0; p < parts.size(); ++p) {
+            offset += appendFile(parts[p], *out, offset);
+            storage().remove(parts[p]);
+            records += written[p];
+        }
+        std::cout << "Joined " << records << " records over " << parts.size() << " key ranges" << std::endl;
+        return records;
+    }
+};
+
+#endif // MERGE_JOIN_HPP
@@ -4,6 +4,15 @@
 #include "record_structure.hpp"  // Include this first for constants
 #include "omp_mergesort.hpp"
 #include "openmp_sort.hpp"
+#include "record_layout.hpp"
+#include "mapped_range.hpp"
+#include "range_reader.hpp"
+#include "input_set.hpp"
+#include "output_format.hpp"
+#include "gensort_sort.hpp"
+#ifdef USE_FASTFLOW
+#include "fastflow_sort.hpp"
+#endif
 #include <mpi.h>
 #include <vector>
 #include <string>
@@ -21,30 +30,34 @@
 #include <stdexcept>
 #include <omp.h>
 #include <cstring>  // For memcpy
+#include <memory>
+#include <tuple>
+#include <exception>
 
 namespace fs = std::filesystem;
 
 // Large file threshold for scatter vs broadcast (100M records)
 constexpr uint64_t LARGE_FILE_THRESHOLD = 100000000ULL;
 
-// Record view for efficient sorting without copying payloads
-struct RecordView {
-    uint64_t key;
-    const char* payload;  // points into mmap buffer
-    uint32_t len;
-    
-    RecordView(uint64_t k, const char* p, uint32_t l) : key(k), payload(p), len(l) {}
-    
-    bool operator<(const RecordView& other) const {
-        return key < other.key;
-    }
+// Engine that sorts a rank's slice; the distributed plumbing is shared
+enum class IntraRankEngine {
+    OpenMP,     // mmap index + OpenMP sort + parallel gather
+    FastFlow    // FastFlow farm: streaming run generation + merge (needs USE_FASTFLOW)
 };
 
 class HybridOpenMPSort {
 private:
     int world_size_;
     int rank_;
+    size_t memory_budget_;              // This rank's share of its node's memory budget
     OpenMPMergeSort omp_sorter_;
+    IntraRankEngine engine_;
+    bool gensort_;                      // SORT_RECORD_FORMAT=gensort: 100-byte records
+    bool permutation_;                  // SORT_OUTPUT_FORMAT=permutation: {key, offset} entries
+    GensortSort gensort_sorter_;
+#ifdef USE_FASTFLOW
+    std::unique_ptr<FastFlowMergeSort> ff_sorter_;
+#endif
     std::string temp_dir_;
     int file_id_;
     static constexpr size_t MAX_BUFFER_SIZE = 128 * 1024 * 1024; // Increased to 128MB
@@ -52,6 +65,7 @@ private:
     // Record boundary handling
     std::vector<uint64_t> record_offsets_;
     uint64_t total_records_;
+    uint64_t input_size_ = 0;           // Ranks with no records get [input_size_, input_size_)
 
     // Parallel quicksort for record views
     void parallelQuickSort(std::vector<RecordView>& arr, size_t low, size_t high) {
@@ -80,11 +94,11 @@ private:
     }
 
     size_t partition(std::vector<RecordView>& arr, size_t low, size_t high) {
-        uint64_t pivot = arr[high].key;
+        const RecordView pivot = arr[high];
         size_t i = low;
         
         for (size_t j = low; j < high; j++) {
-            if (arr[j].key < pivot) {
+            if (arr[j] < pivot) {
                 std::swap(arr[i], arr[j]);
                 i++;
             }
@@ -93,6 +107,39 @@ private:
         return i;
     }
 
+    // Sort record views by key, in parallel for larger inputs
+    void sortRecordViews(std::vector<RecordView>& record_index) {
+        if (record_index.size() > 1000) {
+            // Use OpenMP parallel sort for larger datasets
+            const size_t num_threads = omp_get_max_threads();
+            if (num_threads > 1 && record_index.size() > num_threads * 100) {
+                // Parallel quicksort implementation
+                #pragma omp parallel
+                {
+                    #pragma omp single nowait
+                    {
+                        parallelQuickSort(record_index, 0, record_index.size() - 1);
+                    }
+                }
+            } else {
+                std::sort(record_index.begin(), record_index.end());
+            }
+        } else {
+            // Sequential sort for small datasets
+            std::sort(record_index.begin(), record_index.end());
+        }
+    }
+
+    // Ranks sharing a node split its memory budget evenly
+    static size_t rankMemoryShare(size_t node_budget) {
+        MPI_Comm node;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+        int node_ranks = 1;
+        MPI_Comm_size(node, &node_ranks);
+        MPI_Comm_free(&node);
+        return node_budget / node_ranks;
+    }
+
     std::string getNextTempFileName() {
         return temp_dir_ + "/chunk_" + std::to_string(rank_) + "_" + std::to_string(file_id_++) + ".tmp";
     }
@@ -101,29 +148,19 @@ private:
     void scanRecordBoundaries(const std::string& input_file) {
         if (rank_ != 0) return;
         
-        std::ifstream file(input_file, std::ios::binary | std::ios::ate);
-        if (!file) {
-            throw std::runtime_error("Cannot open input file for boundary scan: " + input_file);
-        }
-        
-        uint64_t file_size = file.tellg();
-        file.seekg(0);
+        // Only the headers are touched, through a read-only mapping
+        MappedRange mapped(input_file, 0, UINT64_MAX);
+        const uint64_t file_size = mapped.end();
+        input_size_ = file_size;
         
         record_offsets_.clear();
         record_offsets_.push_back(0); // First record starts at offset 0
         
         uint64_t offset = 0;
-        while (offset < file_size) {
-            file.seekg(offset);
-            
+        while (offset + HEADER_SIZE <= file_size) {
             // Read record header
-            uint64_t key;
             uint32_t len;
-            
-            if (!file.read(reinterpret_cast<char*>(&key), sizeof(uint64_t)) ||
-                !file.read(reinterpret_cast<char*>(&len), sizeof(uint32_t))) {
-                break; // End of file or corrupted
-            }
+            std::memcpy(&len, mapped.at(offset) + sizeof(uint64_t), sizeof(uint32_t));
             
             // Validate payload length
             if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
@@ -144,8 +181,9 @@ private:
 
     // Broadcast or scatter record boundaries to all ranks
     void broadcastRecordBoundaries() {
-        // First broadcast the number of records
+        // First broadcast the number of records and the input size
         MPI_Bcast(&total_records_, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+        MPI_Bcast(&input_size_, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
         
         if (total_records_ > LARGE_FILE_THRESHOLD) {
             // For very large files, use scatter to distribute only relevant boundaries
@@ -187,6 +225,12 @@ private:
                 uint64_t start_record = i * records_per_rank + std::min(static_cast<uint64_t>(i), remainder);
                 uint64_t end_record = start_record + records_per_rank + (i < remainder ? 1 : 0);
                 
+                if (start_record >= total_records_) {
+                    // More ranks than records: this one gets an empty range
+                    all_boundaries[i * 2] = input_size_;
+                    all_boundaries[i * 2 + 1] = input_size_;
+                    continue;
+                }
                 all_boundaries[i * 2] = record_offsets_[start_record];
                 all_boundaries[i * 2 + 1] = (end_record < total_records_) ? record_offsets_[end_record] : UINT64_MAX;
             }
@@ -221,6 +265,11 @@ private:
             uint64_t start_record = rank_ * records_per_rank + std::min(static_cast<uint64_t>(rank_), remainder);
             uint64_t end_record = start_record + records_per_rank + (rank_ < remainder ? 1 : 0);
             
+            // More ranks than records: this one gets an empty range
+            if (start_record >= total_records_) {
+                return {input_size_, input_size_};
+            }
+            
             uint64_t start_offset = record_offsets_[start_record];
             uint64_t end_offset = (end_record < total_records_) ? record_offsets_[end_record] : UINT64_MAX;
             
@@ -231,127 +280,247 @@ private:
     // Memory-mapped file processing with record view indexing
     void sortChunkWithMmap(const std::string& input_file, uint64_t start_offset, 
                           uint64_t end_offset, const std::string& output_file) {
-        // Open file for memory mapping
-        int fd = open(input_file.c_str(), O_RDONLY);
-        if (fd == -1) {
-            throw std::runtime_error("Cannot open file for mmap: " + input_file);
-        }
+        // Map only the page-aligned range this rank owns
+        MappedRange mapped(input_file, start_offset, end_offset);
+        
+        // Build record index for our chunk, sampling payload sizes on the way
+        std::vector<RecordView> record_index;
+        PayloadSizeHistogram payload_sizes;
+        uint64_t current_offset = mapped.begin();
+        bool invalid_length = false;
         
-        // Get actual file size for mmap
-        struct stat file_stat;
-        if (fstat(fd, &file_stat) == -1) {
-            close(fd);
-            throw std::runtime_error("Cannot stat file: " + input_file);
+        // Thread 0 indexes while the other threads prefault the range ahead of it
+        #pragma omp parallel
+        {
+            const int tid = omp_get_thread_num();
+            const int nt = omp_get_num_threads();
+            if (tid != 0) {
+                mapped.prefault(tid - 1, nt - 1);
+            } else {
+                while (current_offset + HEADER_SIZE <= mapped.end()) {
+                    // Read record header from mapped memory with alignment handling
+                    const char* record_start = mapped.at(current_offset);
+                    
+                    // Use memcpy for unaligned loads to avoid UB
+                    uint64_t key;
+                    uint32_t len;
+                    std::memcpy(&key, record_start, sizeof(uint64_t));
+                    std::memcpy(&len, record_start + sizeof(uint64_t), sizeof(uint32_t));
+                    
+                    // Validate payload length
+                    if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
+                        invalid_length = true;
+                        break;
+                    }
+                    
+                    if (current_offset + HEADER_SIZE + len > mapped.end()) {
+                        break; // Not enough space for payload
+                    }
+                    
+                    // Add to index (payload points directly into mapped memory)
+                    const char* payload_start = record_start + HEADER_SIZE;
+                    record_index.emplace_back(key, payload_start, len);
+                    if (record_index.size() % LAYOUT_SAMPLE_STRIDE == 1) {
+                        payload_sizes.add(len);
+                    }
+                    
+                    current_offset += HEADER_SIZE + len;
+                }
+            }
         }
         
-        // Map the entire file read-only
-        const char* mapped_data = static_cast<const char*>(
-            mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+        if (invalid_length) {
+            std::cerr << "Rank " << rank_ << ": Invalid payload length at offset " 
+                     << current_offset << std::endl;
+        }
         
-        if (mapped_data == MAP_FAILED) {
-            close(fd);
-            throw std::runtime_error("Memory mapping failed for: " + input_file);
+        if (permutation_) {
+            writeChunkPermutation(record_index, mapped, output_file);
+            return;
         }
         
-        // Advise kernel about access pattern
-        madvise(const_cast<char*>(mapped_data), file_stat.st_size, MADV_SEQUENTIAL);
+        sortIndexedChunk(record_index, payload_sizes, output_file, &mapped,
+                         "offset " + std::to_string(start_offset) + " to " + std::to_string(current_offset));
+    }
+
+    // Maps and indexes a bin of input pieces, several pieces at a time,
+    // then sorts the records like a mapped chunk
+    void sortPiecesWithMmap(const std::vector<InputPiece>& pieces, const std::string& output_file) {
+        std::vector<std::unique_ptr<MappedRange>> maps(pieces.size());
+        std::vector<std::vector<RecordView>> indexes(pieces.size());
+        std::exception_ptr error;
+        
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (long long i = 0; i < static_cast<long long>(pieces.size()); ++i) {
+            try {
+                maps[i] = std::make_unique<MappedRange>(pieces[i].path, pieces[i].begin, pieces[i].end);
+                indexMappedRecords(*maps[i], maps[i]->begin(), maps[i]->end(), indexes[i]);
+            } catch (...) {
+                #pragma omp critical(piece_index_error)
+                if (!error) error = std::current_exception();
+            }
+        }
+        if (error) std::rethrow_exception(error);
         
-        // Build record index for our chunk
         std::vector<RecordView> record_index;
-        uint64_t current_offset = start_offset;
+        PayloadSizeHistogram payload_sizes;
+        for (auto& index : indexes) {
+            record_index.insert(record_index.end(), index.begin(), index.end());
+            std::vector<RecordView>().swap(index);
+        }
+        for (size_t i = 0; i < record_index.size(); i += LAYOUT_SAMPLE_STRIDE) {
+            payload_sizes.add(record_index[i].len);
+        }
         
-        while (current_offset < end_offset && current_offset < static_cast<uint64_t>(file_stat.st_size)) {
-            // Read record header from mapped memory with alignment handling
-            const char* record_start = mapped_data + current_offset;
-            
-            if (current_offset + HEADER_SIZE > static_cast<uint64_t>(file_stat.st_size)) {
-                break; // Not enough space for header
-            }
-            
-            // Use memcpy for unaligned loads to avoid UB
-            uint64_t key;
-            uint32_t len;
-            std::memcpy(&key, record_start, sizeof(uint64_t));
-            std::memcpy(&len, record_start + sizeof(uint64_t), sizeof(uint32_t));
-            
-            // Validate payload length
-            if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
-                std::cerr << "Rank " << rank_ << ": Invalid payload length " << len 
-                         << " at offset " << current_offset << std::endl;
-                break;
-            }
-            
-            if (current_offset + HEADER_SIZE + len > static_cast<uint64_t>(file_stat.st_size)) {
-                break; // Not enough space for payload
-            }
-            
-            // Add to index (payload points directly into mapped memory)
-            const char* payload_start = record_start + HEADER_SIZE;
-            record_index.emplace_back(key, payload_start, len);
-            
-            current_offset += HEADER_SIZE + len;
+        sortIndexedChunk(record_index, payload_sizes, output_file, nullptr,
+                         std::to_string(pieces.size()) + " input pieces");
+    }
+
+    // Sorts a mapped chunk's index and writes its {key, input offset}
+    // entries; no payload leaves the mapping
+    void writeChunkPermutation(std::vector<RecordView>& record_index, const MappedRange& mapped,
+                               const std::string& output_file) {
+        std::cout << "Rank " << rank_ << ": Indexed " << record_index.size()
+                 << " records for a permutation" << std::endl;
+        sortRecordViews(record_index);
+        
+        std::vector<PermutationEntry> entries(record_index.size());
+        const long long n = static_cast<long long>(record_index.size());
+        #pragma omp parallel for schedule(static)
+        for (long long i = 0; i < n; ++i) {
+            entries[i] = permutationEntry(record_index[i], mapped);
         }
         
-        std::cout << "Rank " << rank_ << ": Indexed " << record_index.size() 
-                 << " records from offset " << start_offset << " to " << current_offset << std::endl;
+        AsyncWriter writer(output_file);
+        parallelGatherWrite(entries, writer);
+        writer.close();
+    }
+
+    // Decodes the blocks a container range owns, one block-aligned slice per
+    // thread, and sorts the records like a mapped chunk
+    void sortContainerChunk(const std::string& input_file, const ContainerInfo& info,
+                            uint64_t start_offset, uint64_t end_offset, const std::string& output_file) {
+        const int threads = omp_get_max_threads();
+        std::vector<uint64_t> splits = blockAlignedSplits(info, start_offset, end_offset, threads);
+        std::vector<std::vector<char>> decoded(threads);
+        std::vector<std::vector<RecordView>> indexes(threads);
+        std::vector<PayloadSizeHistogram> histograms(threads);
+        std::exception_ptr error;
         
-        // Parallel sort by key using OpenMP
-        if (record_index.size() > 1000) {
-            // Use OpenMP parallel sort for larger datasets
-            const size_t num_threads = omp_get_max_threads();
-            if (num_threads > 1 && record_index.size() > num_threads * 100) {
-                // Parallel quicksort implementation
-                #pragma omp parallel
-                {
-                    #pragma omp single nowait
-                    {
-                        parallelQuickSort(record_index, 0, record_index.size() - 1);
+        #pragma omp parallel num_threads(threads)
+        {
+            const int tid = omp_get_thread_num();
+            try {
+                RangeReader reader(input_file, splits[tid], splits[tid + 1]);
+                std::vector<char>& bytes = decoded[tid];
+                bytes.reserve(splits[tid + 1] - splits[tid]);
+                for (RecordPtr r = reader.next(); r.get(); r = reader.next()) {
+                    bytes.insert(bytes.end(), r.data(), r.data() + r.size());
+                }
+                
+                // Index only once the buffer no longer moves
+                for (size_t pos = 0; pos < bytes.size(); ) {
+                    uint64_t key;
+                    uint32_t len;
+                    std::memcpy(&key, bytes.data() + pos, sizeof(uint64_t));
+                    std::memcpy(&len, bytes.data() + pos + sizeof(uint64_t), sizeof(uint32_t));
+                    indexes[tid].emplace_back(key, bytes.data() + pos + HEADER_SIZE, len);
+                    if (indexes[tid].size() % LAYOUT_SAMPLE_STRIDE == 1) {
+                        histograms[tid].add(len);
                     }
+                    pos += HEADER_SIZE + len;
                 }
-            } else {
-                std::sort(record_index.begin(), record_index.end());
+            } catch (...) {
+                #pragma omp critical(container_decode_error)
+                if (!error) error = std::current_exception();
             }
-        } else {
-            // Sequential sort for small datasets
-            std::sort(record_index.begin(), record_index.end());
         }
+        if (error) std::rethrow_exception(error);
         
-        // Write sorted records to output file
-        std::ofstream out(output_file, std::ios::binary);
-        if (!out) {
-            munmap(const_cast<char*>(mapped_data), file_stat.st_size);
-            close(fd);
-            throw std::runtime_error("Cannot create output file: " + output_file);
+        std::vector<RecordView> record_index;
+        PayloadSizeHistogram payload_sizes;
+        for (int t = 0; t < threads; ++t) {
+            record_index.insert(record_index.end(), indexes[t].begin(), indexes[t].end());
+            std::vector<RecordView>().swap(indexes[t]);
+            payload_sizes.merge(histograms[t]);
+        }
+        
+        sortIndexedChunk(record_index, payload_sizes, output_file, nullptr,
+                         "container blocks " + std::to_string(info.blockAtOrAfter(start_offset)) + " to " +
+                         std::to_string(info.blockAtOrAfter(end_offset)));
+    }
+
+    // Sorts records [first, first + count) of a columnar input from its key
+    // column; payloads are gathered once from the mapped heap
+    void sortColumnarChunk(const std::string& input_file, const ColumnarInfo& info, uint64_t first,
+                           uint64_t count, uint64_t heap_base, const std::string& output_file) {
+        ColumnarIndex index = loadColumnarIndex(input_file, info, first, count, heap_base);
+        PayloadSizeHistogram payload_sizes;
+        for (size_t i = 0; i < index.views.size(); i += LAYOUT_SAMPLE_STRIDE) {
+            payload_sizes.add(index.views[i].len);
         }
         
-        for (const auto& record : record_index) {
-            // Write header
-            out.write(reinterpret_cast<const char*>(&record.key), sizeof(uint64_t));
-            out.write(reinterpret_cast<const char*>(&record.len), sizeof(uint32_t));
-            // Write payload
-            out.write(record.payload, record.len);
+        sortIndexedChunk(index.views, payload_sizes, output_file, index.heap.get(),
+                         "columnar records " + std::to_string(first) + " to " + std::to_string(first + count));
+    }
+
+    // Sorts an index with the layout its payload sizes call for and writes
+    // it; with a mapping, windows are released as their records are gathered
+    void sortIndexedChunk(std::vector<RecordView>& record_index, const PayloadSizeHistogram& payload_sizes,
+                          const std::string& output_file, MappedRange* mapped, const std::string& source) {
+        // Small payloads are moved with their records, large ones stay behind the index
+        SortedChunk sorted;
+        sorted.layout = payload_sizes.choose();
+        
+        std::cout << "Rank " << rank_ << ": Indexed " << record_index.size() 
+                 << " records from " << source
+                 << " (" << layoutName(sorted.layout) << " layout)" << std::endl;
+        
+        if (sorted.layout == PayloadLayout::Inline) {
+            sorted.inline_records = radixSortInline(record_index);
+        } else if (sorted.layout == PayloadLayout::Indirect) {
+            sortRecordViews(record_index);
+            sorted.indirect = std::move(record_index);
+        } else {
+            // Split by size class: small records inline, the rest indirect
+            auto large_begin = std::stable_partition(record_index.begin(), record_index.end(),
+                [](const RecordView& r) { return r.len <= INLINE_PAYLOAD_MAX; });
+            std::vector<RecordView> small(record_index.begin(), large_begin);
+            record_index.erase(record_index.begin(), large_begin);
+            sorted.inline_records = radixSortInline(small);
+            sortRecordViews(record_index);
+            sorted.indirect = std::move(record_index);
         }
         
-        // Cleanup
-        munmap(const_cast<char*>(mapped_data), file_stat.st_size);
-        close(fd);
+        // Inline records were copied out; only the indirect part pins the mapping
+        if (mapped) {
+            for (const auto& record : sorted.indirect) {
+                mapped->retain(record.payload, record.len);
+            }
+            mapped->releaseUnreferenced();
+        }
         
-        // Flush output and close
-        out.flush();
-        out.close();
+        // Write sorted records (parallel gather + async writer), handing
+        // mapped windows back to the kernel as their records are gathered
+        writeSortedChunk(output_file, sorted, [mapped](const RecordView* first, const RecordView* last) {
+            if (!mapped) return;
+            for (; first != last; ++first) {
+                mapped->release(first->payload, first->len);
+            }
+        });
     }
 
     // Improved large file transfer with proper MPI datatypes
     void sendLargeFile(const std::string& file_path, int dest_rank) {
-        std::ifstream inFile(file_path, std::ios::binary | std::ios::ate);
-        if (!inFile) {
+        if (!storage().exists(file_path)) {
             uint64_t size = 0;
             MPI_Send(&size, 1, MPI_UINT64_T, dest_rank, 0, MPI_COMM_WORLD);
             return;
         }
 
-        uint64_t file_size = inFile.tellg();
-        inFile.seekg(0, std::ios::beg);
+        std::unique_ptr<StorageFile> inFile = storage().open(file_path, OpenMode::Read);
+        uint64_t file_size = inFile->size();
+        inFile->readahead(0, file_size, AccessHint::Sequential);
 
         // Send file size using portable MPI datatype
         MPI_Send(&file_size, 1, MPI_UINT64_T, dest_rank, 0, MPI_COMM_WORLD);
@@ -362,7 +531,7 @@ private:
 
             while (remaining > 0) {
                 size_t chunk_size = std::min(buffer.size(), static_cast<size_t>(remaining));
-                inFile.read(buffer.data(), chunk_size);
+                inFile->pread(buffer.data(), chunk_size, file_size - remaining);
                 
                 // Use non-blocking send to avoid potential deadlocks
                 MPI_Request request;
@@ -372,10 +541,9 @@ private:
                 remaining -= chunk_size;
             }
         }
-        inFile.close();
     }
 
-    void receiveLargeFile(int source_rank, std::ofstream& outFile) {
+    void receiveLargeFile(int source_rank, StorageFile& outFile) {
         uint64_t file_size = 0;
         MPI_Status status;
         
@@ -389,13 +557,15 @@ private:
             while (remaining > 0) {
                 size_t chunk_size = std::min(buffer.size(), static_cast<size_t>(remaining));
                 MPI_Recv(buffer.data(), chunk_size, MPI_BYTE, source_rank, 1, MPI_COMM_WORLD, &status);
-                outFile.write(buffer.data(), chunk_size);
+                outFile.pwrite(buffer.data(), chunk_size, file_size - remaining);
                 remaining -= chunk_size;
             }
         }
     }
-    // Tree-based merge to reduce root bottleneck with fixed barrier logic
-    void treeMerge(const std::string& local_sorted_file, const std::string& final_output) {
+    // Tree-based merge to reduce root bottleneck with fixed barrier logic;
+    // the last merge writes final_output in `format` directly
+    void treeMerge(const std::string& local_sorted_file, const std::string& final_output,
+                   const std::string& input_file, OutputFormat format) {
         // Simple binary tree merge - can be extended to k-ary tree
         int step = 1;
         std::string current_file = local_sorted_file;
@@ -407,20 +577,25 @@ private:
                 if (partner < world_size_) {
                     // Receive partner's sorted data
                     std::string received_file = getNextTempFileName();
-                    std::ofstream temp_out(received_file, std::ios::binary);
-                    receiveLargeFile(partner, temp_out);
-                    temp_out.close();
+                    receiveLargeFile(partner, *storage().open(received_file, OpenMode::Write));
                     
                     // Merge current file with received file
-                    std::string merged_file = getNextTempFileName();
+                    const bool last_merge = 2 * step >= world_size_ && !gensort_ && !permutation_;
+                    std::string merged_file = last_merge ? final_output : getNextTempFileName();
                     std::vector<std::string> files_to_merge = {current_file, received_file};
-                    omp_sorter_.kWayMerge(files_to_merge, merged_file);
+                    if (gensort_) {
+                        gensortMerge(files_to_merge, merged_file);
+                    } else if (permutation_) {
+                        mergePermutations(files_to_merge, merged_file, input_file);
+                    } else {
+                        omp_sorter_.kWayMerge(files_to_merge, merged_file, STAGING_BUFFER_SIZE, format);
+                    }
                     
                     // Clean up old files
                     if (current_file != local_sorted_file) {
-                        fs::remove(current_file);
+                        storage().remove(current_file);
                     }
-                    fs::remove(received_file);
+                    storage().remove(received_file);
                     
                     current_file = merged_file;
                 }
@@ -439,34 +614,63 @@ private:
         // Rank 0 has the final result
         if (rank_ == 0) {
             if (current_file != final_output) {
-                // Move final result to output location
-                fs::copy_file(current_file, final_output, fs::copy_options::overwrite_existing);
+                // Move final result to output location, encoding it on the way
+                if (format == OutputFormat::Raw) {
+                    copyFile(current_file, final_output);
+                } else {
+                    AsyncWriter writer(final_output, STAGING_BUFFER_SIZE, outputSink(final_output, format));
+                    streamFile(current_file, writer);
+                    writer.close();
+                }
                 if (current_file != local_sorted_file) {
-                    fs::remove(current_file);
+                    storage().remove(current_file);
                 }
             }
         }
         
         // Clean up local sorted file (all ranks can do this)
         if (rank_ != 0 || current_file == local_sorted_file) {
-            if (fs::exists(local_sorted_file)) {
-                fs::remove(local_sorted_file);
+            if (storage().exists(local_sorted_file)) {
+                storage().remove(local_sorted_file);
             }
         }
     }
 
 public:
-    HybridOpenMPSort(int threads)
-        : omp_sorter_(threads), file_id_(0), total_records_(0)
+    /**
+     * @param threads OpenMP threads (or FastFlow workers) per rank
+     * @param engine Intra-rank engine
+     * @param memory_budget Memory budget of a node, shared by its ranks
+     */
+    HybridOpenMPSort(int threads, IntraRankEngine engine = IntraRankEngine::OpenMP,
+                     size_t memory_budget = MAX_MEMORY_USAGE)
+        : memory_budget_(rankMemoryShare(memory_budget)), omp_sorter_(threads, memory_budget_),
+          engine_(engine), gensort_(gensortRecordsRequested()), permutation_(permutationOutputRequested()),
+          gensort_sorter_(threads, memory_budget_), file_id_(0), total_records_(0)
     {
+#ifndef USE_FASTFLOW
+        if (engine_ == IntraRankEngine::FastFlow) {
+            throw std::runtime_error("FastFlow engine requested but built without USE_FASTFLOW");
+        }
+#endif
         MPI_Comm_size(MPI_COMM_WORLD, &world_size_);
         MPI_Comm_rank(MPI_COMM_WORLD, &rank_);
         
-        // Create unique temp directory for this rank (configurable via TMPDIR)
-        const char* tmpdir = std::getenv("TMPDIR");
-        std::string base_dir = tmpdir ? tmpdir : ".";
-        temp_dir_ = base_dir + "/mpi_tmp_" + std::to_string(rank_);
-        fs::create_directories(temp_dir_);
+        // Private temp directory for this rank (under TMPDIR)
+        temp_dir_ = makeTempDir("mpi_tmp_" + std::to_string(rank_));
+
+#ifdef USE_FASTFLOW
+        if (engine_ == IntraRankEngine::FastFlow) {
+            try {
+                ff_sorter_ = std::make_unique<FastFlowMergeSort>(threads, memory_budget_,
+                                                                 FastFlowStrategy::FarmMerge, true,
+                                                                 temp_dir_ + "/ff");
+            } catch (...) {
+                fs::remove_all(temp_dir_);
+                throw;
+            }
+        }
+#endif
         
         // Set OpenMP thread affinity for NUMA locality
         if (std::getenv("OMP_PROC_BIND") == nullptr) {
@@ -484,31 +688,86 @@ public:
         }
     }
 
-    void sort(const std::string& input_file, const std::string& output_file) {
+    // Sorts input_file across all ranks; rank 0 writes output_file in `format`
+    void sort(const std::string& input_file, const std::string& output_file,
+              OutputFormat format = OutputFormat::Raw) {
         Timer timer("MPI + OpenMP total sort time");
         
         try {
-            // Phase 1: Record boundary detection (rank 0 only)
-            scanRecordBoundaries(input_file);
-            
-            // Phase 2: Broadcast boundaries to all ranks
-            broadcastRecordBoundaries();
+            if (permutation_) {
+                if (gensort_) throw std::runtime_error("Gensort records have no permutation output");
+                requirePermutableInput(input_file);
+            }
             
-            // Phase 3: Calculate record-aligned chunk for this rank
-            auto [start_offset, end_offset] = getRecordAlignedChunk();
+            // Gensort records, block containers and columnar files are split
+            // by every rank at once; raw files need rank 0 to find the
+            // record boundaries
+            ContainerInfo container;
+            const bool is_container = !gensort_ && isContainerFile(input_file, &container);
+            ColumnarInfo columnar;
+            const bool is_columnar = !gensort_ && !is_container && isColumnarFile(input_file, &columnar);
+            uint64_t start_offset, end_offset;
+            uint64_t first_record = 0, record_count = 0, heap_base = 0;
+            if (gensort_) {
+                // Fixed-size records: the split is arithmetic
+                const uint64_t records = gensortRecordCount(input_file);
+                first_record = records * rank_ / world_size_;
+                record_count = records * (rank_ + 1) / world_size_ - first_record;
+                start_offset = first_record * GENSORT_RECORD_SIZE;
+                end_offset = (first_record + record_count) * GENSORT_RECORD_SIZE;
+            } else if (is_container) {
+                std::vector<uint64_t> splits = blockAlignedSplits(container, 0, container.file_size, world_size_);
+                start_offset = splits[rank_];
+                end_offset = splits[rank_ + 1];
+            } else if (is_columnar) {
+                // Split by record count from the header alone; each rank's
+                // heap offset is an exclusive scan of its payload bytes
+                first_record = columnar.records * rank_ / world_size_;
+                record_count = columnar.records * (rank_ + 1) / world_size_ - first_record;
+                start_offset = columnar.entryOffset(first_record);
+                end_offset = columnar.entryOffset(first_record + record_count);
+                uint64_t local_bytes = payloadBytes(readKeyColumn(input_file, columnar, first_record, record_count));
+                MPI_Exscan(&local_bytes, &heap_base, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+                if (rank_ == 0) heap_base = 0;
+            } else {
+                // Phase 1: Record boundary detection (rank 0 only)
+                scanRecordBoundaries(input_file);
+                
+                // Phase 2: Broadcast boundaries to all ranks
+                broadcastRecordBoundaries();
+                
+                // Phase 3: Calculate record-aligned chunk for this rank
+                std::tie(start_offset, end_offset) = getRecordAlignedChunk();
+            }
             
             std::cout << "Rank " << rank_ << " processing record-aligned chunk: bytes " 
                      << start_offset << " to " << end_offset << std::endl;
             
-            // Phase 4: Sort local chunk using memory mapping and record views
+            // Phase 4: Sort local chunk with the intra-rank engine
             std::string sorted_local = getNextTempFileName();
-            sortChunkWithMmap(input_file, start_offset, end_offset, sorted_local);
+            if (gensort_) {
+                gensort_sorter_.sortRange(input_file, first_record, record_count, sorted_local);
+            } else
+#ifdef USE_FASTFLOW
+            if (engine_ == IntraRankEngine::FastFlow && is_columnar) {
+                ff_sorter_->sortColumns(input_file, columnar, first_record, record_count, heap_base, sorted_local);
+            } else if (engine_ == IntraRankEngine::FastFlow) {
+                ff_sorter_->sortRange(input_file, start_offset, end_offset, sorted_local);
+            } else
+#endif
+            if (is_columnar) {
+                sortColumnarChunk(input_file, columnar, first_record, record_count, heap_base, sorted_local);
+            } else if (is_container) {
+                sortContainerChunk(input_file, container, start_offset, end_offset, sorted_local);
+            } else {
+                sortChunkWithMmap(input_file, start_offset, end_offset, sorted_local);
+            }
             
             // Sync point after local sorting
             MPI_Barrier(MPI_COMM_WORLD);
             
             // Phase 5: Tree-based merge to avoid root bottleneck
-            treeMerge(sorted_local, output_file);
+            treeMerge(sorted_local, output_file, input_file, format);
             
             if (rank_ == 0) {
                 std::cout << "MPI+OpenMP sort completed successfully with " 
@@ -523,6 +782,74 @@ public:
         // Final sync to ensure all processes complete
         MPI_Barrier(MPI_COMM_WORLD);
     }
+
+    /**
+     * Sorts this rank's bin of the packed input files
+     * @return The sorted run, or an empty path if a split was misaligned
+     */
+    std::string sortBin(const std::vector<std::string>& input_files, RecordSplitter split) {
+        std::vector<std::vector<InputPiece>> bins = packInputs(input_files, world_size_, split);
+        const std::vector<InputPiece>& pieces = bins[rank_];
+        
+        std::cout << "Rank " << rank_ << " processing " << pieces.size() << " pieces of "
+                 << input_files.size() << " input files, " << pieceBytes(pieces) << " bytes" << std::endl;
+        
+        std::string sorted_local = getNextTempFileName();
+        try {
+#ifdef USE_FASTFLOW
+            if (engine_ == IntraRankEngine::FastFlow) {
+                ff_sorter_->sortPieces(pieces, sorted_local);
+            } else
+#endif
+            sortPiecesWithMmap(pieces, sorted_local);
+        } catch (const std::exception& e) {
+            // Other errors may follow from a misaligned split elsewhere; with
+            // exact splits they are genuine
+            if (split == exactRecordSplits) throw;
+            std::cout << "Rank " << rank_ << ": " << e.what() << std::endl;
+            return std::string();
+        }
+        return sorted_local;
+    }
+
+    // Sorts the virtual concatenation of several raw record files: every
+    // rank computes the same byte-balanced packing and sorts its own bin
+    void sortFiles(const std::vector<std::string>& input_files, const std::string& output_file,
+                   OutputFormat format = OutputFormat::Raw) {
+        Timer timer("MPI + OpenMP multi-file sort time");
+        
+        try {
+            if (gensort_ || permutation_) {
+                throw std::runtime_error("Gensort and permutation sorts need a single input file");
+            }
+            requireRawInputs(input_files);
+            
+            // A split off a record boundary shows on the rank reading the
+            // piece before it, so every rank redoes its bin with exact splits
+            std::string sorted_local = sortBin(input_files, recordAlignedSplits);
+            int misaligned = sorted_local.empty();
+            MPI_Allreduce(MPI_IN_PLACE, &misaligned, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+            if (misaligned) {
+                if (!sorted_local.empty()) storage().remove(sorted_local);
+                if (rank_ == 0) std::cout << "Splitting again by a full header walk" << std::endl;
+                sorted_local = sortBin(input_files, exactRecordSplits);
+            }
+            
+            MPI_Barrier(MPI_COMM_WORLD);
+            treeMerge(sorted_local, output_file, input_files.front(), format);
+            
+            if (rank_ == 0) {
+                std::cout << "MPI+OpenMP sort of " << input_files.size() << " files completed with "
+                         << world_size_ << " processes" << std::endl;
+            }
+            
+        } catch (const std::exception& e) {
+            std::cerr << "Rank " << rank_ << " error: " << e.what() << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
 };
 
 #endif // MPI_OPENMP_SORT_HPP
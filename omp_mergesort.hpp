@@ -1,110 +1,276 @@
 #pragma once
 
 #include "record_structure.hpp"
+#include "parallel_gather.hpp"
+#include "range_reader.hpp"
+#include "permutation_output.hpp"
+#include "input_set.hpp"
+#include "output_format.hpp"
 #include <vector>
 #include <algorithm>
 #include <fstream>
 #include <stdexcept>
 #include <omp.h>
 #include <memory>
-#include <mutex>
 #include <queue>
+#include <string>
+#include <cstdlib>
+#include <exception>
+#include <atomic>
+#include <filesystem>
+#include <iterator>
+#include <unistd.h>
+
+// Runs merged at once by each task of an intermediate merge pass
+constexpr size_t MERGE_FAN_IN = 64;
+
+// Read buffer per input stream of a file merge
+constexpr size_t MERGE_READ_BUFFER = 1 * MB;
+
+// Staging buffer of writers spilling runs; several may be active at once
+constexpr size_t SPILL_BUFFER_SIZE = 8 * MB;
+
+// Heap and bookkeeping bytes charged per RecordPtr against the budget
+constexpr size_t RECORD_OVERHEAD = sizeof(RecordPtr) + 16;
+
+// Fallback leaf size of the parallel mergesort when the L2 size is unknown
+constexpr size_t SORT_CACHE_BYTES = 512 * 1024;
+
+// Below this many elements a merge is done by a single task
+constexpr size_t PARALLEL_MERGE_GRAIN = 64 * 1024;
+
+// Elements of T per mergesort leaf: half the L2 cache, so a leaf and its
+// share of the scratch buffer stay resident while std::sort runs
+template <typename T>
+size_t sortLeafSize() {
+    long l2 = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    size_t bytes = l2 > 0 ? static_cast<size_t>(l2) / 2 : SORT_CACHE_BYTES;
+    return std::max<size_t>(bytes / sizeof(T), 1024);
+}
+
+// Merge path: how many of the first `diag` merged outputs come from a
+template <typename T, typename Compare>
+size_t mergePathSplit(const T* a, size_t na, const T* b, size_t nb, size_t diag, Compare comp) {
+    size_t lo = diag > nb ? diag - nb : 0;
+    size_t hi = std::min(diag, na);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (comp(b[diag - mid - 1], a[mid])) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+// Moves the merge of a and b into out; large merges are cut along the merge
+// path into equal output segments, each merged by its own task
+template <typename T, typename Compare>
+void parallelMerge(T* a, size_t na, T* b, size_t nb, T* out, Compare comp) {
+    const size_t total = na + nb;
+    if (total <= PARALLEL_MERGE_GRAIN) {
+        std::merge(std::make_move_iterator(a), std::make_move_iterator(a + na),
+                   std::make_move_iterator(b), std::make_move_iterator(b + nb), out, comp);
+        return;
+    }
+
+    // All splits are found before any task starts moving elements out
+    const size_t segments = (total + PARALLEL_MERGE_GRAIN - 1) / PARALLEL_MERGE_GRAIN;
+    std::vector<size_t> split(segments + 1);
+    for (size_t s = 0; s <= segments; ++s) {
+        split[s] = mergePathSplit(a, na, b, nb, total * s / segments, comp);
+    }
+
+    for (size_t s = 0; s < segments; ++s) {
+        #pragma omp task firstprivate(s) shared(split)
+        {
+            size_t diag_lo = total * s / segments;
+            size_t diag_hi = total * (s + 1) / segments;
+            size_t ia = split[s];
+            size_t ja = split[s + 1];
+            size_t ib = diag_lo - ia;
+            size_t jb = diag_hi - ja;
+            std::merge(std::make_move_iterator(a + ia), std::make_move_iterator(a + ja),
+                       std::make_move_iterator(b + ib), std::make_move_iterator(b + jb),
+                       out + diag_lo, comp);
+        }
+    }
+    #pragma omp taskwait
+}
+
+// Task-recursive mergesort of src[0, n) ping-ponging with tmp; the result
+// ends in tmp when to_tmp is set, in src otherwise
+template <typename T, typename Compare>
+void mergeSortTasks(T* src, T* tmp, size_t n, bool to_tmp, size_t leaf, Compare comp) {
+    if (n <= leaf) {
+        std::sort(src, src + n, comp);
+        if (to_tmp) std::move(src, src + n, tmp);
+        return;
+    }
+
+    const size_t mid = n / 2;
+    #pragma omp task
+    mergeSortTasks(src, tmp, mid, !to_tmp, leaf, comp);
+    #pragma omp task
+    mergeSortTasks(src + mid, tmp + mid, n - mid, !to_tmp, leaf, comp);
+    #pragma omp taskwait
+
+    // Both halves sit in the buffer opposite to where the result must go
+    T* from = to_tmp ? src : tmp;
+    T* into = to_tmp ? tmp : src;
+    parallelMerge(from, mid, from + mid, n - mid, into, comp);
+}
+
+/**
+ * Parallel mergesort for use inside an existing parallel region (e.g. from
+ * a task): cache-sized leaves are sorted with std::sort and merged in
+ * parallel along merge paths by tasks of the enclosing team.
+ */
+template <typename T, typename Compare>
+void parallelMergeSortTasks(std::vector<T>& data, Compare comp) {
+    const size_t leaf = sortLeafSize<T>();
+    if (data.size() <= leaf) {
+        std::sort(data.begin(), data.end(), comp);
+        return;
+    }
+    std::vector<T> tmp(data.size());
+    mergeSortTasks(data.data(), tmp.data(), data.size(), false, leaf, comp);
+}
+
+// Parallel mergesort on a fresh team of `threads` OpenMP threads
+template <typename T, typename Compare>
+void parallelMergeSort(std::vector<T>& data, Compare comp, int threads) {
+    if (threads <= 1 || data.size() <= sortLeafSize<T>()) {
+        std::sort(data.begin(), data.end(), comp);
+        return;
+    }
+    #pragma omp parallel num_threads(threads)
+    #pragma omp single
+    parallelMergeSortTasks(data, comp);
+}
+
+// Orders records by key (the wide key when SORT_KEY_BYTES is set)
+inline bool recordKeyLess(const RecordPtr& a, const RecordPtr& b) {
+    return recordLess(a.get(), b.get());
+}
 
 class OpenMPMergeSort {
 private:
     int num_threads_;
-    std::mutex io_mutex_;
+    size_t memory_budget_;          // Bytes of records held in memory at once
+    std::string temp_dir_;          // Spilled runs; created on first use, empty otherwise
+    int file_id_;
+    std::string permutation_input_; // Input a permutation sort's runs point into, if any
 
     struct ChunkData {
         std::vector<RecordPtr> records;
-        size_t start_pos;
-        size_t end_pos;
     };
 
 public:
-    OpenMPMergeSort(int threads) : num_threads_(threads) {
+    OpenMPMergeSort(int threads, size_t memory_budget = MAX_MEMORY_USAGE)
+        : num_threads_(threads), memory_budget_(memory_budget), file_id_(0) {
         omp_set_num_threads(threads);
         omp_set_dynamic(0);
     }
 
-    void sort(const std::string& input, const std::string& output) {
+    ~OpenMPMergeSort() {
+        removeSpillDir();
+    }
+
+    OpenMPMergeSort(const OpenMPMergeSort&) = delete;
+    OpenMPMergeSort& operator=(const OpenMPMergeSort&) = delete;
+
+    // Sorts in memory when the input fits the budget, out of core otherwise;
+    // the output is written in `format` by the final merge or gather
+    void sort(const std::string& input, const std::string& output, OutputFormat format = OutputFormat::Raw) {
         Timer timer("OpenMP sort total time");
         size_t file_size = getFileSize(input);
 
-        // Phase 1: Parallel read and local sort
-        std::vector<ChunkData> chunks(num_threads_);
-        
-        #pragma omp parallel num_threads(num_threads_)
-        {
-            int tid = omp_get_thread_num();
-            std::ifstream in(input, std::ios::binary);
-            if (!in.is_open()) {
-                #pragma omp critical
-                throw std::runtime_error("Cannot open input file in thread " + std::to_string(tid));
-            }
+        if (permutationOutputRequested()) {
+            permutationSort(input, output, file_size);
+            return;
+        }
 
-            chunks[tid].start_pos = tid * (file_size / num_threads_);
-            chunks[tid].end_pos = (tid == num_threads_ - 1) ? file_size : (tid + 1) * (file_size / num_threads_);
-            
-            in.seekg(chunks[tid].start_pos);
-            while (in.tellg() < static_cast<std::streampos>(chunks[tid].end_pos) && in.peek() != EOF) {
-                RecordPtr r;
-                {
-                    std::lock_guard<std::mutex> lock(io_mutex_);
-                    r = readRecord(in);
+        ColumnarInfo columnar;
+        if (isColumnarFile(input, &columnar) && columnar.records * sizeof(RecordView) <= memory_budget_ / 2) {
+            columnarSort(input, columnar, output, format);
+            return;
+        }
+
+        if (file_size > memory_budget_ / 2) {
+            externalSort({{input, 0, file_size}}, output, format);
+        } else {
+            withRecordSplits([&](RecordSplitter split) {
+                // One record-aligned range per thread
+                std::vector<uint64_t> splits = split(input, 0, file_size, num_threads_);
+                std::vector<std::vector<InputPiece>> bins(num_threads_);
+                for (int t = 0; t < num_threads_; ++t) {
+                    bins[t].push_back({input, splits[t], splits[t + 1]});
                 }
-                if (!r.get()) break;
-                chunks[tid].records.emplace_back(std::move(r));
-            }
-            
-            // Local sort
-            std::sort(chunks[tid].records.begin(), chunks[tid].records.end(),
-                [](const RecordPtr& a, const RecordPtr& b) {
-                    return a.get()->key < b.get()->key;
-                });
+                inMemorySort(bins, output, format);
+            });
         }
+    }
 
-        // Phase 2: Parallel merge
-        std::vector<RecordPtr> final_sorted = kWayMerge(chunks);
+    /**
+     * Sorts the virtual concatenation of several raw record files. In
+     * memory, each thread ingests the files of a byte-balanced bin; out of
+     * core, runs are read across file boundaries.
+     */
+    void sortFiles(const std::vector<std::string>& files, const std::string& output,
+                   OutputFormat format = OutputFormat::Raw) {
+        Timer timer("OpenMP multi-file sort total time");
+        requireRawInputs(files);
+        if (permutationOutputRequested()) {
+            throw std::runtime_error("Permutation output needs a single input file");
+        }
 
-        // Phase 3: Write output
-        writeRecords(output, final_sorted);
+        std::vector<InputPiece> pieces = wholeFiles(files);
+        std::cout << "Sorting " << files.size() << " input files, " << pieceBytes(pieces) / MB << " MB" << std::endl;
+        if (pieceBytes(pieces) > memory_budget_ / 2) {
+            externalSort(pieces, output, format);
+        } else {
+            withRecordSplits([&](RecordSplitter split) {
+                inMemorySort(packInputs(files, num_threads_, split), output, format);
+            });
+        }
     }
 
     // Method for sorting records in-memory (used by MPI)
     void sortRecords(std::vector<RecordPtr>& records) {
         Timer timer("OpenMP in-memory sort");
-        
-        // Simple sequential sort (thread-safe)
-        std::sort(records.begin(), records.end(),
-            [](const RecordPtr& a, const RecordPtr& b) {
-                return a.get()->key < b.get()->key;
-            });
+        parallelMergeSort(records, recordKeyLess, num_threads_);
     }
 
     // K-way merge for MPI (merges multiple sorted files)
-    void kWayMerge(const std::vector<std::string>& inputFiles, const std::string& outputFile) {
-        std::vector<std::ifstream> files(inputFiles.size());
+    void kWayMerge(const std::vector<std::string>& inputFiles, const std::string& outputFile,
+                   size_t stagingBytes = STAGING_BUFFER_SIZE, OutputFormat format = OutputFormat::Raw) {
+        if (!permutation_input_.empty()) {
+            mergePermutations(inputFiles, outputFile, permutation_input_);
+            return;
+        }
+        
+        std::vector<std::unique_ptr<RangeReader>> readers(inputFiles.size());
         std::vector<RecordPtr> currentRecords(inputFiles.size());
         
-        // Open all input files
+        // Open all input files with large read buffers
         for (size_t i = 0; i < inputFiles.size(); ++i) {
-            files[i].open(inputFiles[i], std::ios::binary);
-            if (!files[i]) {
-                throw std::runtime_error("Cannot open file: " + inputFiles[i]);
-            }
-            currentRecords[i] = readRecord(files[i]);
+            readers[i] = std::make_unique<RangeReader>(inputFiles[i], 0, UINT64_MAX, MERGE_READ_BUFFER);
+            currentRecords[i] = readers[i]->next();
         }
         
-        std::ofstream outFile(outputFile, std::ios::binary);
-        if (!outFile) {
-            throw std::runtime_error("Cannot create output file: " + outputFile);
-        }
+        AsyncWriter writer(outputFile, stagingBytes, outputSink(outputFile, format));
+        RecordBuffer buffer;
         
-        // Merge using priority queue
-        using HeapEntry = std::pair<uint64_t, size_t>; // key, file_index
-        auto cmp = [](const HeapEntry& a, const HeapEntry& b) {
-            return a.first > b.first; // min-heap
+        // Merge using priority queue; full records are only compared on prefix ties
+        using HeapEntry = std::pair<uint64_t, size_t>; // sort prefix, file_index
+        auto cmp = [&currentRecords](const HeapEntry& a, const HeapEntry& b) {
+            if (a.first != b.first) return a.first > b.first; // min-heap
+            return wideKeyBytes() && recordLess(currentRecords[b.second].get(), currentRecords[a.second].get());
         };
         
         std::priority_queue<HeapEntry, std::vector<HeapEntry>, decltype(cmp)> heap(cmp);
@@ -112,7 +278,7 @@ public:
         // Initialize heap
         for (size_t i = 0; i < inputFiles.size(); ++i) {
             if (currentRecords[i].get()) {
-                heap.emplace(currentRecords[i].get()->key, i);
+                heap.emplace(sortPrefix(currentRecords[i].get()->key, currentRecords[i].get()->payload), i);
             }
         }
         
@@ -121,28 +287,336 @@ public:
             auto [key, fileIndex] = heap.top();
             heap.pop();
             
-            // Write the smallest record
-            writeRecord(outFile, currentRecords[fileIndex]);
+            // Stage the smallest record for the writer
+            writer.append(buffer, currentRecords[fileIndex].data(), currentRecords[fileIndex].size());
             
             // Read next record from the same file
-            currentRecords[fileIndex] = readRecord(files[fileIndex]);
+            currentRecords[fileIndex] = readers[fileIndex]->next();
             if (currentRecords[fileIndex].get()) {
-                heap.emplace(currentRecords[fileIndex].get()->key, fileIndex);
+                heap.emplace(sortPrefix(currentRecords[fileIndex].get()->key,
+                                        currentRecords[fileIndex].get()->payload), fileIndex);
             }
         }
         
-        outFile.close();
-        for (auto& file : files) {
-            file.close();
-        }
+        writer.flush(buffer);
+        writer.close();
     }
 
 private:
-    std::vector<RecordPtr> kWayMerge(std::vector<ChunkData>& chunks) {
+    std::string nextRunFileName() {
+        return spillDir() + "/run_" + std::to_string(file_id_++) + ".tmp";
+    }
+
+    // This instance's spill directory (under TMPDIR), created on first use
+    const std::string& spillDir() {
+        if (temp_dir_.empty()) temp_dir_ = makeTempDir("omp_tmp");
+        return temp_dir_;
+    }
+
+    // Removes the spill directory, if this instance created one
+    void removeSpillDir() noexcept {
+        if (temp_dir_.empty()) return;
+        std::error_code ignored;
+        std::filesystem::remove_all(temp_dir_, ignored);
+        temp_dir_.clear();
+    }
+
+    // Records the first exception raised inside a parallel region. A
+    // MisalignedSplit wins: errors of other readers may follow from it.
+    static void captureError(std::exception_ptr& error) {
+        std::exception_ptr current = std::current_exception();
+        bool misaligned = false;
+        try {
+            throw;
+        } catch (const MisalignedSplit&) {
+            misaligned = true;
+        } catch (...) {
+        }
+        #pragma omp critical(omp_sort_error)
+        if (!error || misaligned) error = current;
+    }
+
+    // Sorts a columnar input by its key column alone; payloads stay in the
+    // mapped heap and are read once, by the final gather
+    void columnarSort(const std::string& input, const ColumnarInfo& info, const std::string& output,
+                      OutputFormat format) {
+        Timer timer("OpenMP columnar sort");
+        ColumnarIndex index = loadColumnarIndex(input, info, 0, info.records, 0);
+        parallelMergeSort(index.views, std::less<RecordView>(), num_threads_);
+
+        AsyncWriter writer(output, STAGING_BUFFER_SIZE, outputSink(output, format));
+        parallelGatherWrite(index.views, writer);
+        writer.close();
+    }
+
+    /**
+     * Writes the sorted permutation of a raw input. Records are indexed in
+     * place over one mapping and only {key, offset} entries are written;
+     * when the index outgrows the budget, byte ranges are sorted into
+     * permutation runs that mergeRuns combines by key.
+     */
+    void permutationSort(const std::string& input, const std::string& output, size_t file_size) {
+        Timer timer("OpenMP permutation sort");
+        requirePermutableInput(input);
+        withRecordSplits([&](RecordSplitter split) {
+            permutationSort(input, output, file_size, split);
+        });
+    }
+
+    void permutationSort(const std::string& input, const std::string& output, size_t file_size,
+                         RecordSplitter split) {
+        MappedRange mapped(input, 0, file_size);
+
+        // Smallest records need the most index bytes per input byte
+        const uint64_t run_bytes = std::max<uint64_t>(1, memory_budget_ / 2 * (HEADER_SIZE + PAYLOAD_MIN) /
+                                                             (sizeof(RecordView) + sizeof(PermutationEntry)));
+        const size_t runs = static_cast<size_t>((file_size + run_bytes - 1) / run_bytes);
+        if (runs <= 1) {
+            permutationRun(mapped, split(input, 0, file_size, num_threads_), output);
+            return;
+        }
+
+        spillDir();
+        permutation_input_ = input;
+        try {
+            // One split yields a slice per thread for every run
+            std::vector<uint64_t> splits = split(input, 0, file_size, runs * num_threads_);
+            std::vector<std::string> run_files;
+            for (size_t r = 0; r < runs; ++r) {
+                run_files.push_back(nextRunFileName());
+                permutationRun(mapped, std::vector<uint64_t>(splits.begin() + r * num_threads_,
+                                                             splits.begin() + (r + 1) * num_threads_ + 1),
+                               run_files.back());
+            }
+            mergeRuns(run_files, output);
+        } catch (...) {
+            permutation_input_.clear();
+            removeSpillDir();
+            throw;
+        }
+        permutation_input_.clear();
+        removeSpillDir();
+    }
+
+    // Indexes one slice of the mapping per thread, sorts the views and
+    // writes their permutation entries
+    void permutationRun(const MappedRange& mapped, const std::vector<uint64_t>& splits, const std::string& output) {
+        const int slices = static_cast<int>(splits.size()) - 1;
+        std::vector<std::vector<RecordView>> indexes(slices);
+        std::exception_ptr error;
+
+        #pragma omp parallel for num_threads(num_threads_) schedule(static)
+        for (int t = 0; t < slices; ++t) {
+            try {
+                indexMappedRecords(mapped, splits[t], splits[t + 1], indexes[t]);
+            } catch (...) {
+                captureError(error);
+            }
+        }
+        if (error) std::rethrow_exception(error);
+
+        std::vector<RecordView> views;
+        for (auto& index : indexes) {
+            views.insert(views.end(), index.begin(), index.end());
+            std::vector<RecordView>().swap(index);
+        }
+        parallelMergeSort(views, std::less<RecordView>(), num_threads_);
+
+        std::vector<PermutationEntry> entries(views.size());
+        const long long n = static_cast<long long>(views.size());
+        #pragma omp parallel for num_threads(num_threads_) schedule(static)
+        for (long long i = 0; i < n; ++i) {
+            entries[i] = permutationEntry(views[i], mapped);
+        }
+        std::vector<RecordView>().swap(views);
+
+        AsyncWriter writer(output);
+        parallelGatherWrite(entries, writer);
+        writer.close();
+    }
+
+    // Loads the whole input, sorts per-thread bins and merges them to output
+    void inMemorySort(const std::vector<std::vector<InputPiece>>& bins, const std::string& output,
+                      OutputFormat format) {
+        // Phase 1: Parallel read and local sort. Each thread preads its own
+        // record-aligned pieces into private buffers; no locks are shared.
+        std::vector<ChunkData> chunks(num_threads_);
+        std::exception_ptr error;
+        
+        #pragma omp parallel num_threads(num_threads_)
+        {
+            int tid = omp_get_thread_num();
+            
+            try {
+                PieceReader reader(bins[tid]);
+                for (RecordPtr r = reader.next(); r.get(); r = reader.next()) {
+                    chunks[tid].records.emplace_back(std::move(r));
+                }
+                
+                // Local sort
+                std::sort(chunks[tid].records.begin(), chunks[tid].records.end(), recordKeyLess);
+            } catch (...) {
+                captureError(error);
+            }
+        }
+        
+        if (error) std::rethrow_exception(error);
+
+        // Phase 2+3: Merge straight into the async output writer
+        AsyncWriter writer(output, STAGING_BUFFER_SIZE, outputSink(output, format));
+        mergeToWriter(chunks, writer);
+        writer.close();
+    }
+
+    // Out-of-core sort: memory-bounded run generation followed by parallel
+    // multi-pass merging of the spilled runs
+    void externalSort(const std::vector<InputPiece>& pieces, const std::string& output, OutputFormat format) {
+        Timer timer("OpenMP external sort");
+        spillDir();
+        
+        try {
+            std::vector<std::string> runs = generateRuns(pieces);
+            mergeRuns(runs, output, format);
+        } catch (...) {
+            removeSpillDir();
+            throw;
+        }
+        removeSpillDir();
+    }
+
+    /**
+     * Reads the input in budget-sized chunks on one thread while OpenMP tasks
+     * sort and spill earlier chunks, so reading, sorting and writing overlap.
+     * At most one chunk per thread plus the one being read is resident: a
+     * chunk is read once the spill task of the chunk one window back is done.
+     * @return Sorted run files in input order
+     */
+    std::vector<std::string> generateRuns(const std::vector<InputPiece>& pieces) {
+        Timer timer("OpenMP run generation");
+        
+        PieceReader reader(pieces);
+        
+        const size_t max_in_flight = std::max(1, num_threads_);
+        const size_t chunk_budget = memory_budget_ / (max_in_flight + 1);
+        std::vector<std::string> runs;
+        std::exception_ptr error;
+        std::atomic<bool> failed{false};
+        
+        // Dependence tokens: chunk k's spill task owns slot k % max_in_flight
+        std::vector<char> slots(max_in_flight);
+        [[maybe_unused]] char* tokens = slots.data();   // Only named in depend clauses
+        
+        #pragma omp parallel num_threads(num_threads_)
+        #pragma omp single
+        {
+            bool eof = false;
+            
+            for (size_t k = 0; !eof && !failed.load(std::memory_order_acquire); ++k) {
+                const size_t slot = k % max_in_flight;
+                if (k >= max_in_flight) {
+                    // Wait only for the chunk whose slot this one reuses
+                    #pragma omp taskwait depend(inout: tokens[slot])
+                }
+                
+                auto* chunk = new std::vector<RecordPtr>();
+                try {
+                    size_t used = 0;
+                    while (used < chunk_budget) {
+                        RecordPtr r = reader.next();
+                        if (!r.get()) {
+                            eof = true;
+                            break;
+                        }
+                        used += r.size() + RECORD_OVERHEAD;
+                        chunk->push_back(std::move(r));
+                    }
+                } catch (...) {
+                    captureError(error);
+                    failed.store(true, std::memory_order_release);
+                }
+                
+                if (chunk->empty() || failed.load(std::memory_order_acquire)) {
+                    delete chunk;
+                    break;
+                }
+                
+                std::string run = nextRunFileName();
+                runs.push_back(run);
+                
+                #pragma omp task firstprivate(chunk, run) shared(error, failed) depend(inout: tokens[slot])
+                {
+                    try {
+                        sortChunk(*chunk);
+                        spillRun(run, *chunk);
+                    } catch (...) {
+                        captureError(error);
+                        failed.store(true, std::memory_order_release);
+                    }
+                    delete chunk;
+                }
+            }
+            #pragma omp taskwait
+        }
+        
+        if (error) std::rethrow_exception(error);
+        std::cout << "Generated " << runs.size() << " sorted runs" << std::endl;
+        return runs;
+    }
+
+    /**
+     * Merges runs in passes of at most MERGE_FAN_IN inputs. Groups of an
+     * intermediate pass are merged concurrently; the last pass writes output.
+     */
+    void mergeRuns(std::vector<std::string> runs, const std::string& output,
+                   OutputFormat format = OutputFormat::Raw) {
+        Timer timer("OpenMP multi-pass merge of " + std::to_string(runs.size()) + " runs");
+        
+        while (runs.size() > MERGE_FAN_IN) {
+            const size_t groups = (runs.size() + MERGE_FAN_IN - 1) / MERGE_FAN_IN;
+            std::vector<std::string> next(groups);
+            for (auto& name : next) {
+                name = nextRunFileName();
+            }
+            
+            std::exception_ptr error;
+            #pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads_)
+            for (long long g = 0; g < static_cast<long long>(groups); ++g) {
+                try {
+                    // Split evenly so every group has about the same fan-in
+                    size_t begin = runs.size() * g / groups;
+                    size_t end = runs.size() * (g + 1) / groups;
+                    std::vector<std::string> group(runs.begin() + begin, runs.begin() + end);
+                    kWayMerge(group, next[g], SPILL_BUFFER_SIZE);
+                    for (const auto& file : group) {
+                        storage().remove(file);
+                    }
+                } catch (...) {
+                    captureError(error);
+                }
+            }
+            if (error) std::rethrow_exception(error);
+            runs.swap(next);
+        }
+        
+        kWayMerge(runs, output, STAGING_BUFFER_SIZE, format);
+        for (const auto& file : runs) {
+            storage().remove(file);
+        }
+    }
+
+    // Sorts one chunk of records by key with tasks of the current team
+    void sortChunk(std::vector<RecordPtr>& records) {
+        parallelMergeSortTasks(records, recordKeyLess);
+    }
+
+    // Merges the sorted chunks into the writer's staging buffers. Each record
+    // is freed once staged and each chunk's index once exhausted, so memory
+    // shrinks as the merge proceeds and writing overlaps merging.
+    void mergeToWriter(std::vector<ChunkData>& chunks, AsyncWriter& writer) {
         // Use pointers to records in the heap to avoid copying RecordPtr objects
         using HeapEntry = std::pair<Record*, size_t>;
         auto cmp = [](const HeapEntry& a, const HeapEntry& b) {
-            return a.first->key > b.first->key;
+            return recordLess(b.first, a.first);
         };
         
         std::priority_queue<HeapEntry, std::vector<HeapEntry>, decltype(cmp)> heap(cmp);
@@ -156,8 +630,7 @@ private:
             }
         }
 
-        std::vector<RecordPtr> result;
-        result.reserve(chunks[0].records.size() * chunks.size());
+        RecordBuffer buffer;
 
         while (!heap.empty()) {
             auto entry = heap.top();
@@ -165,38 +638,33 @@ private:
             
             // Find which chunk this record came from
             auto& source_chunk = chunks[entry.second];
+            RecordPtr& record = source_chunk.records[indices[entry.second] - 1];
             
-            // Calculate the index within the chunk's records
-            size_t record_index = indices[entry.second] - 1;
-            
-            // Move the RecordPtr to the result
-            result.push_back(std::move(source_chunk.records[record_index]));
+            // Stage the record, handing full buffers to the writer
+            writer.append(buffer, record.data(), record.size());
+            record = RecordPtr();
             
-            // Push next record from the same chunk if available
-            if (indices[entry.second] < chunks[entry.second].records.size()) {
-                heap.emplace(chunks[entry.second].records[indices[entry.second]].get(), entry.second);
+            // Push next record from the same chunk, or drop the exhausted chunk
+            if (indices[entry.second] < source_chunk.records.size()) {
+                heap.emplace(source_chunk.records[indices[entry.second]].get(), entry.second);
                 indices[entry.second]++;
+            } else {
+                std::vector<RecordPtr>().swap(source_chunk.records);
             }
         }
 
-        return result;
+        writer.flush(buffer);
     }
 
-    void writeRecords(const std::string& output, const std::vector<RecordPtr>& records) {
-        std::ofstream out(output, std::ios::binary);
-        if (!out) throw std::runtime_error("Cannot open output file");
-
-        for (const auto& r : records) {
-            if (!r.get()) continue;
-            writeRecord(out, r);
-        }
+    // Writes a sorted chunk as a run from the calling task. Spill tasks run
+    // concurrently, so each gathers on its own thread.
+    void spillRun(const std::string& output, const std::vector<RecordPtr>& records) {
+        AsyncWriter writer(output, SPILL_BUFFER_SIZE);
+        gatherWrite(records, writer);
+        writer.close();
     }
 
     size_t getFileSize(const std::string& filename) {
-        std::ifstream in(filename, std::ios::binary | std::ios::ate);
-        if (!in) throw std::runtime_error("Cannot open file for size check");
-        size_t size = in.tellg();
-        in.close();
-        return size;
+        return storage().fileSize(filename);
     }
 };
\ No newline at end of file
@@ -0,0 +1,82 @@
+#ifndef OUTPUT_FORMAT_HPP
+#define OUTPUT_FORMAT_HPP
+
+#include "block_container.hpp"
+#include "columnar_format.hpp"
+#include <memory>
+#include <string>
+#include <cstdlib>
+#include <stdexcept>
+
+// On-disk layout of a sort's output, chosen with SORT_OUTPUT_FORMAT
+enum class OutputFormat { Raw, Container, Columnar, Permutation };
+
+inline OutputFormat requestedOutputFormat() {
+    const char* format = std::getenv("SORT_OUTPUT_FORMAT");
+    if (!format || std::string(format) == "raw") return OutputFormat::Raw;
+    if (std::string(format) == "container") return OutputFormat::Container;
+    if (std::string(format) == "columnar") return OutputFormat::Columnar;
+    if (std::string(format) == "permutation") return OutputFormat::Permutation;
+    throw std::runtime_error(std::string("Unknown output format: ") + format);
+}
+
+// Packs the records staged by an AsyncWriter into container blocks
+class ContainerSink : public WriterSink {
+private:
+    ContainerEncoder encoder_;
+
+public:
+    explicit ContainerSink(const std::string& path) : encoder_(path) {}
+
+    void write(const char* data, size_t n) override { encoder_.append(data, n); }
+    void finish() override { encoder_.finish(); }
+};
+
+// Splits the records staged by an AsyncWriter into key column and heap
+class ColumnarSink : public WriterSink {
+private:
+    ColumnarEncoder encoder_;
+
+public:
+    explicit ColumnarSink(const std::string& path) : encoder_(path) {}
+
+    void write(const char* data, size_t n) override { encoder_.append(data, n); }
+    void finish() override { encoder_.finish(); }
+};
+
+/**
+ * Sink that writes a sort's output in the given format as the final merge
+ * or gather produces it
+ * @return nullptr when the raw bytes go to the file as they are
+ */
+inline std::unique_ptr<WriterSink> outputSink(const std::string& path, OutputFormat format) {
+    if (format == OutputFormat::Container) return std::make_unique<ContainerSink>(path);
+    if (format == OutputFormat::Columnar) return std::make_unique<ColumnarSink>(path);
+    return nullptr;
+}
+
+/**
+ * Streams a raw record file through a writer, one staging buffer per read
+ * @return Bytes streamed
+ */
+inline uint64_t streamFile(const std::string& path, AsyncWriter& writer) {
+    std::unique_ptr<StorageFile> in = storage().open(path, OpenMode::Read);
+    in->readahead(0, 0, AccessHint::Sequential);
+    uint64_t offset = 0;
+    for (;;) {
+        RecordBuffer buffer = writer.acquire();
+        buffer.size = in->pread(buffer.data.get(), buffer.capacity, offset);
+        if (buffer.size == 0) break;
+        offset += buffer.size;
+        writer.submit(std::move(buffer));
+    }
+    return offset;
+}
+
+// Persists the output, including the payload heap of a columnar output
+inline void persistOutput(const std::string& output) {
+    storage().persist(output);
+    if (requestedOutputFormat() == OutputFormat::Columnar) storage().persist(heapPath(output));
+}
+
+#endif // OUTPUT_FORMAT_HPP
@@ -0,0 +1,60 @@
+#ifndef PARALLEL_GATHER_HPP
+#define PARALLEL_GATHER_HPP
+
+#include "async_writer.hpp"
+#include <vector>
+#include <omp.h>
+
+/**
+ * Writes items in order through the writer. Items are cut into batches
+ * that fill one staging buffer; each batch is gathered by all threads into
+ * disjoint output ranges while the writer drains the previous one.
+ * @param on_batch Called with [begin, end) once a batch has been gathered
+ */
+template <typename Item, typename BatchDone>
+void parallelGatherWrite(const std::vector<Item>& items, AsyncWriter& writer, BatchDone on_batch) {
+    std::vector<size_t> offsets;
+    size_t begin = 0;
+
+    while (begin < items.size()) {
+        // Output offsets of this batch's records inside the staging buffer
+        offsets.clear();
+        size_t bytes = 0;
+        size_t end = begin;
+        while (end < items.size()) {
+            size_t size = gatherSize(items[end]);
+            if (bytes + size > writer.bufferCapacity() && end > begin) break;
+            offsets.push_back(bytes);
+            bytes += size;
+            ++end;
+        }
+
+        RecordBuffer buffer = writer.acquire();
+        char* dst = buffer.data.get();
+        const long long count = static_cast<long long>(end - begin);
+
+        #pragma omp parallel
+        {
+            #pragma omp for schedule(static)
+            for (long long i = 0; i < count; ++i) {
+                if (i + GATHER_PREFETCH_DISTANCE < static_cast<size_t>(count)) {
+                    __builtin_prefetch(gatherSource(items[begin + i + GATHER_PREFETCH_DISTANCE]));
+                }
+                gatherCopy(dst + offsets[i], items[begin + i]);
+            }
+            streamFence();
+        }
+
+        buffer.size = bytes;
+        writer.submit(std::move(buffer));
+        on_batch(begin, end);
+        begin = end;
+    }
+}
+
+template <typename Item>
+void parallelGatherWrite(const std::vector<Item>& items, AsyncWriter& writer) {
+    parallelGatherWrite(items, writer, [](size_t, size_t) {});
+}
+
+#endif // PARALLEL_GATHER_HPP
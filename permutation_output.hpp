@@ -0,0 +1,220 @@
+#ifndef PERMUTATION_OUTPUT_HPP
+#define PERMUTATION_OUTPUT_HPP
+
+#include "record_structure.hpp"
+#include "storage_backend.hpp"
+#include "async_writer.hpp"
+#include "mapped_range.hpp"
+#include "output_format.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <queue>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+
+/*
+ * Permutation output (SORT_OUTPUT_FORMAT=permutation): instead of the
+ * sorted records, a dense array of 16-byte entries {key, byte offset of
+ * the record in the input} in sorted order. Payloads are never moved;
+ * PermutedReader materializes records from the original input on demand.
+ */
+
+struct PermutationEntry {
+    uint64_t key;
+    uint64_t offset;
+};
+static_assert(sizeof(PermutationEntry) == 16, "PermutationEntry layout must not change");
+
+// Entries fetched by each read of a permutation file
+constexpr size_t PERMUTATION_READ_ENTRIES = 64 * 1024;
+
+inline bool permutationOutputRequested() {
+    return requestedOutputFormat() == OutputFormat::Permutation;
+}
+
+// Offsets only identify records of a raw file
+inline void requirePermutableInput(const std::string& input) {
+    if (isContainerFile(input) || isColumnarFile(input)) {
+        throw std::runtime_error("Permutation output needs a raw record input; convert " + input +
+                                 " with convert_records to-raw first");
+    }
+}
+
+inline size_t gatherSize(const PermutationEntry&) { return sizeof(PermutationEntry); }
+inline const void* gatherSource(const PermutationEntry& e) { return &e; }
+inline void gatherCopy(char* dst, const PermutationEntry& e) {
+    std::memcpy(dst, &e, sizeof(e));
+}
+
+// Entry of a view into a mapping of the input
+inline PermutationEntry permutationEntry(const RecordView& view, const MappedRange& mapped) {
+    return {view.key, mapped.offsetOf(view.payload) - HEADER_SIZE};
+}
+
+// Streams sorted views into a permutation file from the calling thread
+inline void writePermutation(const std::vector<RecordView>& views, const MappedRange& mapped,
+                             AsyncWriter& writer) {
+    RecordBuffer buffer;
+    for (const auto& view : views) {
+        PermutationEntry entry = permutationEntry(view, mapped);
+        writer.append(buffer, reinterpret_cast<const char*>(&entry), sizeof(entry));
+    }
+    writer.flush(buffer);
+}
+
+// Sequential reader of a permutation file
+class PermutationReader {
+private:
+    std::unique_ptr<StorageFile> file_;
+    uint64_t count_;
+    uint64_t next_ = 0;                 // Next entry to fetch
+    std::vector<PermutationEntry> buffer_;
+    size_t pos_ = 0;
+
+public:
+    explicit PermutationReader(const std::string& path)
+        : file_(storage().open(path, OpenMode::Read)) {
+        const uint64_t bytes = file_->size();
+        if (bytes % sizeof(PermutationEntry) != 0) {
+            throw std::runtime_error("Not a permutation file (size not a multiple of 16): " + path);
+        }
+        count_ = bytes / sizeof(PermutationEntry);
+        file_->readahead(0, bytes, AccessHint::Sequential);
+    }
+
+    uint64_t size() const { return count_; }
+
+    // Next entry, valid until the following call; null at the end
+    const PermutationEntry* next() {
+        if (pos_ == buffer_.size()) {
+            if (next_ >= count_) return nullptr;
+            buffer_.resize(static_cast<size_t>(std::min<uint64_t>(PERMUTATION_READ_ENTRIES, count_ - next_)));
+            const size_t bytes = buffer_.size() * sizeof(PermutationEntry);
+            if (file_->pread(buffer_.data(), bytes, next_ * sizeof(PermutationEntry)) != bytes) {
+                throw std::runtime_error("Permutation file truncated");
+            }
+            next_ += buffer_.size();
+            pos_ = 0;
+        }
+        return &buffer_[pos_++];
+    }
+};
+
+/**
+ * Merges sorted permutation files. Entries compare by key; with wide keys
+ * the input is mapped to compare their prefixes, and full keys on ties.
+ * @param input Record file the entries point into
+ */
+inline void mergePermutations(const std::vector<std::string>& inputs, const std::string& output,
+                              const std::string& input) {
+    std::unique_ptr<MappedRange> mapped;
+    if (wideKeyBytes()) mapped = std::make_unique<MappedRange>(input, 0, UINT64_MAX);
+    auto recordAt = [&](const PermutationEntry* e) {
+        return reinterpret_cast<const Record*>(mapped->at(e->offset));
+    };
+
+    std::vector<std::unique_ptr<PermutationReader>> readers;
+    std::vector<const PermutationEntry*> current;
+    for (const auto& file : inputs) {
+        readers.push_back(std::make_unique<PermutationReader>(file));
+        current.push_back(readers.back()->next());
+    }
+
+    using HeapEntry = std::pair<uint64_t, size_t>;     // sort prefix, input index
+    auto cmp = [&](const HeapEntry& a, const HeapEntry& b) {
+        if (a.first != b.first) return a.first > b.first;   // min-heap
+        if (wideKeyBytes() && recordLess(recordAt(current[b.second]), recordAt(current[a.second]))) return true;
+        return false;
+    };
+    auto prefixOf = [&](const PermutationEntry* e) {
+        return mapped ? sortPrefix(e->key, recordAt(e)->payload) : e->key;
+    };
+    std::priority_queue<HeapEntry, std::vector<HeapEntry>, decltype(cmp)> heap(cmp);
+    for (size_t i = 0; i < current.size(); ++i) {
+        if (current[i]) heap.emplace(prefixOf(current[i]), i);
+    }
+
+    AsyncWriter writer(output);
+    RecordBuffer buffer;
+    while (!heap.empty()) {
+        const size_t i = heap.top().second;
+        heap.pop();
+        writer.append(buffer, reinterpret_cast<const char*>(current[i]), sizeof(PermutationEntry));
+        current[i] = readers[i]->next();
+        if (current[i]) heap.emplace(prefixOf(current[i]), i);
+    }
+    writer.flush(buffer);
+    writer.close();
+}
+
+/**
+ * Materializes the records a permutation refers to, in permutation order,
+ * either sequentially or by rank
+ */
+class PermutedReader {
+private:
+    std::unique_ptr<StorageFile> entries_;
+    std::unique_ptr<StorageFile> input_;
+    uint64_t count_;
+    std::unique_ptr<PermutationReader> sequential_;
+    std::unique_ptr<char[]> record_;
+
+    RecordPtr load(const PermutationEntry& entry) {
+        const size_t got = input_->pread(record_.get(), HEADER_SIZE + PAYLOAD_MAX, entry.offset);
+        uint32_t len = 0;
+        if (got >= HEADER_SIZE) std::memcpy(&len, record_.get() + sizeof(uint64_t), sizeof(uint32_t));
+        if (got < HEADER_SIZE || len < PAYLOAD_MIN || len > PAYLOAD_MAX || got < HEADER_SIZE + len) {
+            throw std::runtime_error("No record at input offset " + std::to_string(entry.offset));
+        }
+        return RecordPtr(record_.get(), HEADER_SIZE + len);
+    }
+
+public:
+    PermutedReader(const std::string& permutation, const std::string& input)
+        : entries_(storage().open(permutation, OpenMode::Read)),
+          input_(storage().open(input, OpenMode::Read)),
+          count_(entries_->size() / sizeof(PermutationEntry)),
+          sequential_(std::make_unique<PermutationReader>(permutation)),
+          record_(new char[HEADER_SIZE + PAYLOAD_MAX]) {
+        input_->readahead(0, 0, AccessHint::Random);
+    }
+
+    uint64_t size() const { return count_; }
+
+    // Next record in sorted order; empty at the end
+    RecordPtr next() {
+        const PermutationEntry* entry = sequential_->next();
+        return entry ? load(*entry) : RecordPtr();
+    }
+
+    // The record of sorted rank i
+    RecordPtr at(uint64_t i) {
+        if (i >= count_) throw std::runtime_error("Permutation rank out of range: " + std::to_string(i));
+        PermutationEntry entry;
+        entries_->pread(&entry, sizeof(entry), i * sizeof(entry));
+        return load(entry);
+    }
+};
+
+/**
+ * Writes the records of a permutation, in its order, as a raw record file
+ * @return Records written
+ */
+inline uint64_t materializePermutation(const std::string& permutation, const std::string& input,
+                                       const std::string& output) {
+    PermutedReader reader(permutation, input);
+    AsyncWriter writer(output);
+    RecordBuffer buffer;
+    uint64_t records = 0;
+    for (RecordPtr r = reader.next(); r.get(); r = reader.next()) {
+        writer.append(buffer, r.data(), r.size());
+        records++;
+    }
+    writer.flush(buffer);
+    writer.close();
+    return records;
+}
+
+#endif // PERMUTATION_OUTPUT_HPP
@@ -0,0 +1,234 @@
+#ifndef RANGE_READER_HPP
+#define RANGE_READER_HPP
+
+#include "record_structure.hpp"
+#include "mapped_range.hpp"
+#include "storage_backend.hpp"
+#include "block_container.hpp"
+#include "columnar_format.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+// Bytes fetched by each pread of a RangeReader
+constexpr size_t PREAD_BLOCK_SIZE = 8 * MB;
+
+// Consecutive valid record headers that confirm a resynchronised boundary
+constexpr size_t RESYNC_CONFIRM_RECORDS = 16;
+
+// Bytes read at a split target to resynchronise on a record boundary
+constexpr size_t RESYNC_WINDOW = (RESYNC_CONFIRM_RECORDS + 1) * (HEADER_SIZE + PAYLOAD_MAX);
+
+/**
+ * First offset at or after `from` that starts RESYNC_CONFIRM_RECORDS valid
+ * record headers in a row, or a run of valid headers ending exactly at
+ * `end`. Only RESYNC_WINDOW bytes are read. Raw records carry no sync
+ * marker, so the result is a candidate boundary. The reader of the range
+ * before it confirms it by ending exactly there (see MisalignedSplit).
+ * @return The candidate, or `end` if there is none within reach
+ */
+inline uint64_t resyncRecordBoundary(StorageFile& file, uint64_t from, uint64_t end) {
+    if (from >= end) return end;
+    std::vector<char> window(static_cast<size_t>(std::min<uint64_t>(RESYNC_WINDOW, end - from)));
+    const size_t got = file.pread(window.data(), window.size(), from);
+
+    for (size_t start = 0; start < std::min(got, HEADER_SIZE + PAYLOAD_MAX); ++start) {
+        size_t offset = start;
+        size_t confirmed = 0;
+        while (confirmed < RESYNC_CONFIRM_RECORDS && offset + HEADER_SIZE <= got) {
+            uint32_t len;
+            std::memcpy(&len, window.data() + offset + sizeof(uint64_t), sizeof(uint32_t));
+            if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) break;
+            offset += HEADER_SIZE + len;
+            confirmed++;
+        }
+        if (confirmed == RESYNC_CONFIRM_RECORDS || from + offset == end) return from + start;
+    }
+    return end;
+}
+
+/**
+ * Splits [begin, end) of a record file into `parts` ranges of roughly equal
+ * size. Raw files are cut at byte offsets, and each cut is moved to the
+ * boundary resyncRecordBoundary() finds there. Only a small window is read
+ * per cut. A reader that runs past a cut throws MisalignedSplit; the caller
+ * then redoes the work with exactRecordSplits(). Block containers are split
+ * on block boundaries and columnar key files on entry boundaries, without
+ * reading records.
+ * @return parts + 1 offsets; range i is [splits[i], splits[i + 1])
+ */
+inline std::vector<uint64_t> recordAlignedSplits(const std::string& path, uint64_t begin,
+                                                 uint64_t end, size_t parts) {
+    ContainerInfo info;
+    if (isContainerFile(path, &info)) {
+        return blockAlignedSplits(info, begin, end, parts);
+    }
+    ColumnarInfo columnar;
+    if (isColumnarFile(path, &columnar)) {
+        return entryAlignedSplits(columnar, begin, end, parts);
+    }
+
+    std::unique_ptr<StorageFile> file = storage().open(path, OpenMode::Read);
+    const uint64_t last = std::min<uint64_t>(end, file->size());
+    const uint64_t first = std::min(begin, last);
+
+    std::vector<uint64_t> splits(parts + 1, last);
+    splits[0] = first;
+    for (size_t p = 1; p < parts; ++p) {
+        const uint64_t target = std::max(splits[p - 1], first + (last - first) * p / parts);
+        splits[p] = resyncRecordBoundary(*file, target, last);
+    }
+    return splits;
+}
+
+/**
+ * Splits [begin, end) of a raw record file exactly, by walking every record
+ * header from begin through a read-only mapping. Payloads are at most 4 KB,
+ * so this faults in (and, on a throttled device, reads) every page of the
+ * range: it is the fallback for a MisalignedSplit, not the default.
+ * @return parts + 1 offsets; range i is [splits[i], splits[i + 1])
+ */
+inline std::vector<uint64_t> exactRecordSplits(const std::string& path, uint64_t begin,
+                                               uint64_t end, size_t parts) {
+    if (isContainerFile(path) || isColumnarFile(path)) {
+        return recordAlignedSplits(path, begin, end, parts);
+    }
+
+    MappedRange mapped(path, begin, end);
+    const uint64_t first = mapped.begin();
+    const uint64_t last = mapped.end();
+
+    std::vector<uint64_t> splits(parts + 1, last);
+    splits[0] = first;
+    size_t next = 1;
+    uint64_t offset = first;
+
+    while (next < parts && offset + HEADER_SIZE <= last) {
+        // Every split target at or before this offset starts here
+        while (next < parts && offset >= first + (last - first) * next / parts) {
+            splits[next++] = offset;
+        }
+
+        uint32_t len;
+        std::memcpy(&len, mapped.at(offset) + sizeof(uint64_t), sizeof(uint32_t));
+        if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
+            throw std::runtime_error("Invalid record length: " + std::to_string(len) +
+                                     " at offset " + std::to_string(offset));
+        }
+        offset += HEADER_SIZE + len;
+    }
+
+    return splits;
+}
+
+// recordAlignedSplits or exactRecordSplits
+using RecordSplitter = std::vector<uint64_t> (*)(const std::string&, uint64_t, uint64_t, size_t);
+
+/**
+ * Runs work(recordAlignedSplits). If a reader hits a MisalignedSplit, runs
+ * it again with exactRecordSplits. The work must not have produced output
+ * by the time its readers finish.
+ */
+template <typename Work>
+void withRecordSplits(Work work) {
+    try {
+        work(recordAlignedSplits);
+    } catch (const MisalignedSplit& e) {
+        std::cout << e.what() << "; splitting again by a full header walk" << std::endl;
+        work(exactRecordSplits);
+    }
+}
+
+/**
+ * Sequential record reader over a byte range using large pread calls into
+ * a private buffer. Readers share nothing, so any number of threads can
+ * ingest disjoint ranges of the same file without locking. Block
+ * containers and columnar files are recognised and decoded transparently;
+ * a columnar range is a byte range of its key column.
+ */
+class RangeReader {
+private:
+    std::unique_ptr<StorageFile> file_;
+    uint64_t file_pos_;                 // Next file offset to fetch
+    uint64_t end_;                      // End of the range
+    std::unique_ptr<char[]> buffer_;
+    size_t capacity_;
+    size_t head_ = 0;                   // First unconsumed byte in buffer_
+    size_t tail_ = 0;                   // One past the last valid byte
+    std::unique_ptr<BlockCursor> blocks_;   // Set when the file is a container
+    std::unique_ptr<ColumnarCursor> columns_;   // Set when the file is a key column
+
+    // Ensures at least n unconsumed bytes are buffered; false at range end
+    bool fill(size_t n) {
+        if (tail_ - head_ >= n) return true;
+
+        std::memmove(buffer_.get(), buffer_.get() + head_, tail_ - head_);
+        tail_ -= head_;
+        head_ = 0;
+
+        while (tail_ < n && file_pos_ < end_) {
+            size_t want = static_cast<size_t>(std::min<uint64_t>(capacity_ - tail_, end_ - file_pos_));
+            size_t got = file_->pread(buffer_.get() + tail_, want, file_pos_);
+            if (got == 0) {
+                end_ = file_pos_;   // File shorter than the range
+                break;
+            }
+            tail_ += got;
+            file_pos_ += got;
+        }
+        return tail_ - head_ >= n;
+    }
+
+    // Bytes left over at the range end belong to a record that goes on past
+    // it; only a file's end may cut a record short
+    RecordPtr endOfRange() {
+        if (tail_ > head_ && end_ < file_->size()) throw MisalignedSplit(end_);
+        return RecordPtr();
+    }
+
+public:
+    RangeReader(const std::string& path, uint64_t begin, uint64_t end,
+                size_t buffer_size = PREAD_BLOCK_SIZE)
+        : file_(storage().open(path, OpenMode::Read)), file_pos_(begin), end_(end),
+          capacity_(buffer_size) {
+        file_->readahead(begin, end - begin, AccessHint::Sequential);
+        ContainerInfo info;
+        if (probeContainer(*file_, &info)) {
+            blocks_ = std::make_unique<BlockCursor>(*file_, info, begin, end);
+            return;
+        }
+        ColumnarInfo columnar;
+        if (probeColumnar(*file_, &columnar)) {
+            columns_ = std::make_unique<ColumnarCursor>(path, columnar, begin, end, buffer_size);
+        } else {
+            buffer_.reset(new char[buffer_size]);
+        }
+    }
+
+    RangeReader(const RangeReader&) = delete;
+    RangeReader& operator=(const RangeReader&) = delete;
+
+    // Reads the next record; returns an empty RecordPtr at the end of the range
+    RecordPtr next() {
+        if (blocks_) return blocks_->next();
+        if (columns_) return columns_->next();
+        if (!fill(HEADER_SIZE)) return endOfRange();
+
+        uint32_t len;
+        std::memcpy(&len, buffer_.get() + head_ + sizeof(uint64_t), sizeof(uint32_t));
+        if (len < PAYLOAD_MIN || len > PAYLOAD_MAX) {
+            throw std::runtime_error("Invalid record length: " + std::to_string(len));
+        }
+
+        if (!fill(HEADER_SIZE + len)) return endOfRange();  // Truncated last record
+
+        RecordPtr record(buffer_.get() + head_, HEADER_SIZE + len);
+        head_ += HEADER_SIZE + len;
+        return record;
+    }
+};
+
+#endif // RANGE_READER_HPP
@@ -0,0 +1,333 @@
+#ifndef RECORD_LAYOUT_HPP
+#define RECORD_LAYOUT_HPP
+
+#include "record_structure.hpp"
+#include "parallel_gather.hpp"
+#include "omp_mergesort.hpp"
+#include <array>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <climits>
+#include <omp.h>
+
+// Payloads up to this size are cheaper to move with their record than to
+// reach through a RecordView when the sorted output is written
+constexpr uint32_t INLINE_PAYLOAD_MAX = 64;
+
+// Only every LAYOUT_SAMPLE_STRIDE-th record feeds the payload histogram
+constexpr size_t LAYOUT_SAMPLE_STRIDE = 64;
+
+// Target size of one radix bucket so its local sort stays cache resident
+constexpr size_t RADIX_BUCKET_BYTES = 256 * 1024;
+
+// How a chunk is physically reordered
+enum class PayloadLayout {
+    Inline,     // Move whole records (small payloads)
+    Indirect,   // Sort a key index, gather payloads on output (large payloads)
+    Mixed       // Split by size class, merge both parts on output
+};
+
+inline const char* layoutName(PayloadLayout layout) {
+    switch (layout) {
+        case PayloadLayout::Inline:   return "inline";
+        case PayloadLayout::Indirect: return "indirect";
+        default:                      return "mixed";
+    }
+}
+
+// Histogram of sampled payload lengths in power-of-two size classes
+class PayloadSizeHistogram {
+private:
+    // Class c counts lengths in (2^(c-1), 2^c]; PAYLOAD_MAX = 2^12
+    std::array<uint64_t, 13> classes_{};
+    uint64_t samples_ = 0;
+
+    static size_t sizeClass(uint32_t len) {
+        size_t c = 0;
+        while (c < 12 && (1u << c) < len) ++c;
+        return c;
+    }
+
+public:
+    void add(uint32_t len) {
+        classes_[sizeClass(len)]++;
+        samples_++;
+    }
+
+    void merge(const PayloadSizeHistogram& other) {
+        for (size_t c = 0; c < classes_.size(); ++c) classes_[c] += other.classes_[c];
+        samples_ += other.samples_;
+    }
+
+    uint64_t samples() const { return samples_; }
+
+    // Fraction of sampled payloads no longer than limit (rounded to a class)
+    double fractionAtMost(uint32_t limit) const {
+        if (samples_ == 0) return 0.0;
+        uint64_t count = 0;
+        for (size_t c = 0; c < classes_.size() && (1u << c) <= limit; ++c) {
+            count += classes_[c];
+        }
+        return static_cast<double>(count) / samples_;
+    }
+
+    PayloadLayout choose() const {
+        if (samples_ == 0) return PayloadLayout::Indirect;
+        double small = fractionAtMost(INLINE_PAYLOAD_MAX);
+        if (small >= 0.9) return PayloadLayout::Inline;
+        if (small <= 0.1) return PayloadLayout::Indirect;
+        return PayloadLayout::Mixed;
+    }
+};
+
+// A sorted chunk: small records inline in key order, large records as a
+// sorted view index over the source bytes
+struct SortedChunk {
+    PayloadLayout layout = PayloadLayout::Indirect;
+    RecordBuffer inline_records;
+    std::vector<RecordView> indirect;
+};
+
+/**
+ * Sorts small records by moving them whole: one parallel radix scatter of
+ * full records into contiguous buckets, then a cache-resident sort of each
+ * bucket into the output buffer. A bucket over 2 * RADIX_BUCKET_BYTES
+ * (keys the digits cannot split) is sorted by a parallel mergesort instead.
+ * @param views Records to sort (payloads are copied out of the source)
+ * @return Records serialized back to back in key order
+ */
+inline RecordBuffer radixSortInline(const std::vector<RecordView>& views) {
+    RecordBuffer sorted;
+    const size_t n = views.size();
+    if (n == 0) return sorted;
+
+    uint64_t min_key = UINT64_MAX, max_key = 0;
+    size_t total_bytes = 0;
+    #pragma omp parallel for reduction(min:min_key) reduction(max:max_key) reduction(+:total_bytes)
+    for (size_t i = 0; i < n; ++i) {
+        min_key = std::min(min_key, views[i].prefix);
+        max_key = std::max(max_key, views[i].prefix);
+        total_bytes += HEADER_SIZE + views[i].len;
+    }
+
+    // Digit width grows with the data so buckets stay around RADIX_BUCKET_BYTES;
+    // digits come from the top of the key range in use so clustered keys spread
+    int bits = 8;
+    while (bits < 16 && (total_bytes >> bits) > RADIX_BUCKET_BYTES) ++bits;
+    const uint64_t span = max_key - min_key;
+    const int span_bits = span == 0 ? 0 : 64 - __builtin_clzll(span);
+    const int shift = std::max(0, span_bits - bits);
+    const size_t num_buckets = size_t(1) << bits;
+    auto digit = [=](uint64_t key) { return static_cast<size_t>((key - min_key) >> shift); };
+
+    std::unique_ptr<char[]> scattered(new char[total_bytes]);
+    sorted.data.reset(new char[total_bytes]);
+    sorted.size = total_bytes;
+    sorted.capacity = total_bytes;
+
+    std::vector<size_t> bucket_start(num_buckets + 1, 0);
+    std::vector<std::vector<size_t>> cursors;
+    std::vector<size_t> oversized;      // Buckets of skewed or duplicate keys
+    std::vector<std::pair<uint64_t, size_t>> oversized_index;
+    std::vector<size_t> slice_bytes;
+
+    // Bucket entries are (prefix, offset); prefix ties fall back to the full
+    // keys, then to input order
+    const char* base = scattered.get();
+    auto entry_less = [base](const std::pair<uint64_t, size_t>& a, const std::pair<uint64_t, size_t>& b) {
+        if (a.first != b.first) return a.first < b.first;
+        if (wideKeyBytes()) {
+            const Record* ra = reinterpret_cast<const Record*>(base + a.second);
+            const Record* rb = reinterpret_cast<const Record*>(base + b.second);
+            if (recordLess(ra, rb)) return true;
+            if (recordLess(rb, ra)) return false;
+        }
+        return a.second < b.second;
+    };
+    auto index_bucket = [base](size_t lo, size_t hi, std::vector<std::pair<uint64_t, size_t>>& index) {
+        index.clear();
+        for (size_t off = lo; off < hi;) {
+            uint64_t key;
+            uint32_t len;
+            std::memcpy(&key, base + off, sizeof(uint64_t));
+            std::memcpy(&len, base + off + sizeof(uint64_t), sizeof(uint32_t));
+            index.emplace_back(sortPrefix(key, base + off + HEADER_SIZE), off);
+            off += HEADER_SIZE + len;
+        }
+    };
+    auto record_bytes = [base](size_t off) {
+        uint32_t len;
+        std::memcpy(&len, base + off + sizeof(uint64_t), sizeof(uint32_t));
+        return HEADER_SIZE + len;
+    };
+
+    #pragma omp parallel
+    {
+        const int nt = omp_get_num_threads();
+        const int tid = omp_get_thread_num();
+
+        #pragma omp single
+        {
+            cursors.assign(nt, std::vector<size_t>(num_buckets, 0));
+            slice_bytes.assign(nt, 0);
+        }
+
+        // Per-thread byte histogram over a static slice of the input
+        const size_t begin = n * tid / nt;
+        const size_t end = n * (tid + 1) / nt;
+        std::vector<size_t>& cursor = cursors[tid];
+        for (size_t i = begin; i < end; ++i) {
+            cursor[digit(views[i].prefix)] += HEADER_SIZE + views[i].len;
+        }
+
+        #pragma omp barrier
+        #pragma omp single
+        {
+            // Exclusive prefix sum: bucket-major, thread-minor
+            size_t offset = 0;
+            for (size_t b = 0; b < num_buckets; ++b) {
+                bucket_start[b] = offset;
+                for (int t = 0; t < nt; ++t) {
+                    size_t bytes = cursors[t][b];
+                    cursors[t][b] = offset;
+                    offset += bytes;
+                }
+                if (offset - bucket_start[b] > 2 * RADIX_BUCKET_BYTES) oversized.push_back(b);
+            }
+            bucket_start[num_buckets] = offset;
+        }
+
+        // Scatter full records into their buckets
+        for (size_t i = begin; i < end; ++i) {
+            const RecordView& v = views[i];
+            char* dst = scattered.get() + cursor[digit(v.prefix)];
+            std::memcpy(dst, &v.key, sizeof(uint64_t));
+            std::memcpy(dst + sizeof(uint64_t), &v.len, sizeof(uint32_t));
+            std::memcpy(dst + HEADER_SIZE, v.payload, v.len);
+            cursor[digit(v.prefix)] += HEADER_SIZE + v.len;
+        }
+
+        #pragma omp barrier
+
+        // Each bucket is small enough to sort locally and copy out in order
+        std::vector<std::pair<uint64_t, size_t>> local_index;
+        #pragma omp for schedule(dynamic, 16)
+        for (size_t b = 0; b < num_buckets; ++b) {
+            const size_t lo = bucket_start[b];
+            const size_t hi = bucket_start[b + 1];
+            if (lo == hi || hi - lo > 2 * RADIX_BUCKET_BYTES) continue;
+
+            index_bucket(lo, hi, local_index);
+            std::sort(local_index.begin(), local_index.end(), entry_less);
+
+            char* dst = sorted.data.get() + lo;
+            for (const auto& entry : local_index) {
+                const size_t bytes = record_bytes(entry.second);
+                std::memcpy(dst, base + entry.second, bytes);
+                dst += bytes;
+            }
+        }
+
+        // Skewed or duplicate keys overfill a bucket that the digits cannot
+        // split: the whole team sorts it, then copies out a slice per thread
+        for (size_t b : oversized) {
+            #pragma omp single
+            {
+                index_bucket(bucket_start[b], bucket_start[b + 1], oversized_index);
+                parallelMergeSortTasks(oversized_index, entry_less);
+            }
+
+            const size_t first = oversized_index.size() * tid / nt;
+            const size_t last = oversized_index.size() * (tid + 1) / nt;
+            size_t bytes = 0;
+            for (size_t i = first; i < last; ++i) bytes += record_bytes(oversized_index[i].second);
+            slice_bytes[tid] = bytes;
+            #pragma omp barrier
+
+            char* dst = sorted.data.get() + bucket_start[b];
+            for (int t = 0; t < tid; ++t) dst += slice_bytes[t];
+            for (size_t i = first; i < last; ++i) {
+                const size_t record = record_bytes(oversized_index[i].second);
+                std::memcpy(dst, base + oversized_index[i].second, record);
+                dst += record;
+            }
+            #pragma omp barrier
+        }
+    }
+
+    return sorted;
+}
+
+// View of the inline record at pos
+inline RecordView inlineRecordView(const char* pos) {
+    uint64_t key;
+    uint32_t len;
+    std::memcpy(&key, pos, sizeof(uint64_t));
+    std::memcpy(&len, pos + sizeof(uint64_t), sizeof(uint32_t));
+    return RecordView(key, pos + HEADER_SIZE, len);
+}
+
+/**
+ * Writes a sorted chunk. Inline-only chunks are already contiguous and go
+ * out in one write; otherwise a merge cursor over both parts fills one
+ * staging buffer's worth of views at a time, gathered in parallel through
+ * the async writer.
+ * @param on_gathered Called with each [first, last) range of indirect views
+ *        whose bytes have been copied out, so their source can be released
+ */
+template <typename Gathered>
+void writeSortedChunk(const std::string& path, const SortedChunk& chunk, Gathered on_gathered) {
+    if (chunk.indirect.empty()) {
+        storage().open(path, OpenMode::Write)->pwrite(chunk.inline_records.data.get(),
+                                                      chunk.inline_records.size, 0);
+        return;
+    }
+
+    AsyncWriter writer(path);
+    const std::vector<RecordView>& indirect = chunk.indirect;
+    if (chunk.inline_records.size == 0) {
+        parallelGatherWrite(indirect, writer, [&](size_t begin, size_t end) {
+            on_gathered(indirect.data() + begin, indirect.data() + end);
+        });
+        writer.close();
+        return;
+    }
+
+    const char* pos = chunk.inline_records.data.get();
+    const char* const end = pos + chunk.inline_records.size;
+    RecordView head = inlineRecordView(pos);    // Next inline record
+    size_t next = 0;                            // Next indirect view
+    std::vector<RecordView> batch;
+
+    while (pos < end || next < indirect.size()) {
+        batch.clear();
+        const size_t first = next;
+        size_t bytes = 0;
+        while (pos < end || next < indirect.size()) {
+            // Ties go to the inline record, as std::merge would
+            const bool take_inline = pos < end && (next == indirect.size() || !(indirect[next] < head));
+            const RecordView& view = take_inline ? head : indirect[next];
+            if (bytes + HEADER_SIZE + view.len > writer.bufferCapacity() && !batch.empty()) break;
+            bytes += HEADER_SIZE + view.len;
+            batch.push_back(view);
+            if (take_inline) {
+                pos += HEADER_SIZE + head.len;
+                if (pos < end) head = inlineRecordView(pos);
+            } else {
+                next++;
+            }
+        }
+        parallelGatherWrite(batch, writer);
+        on_gathered(indirect.data() + first, indirect.data() + next);
+    }
+    writer.close();
+}
+
+inline void writeSortedChunk(const std::string& path, const SortedChunk& chunk) {
+    writeSortedChunk(path, chunk, [](const RecordView*, const RecordView*) {});
+}
+
+#endif // RECORD_LAYOUT_HPP
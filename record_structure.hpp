@@ -4,6 +4,8 @@
 #include <cstring>     
 #include <chrono>
 #include <cstdint>
+#include <cstdlib>
+#include <algorithm>
 #include <vector>
 #include <memory>
 #include <string>
@@ -25,6 +27,60 @@ struct Record {
     char payload[];     // flexible array member (C99-style)
 };
 
+/*
+ * Wide keys: with SORT_KEY_BYTES=W (16-64) records are ordered by the
+ * first W payload bytes compared as unsigned bytes; a payload shorter than
+ * W is a shorter key and sorts before its extensions. Sort indexes keep an
+ * 8-byte big-endian prefix of the key inline and compare the rest with
+ * memcmp only when prefixes tie. Without it the header key is the order.
+ */
+constexpr size_t WIDE_KEY_MIN = 16;
+constexpr size_t WIDE_KEY_MAX = 64;
+
+// Wide key length in bytes, 0 when records are ordered by the header key
+inline size_t wideKeyBytes() {
+    static const size_t bytes = [] {
+        const char* env = std::getenv("SORT_KEY_BYTES");
+        if (!env) return size_t(0);
+        size_t w = std::stoul(env);
+        if (w < WIDE_KEY_MIN || w > WIDE_KEY_MAX) {
+            throw std::runtime_error("SORT_KEY_BYTES must be between " + std::to_string(WIDE_KEY_MIN) +
+                                     " and " + std::to_string(WIDE_KEY_MAX));
+        }
+        return w;
+    }();
+    return bytes;
+}
+
+// Normalized prefix: the first 8 wide-key bytes as a big-endian integer
+// (PAYLOAD_MIN guarantees they exist)
+inline uint64_t widePrefix(const char* payload) {
+    uint64_t word;
+    std::memcpy(&word, payload, sizeof(word));
+    return __builtin_bswap64(word);
+}
+
+// Orders two wide keys whose prefixes tie
+inline bool wideKeyTailLess(const char* a, uint32_t a_len, const char* b, uint32_t b_len) {
+    const size_t ka = std::min<size_t>(wideKeyBytes(), a_len);
+    const size_t kb = std::min<size_t>(wideKeyBytes(), b_len);
+    int c = std::memcmp(a + sizeof(uint64_t), b + sizeof(uint64_t), std::min(ka, kb) - sizeof(uint64_t));
+    return c != 0 ? c < 0 : ka < kb;
+}
+
+// Integer the sort order starts from: the header key or the wide-key prefix
+inline uint64_t sortPrefix(uint64_t key, const char* payload) {
+    return wideKeyBytes() ? widePrefix(payload) : key;
+}
+
+// Record order on serialized records
+inline bool recordLess(const Record* a, const Record* b) {
+    if (!wideKeyBytes()) return a->key < b->key;
+    const uint64_t pa = widePrefix(a->payload);
+    const uint64_t pb = widePrefix(b->payload);
+    return pa != pb ? pa < pb : wideKeyTailLess(a->payload, a->len, b->payload, b->len);
+}
+
 // Constants for chunk management
 constexpr size_t MB = 1024 * 1024;
 constexpr size_t BUFFER_SIZE = 64 * MB;               // 64MB buffer for I/O
@@ -77,7 +133,30 @@ public:
     }
 
     bool operator<(const RecordPtr& other) const {
-        return record->key < other.record->key;
+        return recordLess(record, other.record);
+    }
+};
+
+// Record view for efficient sorting without copying payloads
+struct RecordView {
+    uint64_t key;
+    const char* payload;  // points into mmap buffer
+    uint32_t len;
+    uint64_t prefix;      // sortPrefix() of the record, compared first
+    
+    RecordView() : key(0), payload(nullptr), len(0), prefix(0) {}
+    RecordView(uint64_t k, const char* p, uint32_t l)
+        : key(k), payload(p), len(l), prefix(p ? sortPrefix(k, p) : k) {}
+    
+    // Points the view at its payload once it is known
+    void bind(const char* p) {
+        payload = p;
+        prefix = sortPrefix(key, p);
+    }
+    
+    bool operator<(const RecordView& other) const {
+        if (prefix != other.prefix) return prefix < other.prefix;
+        return wideKeyBytes() && wideKeyTailLess(payload, len, other.payload, other.len);
     }
 };
 
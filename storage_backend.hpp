@@ -0,0 +1,875 @@
+#ifndef STORAGE_BACKEND_HPP
+#define STORAGE_BACKEND_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cerrno>
+#include <filesystem>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#endif
+
+// Bytes moved by one request of the io_uring backend; a large read or
+// write is split into requests that are all in flight at once
+constexpr size_t IO_URING_SEGMENT = 1024 * 1024;
+
+// Requests one io_uring ring can have in flight
+constexpr unsigned IO_URING_DEPTH = 32;
+
+// Block size used when a file is copied through a backend
+constexpr size_t STORAGE_COPY_BLOCK = 8 * 1024 * 1024;
+
+// Transfer time a simulated device can bank while idle, in seconds
+constexpr double DEVICE_BURST_SECONDS = 0.05;
+
+// Access pattern hints for StorageFile::readahead
+enum class AccessHint {
+    Sequential,     // Read front to back: enlarge readahead
+    Random,         // No readahead
+    WillNeed,       // Fetch the range now
+    DontNeed        // Range can be dropped from memory
+};
+
+enum class OpenMode {
+    Read,           // Existing file, read only
+    Write,          // Create or truncate, write only
+    ReadWrite       // Create if missing, keep contents
+};
+
+/**
+ * An open file of a StorageBackend. All access is positional, so one file
+ * can be shared by several threads reading disjoint ranges.
+ */
+class StorageFile {
+public:
+    virtual ~StorageFile() = default;
+
+    // Reads up to n bytes at offset; returns fewer only at end of file
+    virtual size_t pread(void* buffer, size_t n, uint64_t offset) = 0;
+
+    // Writes all n bytes at offset, extending the file as needed
+    virtual void pwrite(const void* buffer, size_t n, uint64_t offset) = 0;
+
+    virtual uint64_t size() const = 0;
+    virtual void truncate(uint64_t size) = 0;
+    virtual void readahead(uint64_t offset, uint64_t length, AccessHint hint) = 0;
+
+    // Read-only view of [offset, offset + length); offset must be page aligned
+    virtual const char* map(uint64_t offset, size_t length) = 0;
+
+    // Releases part of a view returned by map(); p must be page aligned
+    virtual void unmap(const char* p, size_t length) = 0;
+};
+
+/**
+ * Where sort inputs, runs and outputs live. Readers, writers and temp-file
+ * management go through the process-wide backend returned by storage(),
+ * so the I/O strategy is a configuration choice (SORT_STORAGE).
+ */
+class StorageBackend {
+public:
+    virtual ~StorageBackend() = default;
+    virtual const char* name() const = 0;
+    virtual std::unique_ptr<StorageFile> open(const std::string& path, OpenMode mode) = 0;
+    virtual uint64_t fileSize(const std::string& path) = 0;
+    virtual bool exists(const std::string& path) = 0;
+    virtual void remove(const std::string& path) = 0;
+
+    // Moves a file over `to`, replacing it; no data is copied
+    virtual void rename(const std::string& from, const std::string& to) = 0;
+
+    // Makes sure a file is on disk; only meaningful for the RAM-backed store
+    virtual void persist(const std::string&) {}
+};
+
+/**
+ * Buffered POSIX I/O through the page cache: pread/pwrite, posix_fadvise
+ * for hints, mmap for views.
+ */
+class PosixFile : public StorageFile {
+protected:
+    int fd_ = -1;
+    std::string path_;
+
+    [[noreturn]] void fail(const char* what, uint64_t offset) const {
+        throw std::runtime_error(std::string(what) + " failed on " + path_ + " at offset " +
+                                 std::to_string(offset) + ": " + std::strerror(errno));
+    }
+
+public:
+    PosixFile(const std::string& path, OpenMode mode) : path_(path) {
+        int flags = O_RDONLY;
+        if (mode == OpenMode::Write) flags = O_WRONLY | O_CREAT | O_TRUNC;
+        if (mode == OpenMode::ReadWrite) flags = O_RDWR | O_CREAT;
+        fd_ = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+        if (fd_ == -1) {
+            throw std::runtime_error("Cannot open file: " + path + ": " + std::strerror(errno));
+        }
+    }
+
+    ~PosixFile() override {
+        if (fd_ != -1) ::close(fd_);
+    }
+
+    PosixFile(const PosixFile&) = delete;
+    PosixFile& operator=(const PosixFile&) = delete;
+
+    size_t pread(void* buffer, size_t n, uint64_t offset) override {
+        size_t done = 0;
+        while (done < n) {
+            ssize_t got = ::pread(fd_, static_cast<char*>(buffer) + done, n - done, offset + done);
+            if (got < 0) {
+                if (errno == EINTR) continue;
+                fail("pread", offset + done);
+            }
+            if (got == 0) break;
+            done += got;
+        }
+        return done;
+    }
+
+    void pwrite(const void* buffer, size_t n, uint64_t offset) override {
+        size_t done = 0;
+        while (done < n) {
+            ssize_t put = ::pwrite(fd_, static_cast<const char*>(buffer) + done, n - done, offset + done);
+            if (put < 0) {
+                if (errno == EINTR) continue;
+                fail("pwrite", offset + done);
+            }
+            done += put;
+        }
+    }
+
+    uint64_t size() const override {
+        struct stat st;
+        if (fstat(fd_, &st) == -1) fail("fstat", 0);
+        return st.st_size;
+    }
+
+    void truncate(uint64_t size) override {
+        if (ftruncate(fd_, size) == -1) fail("ftruncate", size);
+    }
+
+    void readahead(uint64_t offset, uint64_t length, AccessHint hint) override {
+        int advice = POSIX_FADV_NORMAL;
+        switch (hint) {
+            case AccessHint::Sequential: advice = POSIX_FADV_SEQUENTIAL; break;
+            case AccessHint::Random:     advice = POSIX_FADV_RANDOM; break;
+            case AccessHint::WillNeed:   advice = POSIX_FADV_WILLNEED; break;
+            case AccessHint::DontNeed:   advice = POSIX_FADV_DONTNEED; break;
+        }
+        posix_fadvise(fd_, offset, length, advice);
+    }
+
+    const char* map(uint64_t offset, size_t length) override {
+        if (length == 0) return nullptr;
+        void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd_, offset);
+        if (p == MAP_FAILED) fail("mmap", offset);
+        return static_cast<const char*>(p);
+    }
+
+    void unmap(const char* p, size_t length) override {
+        if (p && length > 0) munmap(const_cast<char*>(p), length);
+    }
+};
+
+/**
+ * Reads are served from a read-only mapping of the whole file, remapped
+ * when the file has grown; writes go through pwrite. A read holds the
+ * mapping it copies from, so a remap by another thread cannot unmap it
+ * mid-copy: the old mapping goes when its last reader is done.
+ */
+class MmapFile : public PosixFile {
+private:
+    struct Mapping {
+        const char* data;
+        size_t size;
+        ~Mapping() { munmap(const_cast<char*>(data), size); }
+    };
+
+    std::mutex mutex_;
+    std::shared_ptr<const Mapping> view_;
+
+    void remap(size_t file_size) {
+        view_.reset();
+        if (file_size == 0) return;
+        void* p = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED) fail("mmap", 0);
+        view_.reset(new Mapping{static_cast<const char*>(p), file_size});
+    }
+
+public:
+    using PosixFile::PosixFile;
+
+    size_t pread(void* buffer, size_t n, uint64_t offset) override {
+        std::shared_ptr<const Mapping> view;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            const size_t view_size = view_ ? view_->size : 0;
+            if (offset + n > view_size) {
+                size_t file_size = size();
+                if (file_size != view_size) remap(file_size);
+            }
+            view = view_;
+        }
+        if (!view || offset >= view->size) return 0;
+        size_t count = std::min<uint64_t>(n, view->size - offset);
+        std::memcpy(buffer, view->data + offset, count);
+        return count;
+    }
+
+    void readahead(uint64_t offset, uint64_t length, AccessHint hint) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!view_ && size() > 0) remap(size());
+        if (!view_ || offset >= view_->size) return;
+
+        // madvise needs a page-aligned start
+        const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        const uint64_t start = offset - offset % page;
+        const size_t bytes = std::min<uint64_t>(length + (offset - start), view_->size - start);
+        int advice = MADV_NORMAL;
+        switch (hint) {
+            case AccessHint::Sequential: advice = MADV_SEQUENTIAL; break;
+            case AccessHint::Random:     advice = MADV_RANDOM; break;
+            case AccessHint::WillNeed:   advice = MADV_WILLNEED; break;
+            case AccessHint::DontNeed:   advice = MADV_DONTNEED; break;
+        }
+        madvise(const_cast<char*>(view_->data) + start, bytes, advice);
+    }
+};
+
+#if defined(__linux__)
+/**
+ * Minimal io_uring ring driven through the raw system calls: a transfer is
+ * split into IO_URING_SEGMENT requests that are kept IO_URING_DEPTH deep.
+ * Each thread uses its own ring.
+ */
+class IoUringRing {
+private:
+    int ring_fd_ = -1;
+    void* sq_ptr_ = nullptr;
+    void* cq_ptr_ = nullptr;
+    size_t sq_len_ = 0, cq_len_ = 0, sqes_len_ = 0;
+    unsigned* sq_head_; unsigned* sq_tail_; unsigned* sq_mask_; unsigned* sq_array_;
+    unsigned* cq_head_; unsigned* cq_tail_; unsigned* cq_mask_;
+    io_uring_sqe* sqes_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned entries_ = 0;
+
+public:
+    explicit IoUringRing(unsigned depth) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+        if (ring_fd_ < 0) {
+            throw std::runtime_error(std::string("io_uring_setup failed: ") + std::strerror(errno));
+        }
+        entries_ = params.sq_entries;
+
+        sq_len_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_len_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sq_len_ = cq_len_ = std::max(sq_len_, cq_len_);
+
+        sq_ptr_ = mmap(nullptr, sq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd_, IORING_OFF_SQ_RING);
+        cq_ptr_ = single ? sq_ptr_
+                         : mmap(nullptr, cq_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                ring_fd_, IORING_OFF_CQ_RING);
+        sqes_len_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqes_len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_SQES);
+        if (sq_ptr_ == MAP_FAILED || cq_ptr_ == MAP_FAILED || sqes == MAP_FAILED) {
+            close(ring_fd_);
+            throw std::runtime_error("io_uring ring mapping failed");
+        }
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        char* sq = static_cast<char*>(sq_ptr_);
+        char* cq = static_cast<char*>(cq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    ~IoUringRing() {
+        munmap(sqes_, sqes_len_);
+        if (cq_ptr_ != sq_ptr_) munmap(cq_ptr_, cq_len_);
+        munmap(sq_ptr_, sq_len_);
+        close(ring_fd_);
+    }
+
+    IoUringRing(const IoUringRing&) = delete;
+    IoUringRing& operator=(const IoUringRing&) = delete;
+
+    /**
+     * Reads or writes n bytes at offset with all segments in flight
+     * @param opcode IORING_OP_READ or IORING_OP_WRITE
+     * @return Bytes transferred before the first short segment (end of file)
+     */
+    size_t transfer(uint8_t opcode, int fd, char* buffer, size_t n, uint64_t offset) {
+        const size_t segments = (n + IO_URING_SEGMENT - 1) / IO_URING_SEGMENT;
+        std::vector<int64_t> result(segments, -1);
+        size_t next = 0, in_flight = 0;
+
+        while (next < segments || in_flight > 0) {
+            unsigned to_submit = 0;
+            unsigned tail = *sq_tail_;
+            while (next < segments && in_flight < entries_) {
+                const size_t begin = next * IO_URING_SEGMENT;
+                io_uring_sqe* sqe = &sqes_[tail & *sq_mask_];
+                std::memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = opcode;
+                sqe->fd = fd;
+                sqe->addr = reinterpret_cast<uint64_t>(buffer + begin);
+                sqe->len = static_cast<uint32_t>(std::min(IO_URING_SEGMENT, n - begin));
+                sqe->off = offset + begin;
+                sqe->user_data = next;
+                sq_array_[tail & *sq_mask_] = tail & *sq_mask_;
+                tail++;
+                next++;
+                in_flight++;
+                to_submit++;
+            }
+            __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+            if (syscall(__NR_io_uring_enter, ring_fd_, to_submit, 1, IORING_ENTER_GETEVENTS,
+                        nullptr, 0) < 0 && errno != EINTR) {
+                throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+            }
+
+            unsigned head = *cq_head_;
+            while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+                const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+                result[cqe.user_data] = cqe.res;
+                head++;
+                in_flight--;
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        }
+
+        size_t done = 0;
+        for (size_t s = 0; s < segments; ++s) {
+            const size_t want = std::min(IO_URING_SEGMENT, n - s * IO_URING_SEGMENT);
+            if (result[s] < 0) {
+                errno = static_cast<int>(-result[s]);
+                throw std::runtime_error(std::string("io_uring request failed: ") + std::strerror(errno));
+            }
+            if (static_cast<size_t>(result[s]) < want) {
+                // A short segment: finish it synchronously, then stop at end of file
+                size_t got = result[s];
+                char* p = buffer + s * IO_URING_SEGMENT;
+                while (got < want) {
+                    ssize_t r = opcode == IORING_OP_READ
+                        ? ::pread(fd, p + got, want - got, offset + s * IO_URING_SEGMENT + got)
+                        : ::pwrite(fd, p + got, want - got, offset + s * IO_URING_SEGMENT + got);
+                    if (r < 0 && errno == EINTR) continue;
+                    if (r < 0) throw std::runtime_error(std::string("I/O failed: ") + std::strerror(errno));
+                    if (r == 0) break;
+                    got += r;
+                }
+                done += got;
+                if (got < want) break;
+                continue;
+            }
+            done += want;
+        }
+        return done;
+    }
+
+    static IoUringRing& local() {
+        thread_local IoUringRing ring(IO_URING_DEPTH);
+        return ring;
+    }
+};
+
+/**
+ * Positional reads and writes submitted through io_uring; hints and views
+ * are the POSIX ones.
+ */
+class IoUringFile : public PosixFile {
+public:
+    using PosixFile::PosixFile;
+
+    size_t pread(void* buffer, size_t n, uint64_t offset) override {
+        return IoUringRing::local().transfer(IORING_OP_READ, fd_, static_cast<char*>(buffer), n, offset);
+    }
+
+    void pwrite(const void* buffer, size_t n, uint64_t offset) override {
+        char* p = const_cast<char*>(static_cast<const char*>(buffer));
+        if (IoUringRing::local().transfer(IORING_OP_WRITE, fd_, p, n, offset) != n) {
+            fail("io_uring write", offset);
+        }
+    }
+};
+#endif
+
+template <typename File>
+class FileSystemBackend : public StorageBackend {
+private:
+    const char* name_;
+
+public:
+    explicit FileSystemBackend(const char* name) : name_(name) {}
+
+    const char* name() const override { return name_; }
+
+    std::unique_ptr<StorageFile> open(const std::string& path, OpenMode mode) override {
+        return std::make_unique<File>(path, mode);
+    }
+
+    uint64_t fileSize(const std::string& path) override {
+        struct stat st;
+        if (stat(path.c_str(), &st) == -1) {
+            throw std::runtime_error("Cannot stat file: " + path);
+        }
+        return st.st_size;
+    }
+
+    bool exists(const std::string& path) override {
+        struct stat st;
+        return stat(path.c_str(), &st) == 0;
+    }
+
+    void remove(const std::string& path) override {
+        ::unlink(path.c_str());
+    }
+
+    void rename(const std::string& from, const std::string& to) override {
+        if (::rename(from.c_str(), to.c_str()) == -1) {
+            throw std::runtime_error("Cannot rename " + from + " to " + to + ": " + std::strerror(errno));
+        }
+    }
+};
+
+/**
+ * RAM-backed store: files written through it live only in memory, so runs
+ * cost no disk I/O and sorts can be benchmarked CPU-only. Files it does not
+ * hold are loaded from disk the first time they are opened; persist()
+ * writes a file out to disk.
+ */
+class MemoryBackend : public StorageBackend {
+private:
+    struct Blob {
+        std::mutex mutex;
+        std::vector<char> data;
+    };
+
+    class MemoryFile : public StorageFile {
+    private:
+        std::shared_ptr<Blob> blob_;
+
+    public:
+        explicit MemoryFile(std::shared_ptr<Blob> blob) : blob_(std::move(blob)) {}
+
+        size_t pread(void* buffer, size_t n, uint64_t offset) override {
+            std::lock_guard<std::mutex> lock(blob_->mutex);
+            if (offset >= blob_->data.size()) return 0;
+            size_t count = std::min<uint64_t>(n, blob_->data.size() - offset);
+            std::memcpy(buffer, blob_->data.data() + offset, count);
+            return count;
+        }
+
+        void pwrite(const void* buffer, size_t n, uint64_t offset) override {
+            std::lock_guard<std::mutex> lock(blob_->mutex);
+            if (offset + n > blob_->data.size()) blob_->data.resize(offset + n);
+            std::memcpy(blob_->data.data() + offset, buffer, n);
+        }
+
+        uint64_t size() const override {
+            std::lock_guard<std::mutex> lock(blob_->mutex);
+            return blob_->data.size();
+        }
+
+        void truncate(uint64_t size) override {
+            std::lock_guard<std::mutex> lock(blob_->mutex);
+            blob_->data.resize(size);
+        }
+
+        void readahead(uint64_t, uint64_t, AccessHint) override {}
+
+        // Views point into the blob; it must not grow while they are used
+        const char* map(uint64_t offset, size_t) override {
+            std::lock_guard<std::mutex> lock(blob_->mutex);
+            return blob_->data.data() + offset;
+        }
+
+        void unmap(const char*, size_t) override {}
+    };
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<Blob>> files_;
+
+    // Blob of a path, loading it from disk if the store does not hold it
+    std::shared_ptr<Blob> find(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = files_.find(path);
+        if (it != files_.end()) return it->second;
+
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) return nullptr;
+        auto blob = std::make_shared<Blob>();
+        blob->data.resize(static_cast<size_t>(in.tellg()));
+        in.seekg(0);
+        in.read(blob->data.data(), blob->data.size());
+        files_[path] = blob;
+        return blob;
+    }
+
+public:
+    const char* name() const override { return "memory"; }
+
+    std::unique_ptr<StorageFile> open(const std::string& path, OpenMode mode) override {
+        if (mode == OpenMode::Write) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto blob = std::make_shared<Blob>();
+            files_[path] = blob;
+            return std::make_unique<MemoryFile>(blob);
+        }
+        std::shared_ptr<Blob> blob = find(path);
+        if (!blob) {
+            if (mode == OpenMode::Read) throw std::runtime_error("Cannot open file: " + path);
+            std::lock_guard<std::mutex> lock(mutex_);
+            blob = files_.emplace(path, std::make_shared<Blob>()).first->second;
+        }
+        return std::make_unique<MemoryFile>(blob);
+    }
+
+    uint64_t fileSize(const std::string& path) override {
+        std::shared_ptr<Blob> blob = find(path);
+        if (!blob) throw std::runtime_error("Cannot stat file: " + path);
+        std::lock_guard<std::mutex> lock(blob->mutex);
+        return blob->data.size();
+    }
+
+    bool exists(const std::string& path) override {
+        return find(path) != nullptr;
+    }
+
+    void remove(const std::string& path) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        files_.erase(path);
+    }
+
+    void rename(const std::string& from, const std::string& to) override {
+        std::shared_ptr<Blob> blob = find(from);
+        if (!blob) throw std::runtime_error("Cannot rename missing file: " + from);
+        std::lock_guard<std::mutex> lock(mutex_);
+        files_.erase(from);
+        files_[to] = std::move(blob);
+    }
+
+    void persist(const std::string& path) override {
+        std::shared_ptr<Blob> blob;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = files_.find(path);
+            if (it == files_.end()) return;
+            blob = it->second;
+        }
+        std::lock_guard<std::mutex> lock(blob->mutex);
+        std::ofstream out(path, std::ios::binary);
+        out.write(blob->data.data(), blob->data.size());
+        if (!out) throw std::runtime_error("Cannot persist file: " + path);
+    }
+};
+
+/**
+ * Performance of a simulated storage device
+ */
+struct DeviceProfile {
+    double read_bytes_per_sec;
+    double write_bytes_per_sec;
+    double latency_sec;         // Added to every operation
+    unsigned queue_depth;       // Operations the device services at once
+};
+
+/**
+ * Parses SORT_THROTTLE: a preset (hdd, nfs, ssd, nvme) or
+ * "read_mb_s:write_mb_s:latency_us:queue_depth"
+ */
+inline DeviceProfile parseDeviceProfile(const std::string& spec) {
+    const double mb = 1024.0 * 1024.0;
+    if (spec == "hdd")  return {160 * mb, 150 * mb, 6e-3, 1};
+    if (spec == "nfs")  return {110 * mb, 90 * mb, 5e-4, 8};
+    if (spec == "ssd")  return {520 * mb, 480 * mb, 1e-4, 32};
+    if (spec == "nvme") return {3000 * mb, 2000 * mb, 2e-5, 128};
+
+    DeviceProfile profile;
+    char extra;
+    if (std::sscanf(spec.c_str(), "%lf:%lf:%lf:%u%c", &profile.read_bytes_per_sec,
+                    &profile.write_bytes_per_sec, &profile.latency_sec, &profile.queue_depth, &extra) != 4 ||
+        profile.read_bytes_per_sec <= 0 || profile.write_bytes_per_sec <= 0 ||
+        profile.latency_sec < 0 || profile.queue_depth == 0) {
+        throw std::runtime_error("Invalid storage throttle: " + spec +
+                                 " (expected hdd, nfs, ssd, nvme or read_mb_s:write_mb_s:latency_us:queue_depth)");
+    }
+    profile.read_bytes_per_sec *= mb;
+    profile.write_bytes_per_sec *= mb;
+    profile.latency_sec *= 1e-6;
+    return profile;
+}
+
+/**
+ * One simulated device. At most queue_depth operations are in service;
+ * each waits its latency plus its transfer time, and transfer time is
+ * drawn from a token bucket (counted in seconds of device time) so the
+ * bandwidth cap holds across all threads using the device.
+ */
+class SimulatedDevice {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    DeviceProfile profile_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    unsigned active_ = 0;
+    double tokens_ = DEVICE_BURST_SECONDS;
+    Clock::time_point refilled_ = Clock::now();
+
+    uint64_t read_bytes_ = 0;
+    uint64_t write_bytes_ = 0;
+    uint64_t operations_ = 0;
+    double delayed_ = 0;            // Seconds operations were held back
+
+public:
+    explicit SimulatedDevice(const DeviceProfile& profile) : profile_(profile) {}
+
+    // Blocks the caller for the service time of one operation of n bytes
+    void service(size_t n, bool write) {
+        const auto start = Clock::now();
+        double wait;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return active_ < profile_.queue_depth; });
+            active_++;
+
+            // Refill, then charge; a negative balance is the transfer
+            // backlog this operation has to wait out
+            const auto now = Clock::now();
+            tokens_ = std::min(DEVICE_BURST_SECONDS,
+                               tokens_ + std::chrono::duration<double>(now - refilled_).count());
+            refilled_ = now;
+            tokens_ -= n / (write ? profile_.write_bytes_per_sec : profile_.read_bytes_per_sec);
+            wait = profile_.latency_sec + std::max(0.0, -tokens_);
+        }
+
+        std::this_thread::sleep_until(start + std::chrono::duration<double>(wait));
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        active_--;
+        (write ? write_bytes_ : read_bytes_) += n;
+        operations_++;
+        delayed_ += std::chrono::duration<double>(Clock::now() - start).count();
+        cv_.notify_one();
+    }
+
+    void report(std::ostream& out, dev_t id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (operations_ == 0) return;
+        out << "Simulated device " << id << ": " << operations_ << " ops, "
+            << std::fixed << std::setprecision(1)
+            << read_bytes_ / (1024.0 * 1024.0) << " MB read, "
+            << write_bytes_ / (1024.0 * 1024.0) << " MB written, "
+            << delayed_ << " s in service" << std::endl;
+    }
+};
+
+/**
+ * Wraps another backend's files so every operation is serviced by the
+ * simulated device holding the file. Views are charged as one read of
+ * the whole mapped length when created.
+ */
+class ThrottledBackend : public StorageBackend {
+private:
+    class ThrottledFile : public StorageFile {
+    private:
+        std::unique_ptr<StorageFile> inner_;
+        SimulatedDevice& device_;
+
+    public:
+        ThrottledFile(std::unique_ptr<StorageFile> inner, SimulatedDevice& device)
+            : inner_(std::move(inner)), device_(device) {}
+
+        size_t pread(void* buffer, size_t n, uint64_t offset) override {
+            size_t got = inner_->pread(buffer, n, offset);
+            device_.service(got, false);
+            return got;
+        }
+
+        void pwrite(const void* buffer, size_t n, uint64_t offset) override {
+            inner_->pwrite(buffer, n, offset);
+            device_.service(n, true);
+        }
+
+        uint64_t size() const override { return inner_->size(); }
+        void truncate(uint64_t size) override { inner_->truncate(size); }
+
+        void readahead(uint64_t offset, uint64_t length, AccessHint hint) override {
+            inner_->readahead(offset, length, hint);
+        }
+
+        const char* map(uint64_t offset, size_t length) override {
+            const char* p = inner_->map(offset, length);
+            device_.service(length, false);
+            return p;
+        }
+
+        void unmap(const char* p, size_t length) override { inner_->unmap(p, length); }
+    };
+
+    std::unique_ptr<StorageBackend> inner_;
+    DeviceProfile profile_;
+    std::string name_;
+    std::mutex mutex_;
+    std::map<dev_t, std::unique_ptr<SimulatedDevice>> devices_;
+
+    // Device of a path: the file system holding it, or its directory for new files
+    SimulatedDevice& deviceOf(const std::string& path) {
+        struct stat st;
+        dev_t id = 0;
+        if (stat(path.c_str(), &st) == 0) {
+            id = st.st_dev;
+        } else {
+            size_t slash = path.find_last_of('/');
+            std::string dir = slash == std::string::npos ? "." : path.substr(0, std::max<size_t>(slash, 1));
+            if (stat(dir.c_str(), &st) == 0) id = st.st_dev;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& device = devices_[id];
+        if (!device) device = std::make_unique<SimulatedDevice>(profile_);
+        return *device;
+    }
+
+public:
+    ThrottledBackend(std::unique_ptr<StorageBackend> inner, const DeviceProfile& profile,
+                     const std::string& spec)
+        : inner_(std::move(inner)), profile_(profile),
+          name_(std::string(inner_->name()) + " throttled to " + spec) {}
+
+    ~ThrottledBackend() override {
+        for (auto& [id, device] : devices_) {
+            device->report(std::cout, id);
+        }
+    }
+
+    const char* name() const override { return name_.c_str(); }
+
+    std::unique_ptr<StorageFile> open(const std::string& path, OpenMode mode) override {
+        SimulatedDevice& device = deviceOf(path);
+        std::unique_ptr<StorageFile> file = inner_->open(path, mode);
+        device.service(0, mode != OpenMode::Read);
+        return std::make_unique<ThrottledFile>(std::move(file), device);
+    }
+
+    uint64_t fileSize(const std::string& path) override { return inner_->fileSize(path); }
+    bool exists(const std::string& path) override { return inner_->exists(path); }
+    void remove(const std::string& path) override { inner_->remove(path); }
+    void rename(const std::string& from, const std::string& to) override { inner_->rename(from, to); }
+    void persist(const std::string& path) override { inner_->persist(path); }
+};
+
+/**
+ * Creates a backend by name: posix, mmap, io_uring or memory
+ */
+inline std::unique_ptr<StorageBackend> makeStorageBackend(const std::string& name) {
+    if (name == "posix") return std::make_unique<FileSystemBackend<PosixFile>>("posix");
+    if (name == "mmap") return std::make_unique<FileSystemBackend<MmapFile>>("mmap");
+#if defined(__linux__)
+    if (name == "io_uring") return std::make_unique<FileSystemBackend<IoUringFile>>("io_uring");
+#endif
+    if (name == "memory") return std::make_unique<MemoryBackend>();
+    throw std::runtime_error("Unknown storage backend: " + name);
+}
+
+inline std::unique_ptr<StorageBackend>& storageSlot() {
+    static std::unique_ptr<StorageBackend> backend = [] {
+        const char* name = std::getenv("SORT_STORAGE");
+        std::unique_ptr<StorageBackend> base = makeStorageBackend(name ? name : "posix");
+        const char* throttle = std::getenv("SORT_THROTTLE");
+        if (!throttle || !*throttle) return base;
+        return std::unique_ptr<StorageBackend>(
+            new ThrottledBackend(std::move(base), parseDeviceProfile(throttle), throttle));
+    }();
+    return backend;
+}
+
+// Process-wide backend, chosen by SORT_STORAGE (default posix) and
+// optionally slowed to a simulated device by SORT_THROTTLE
+inline StorageBackend& storage() {
+    return *storageSlot();
+}
+
+inline void setStorageBackend(std::unique_ptr<StorageBackend> backend) {
+    storageSlot() = std::move(backend);
+}
+
+/**
+ * Appends a whole file to dst at offset through the current backend
+ * @return Bytes copied
+ */
+inline uint64_t appendFile(const std::string& src, StorageFile& dst, uint64_t offset) {
+    std::unique_ptr<StorageFile> in = storage().open(src, OpenMode::Read);
+    in->readahead(0, 0, AccessHint::Sequential);
+    std::unique_ptr<char[]> block(new char[STORAGE_COPY_BLOCK]);
+    uint64_t copied = 0;
+    for (;;) {
+        size_t got = in->pread(block.get(), STORAGE_COPY_BLOCK, copied);
+        if (got == 0) break;
+        dst.pwrite(block.get(), got, offset + copied);
+        copied += got;
+    }
+    return copied;
+}
+
+// Copies src over dst through the current backend
+inline void copyFile(const std::string& src, const std::string& dst) {
+    std::unique_ptr<StorageFile> out = storage().open(dst, OpenMode::Write);
+    appendFile(src, *out, 0);
+}
+
+/**
+ * Creates a fresh private directory for temporary files, under TMPDIR (or
+ * the working directory), so concurrent sorts never share spill files
+ * @param prefix Name prefix; a unique suffix is appended
+ * @return Path of the new directory, owned by the caller
+ */
+inline std::string makeTempDir(const std::string& prefix) {
+    const char* tmpdir = std::getenv("TMPDIR");
+    const std::string base = tmpdir ? tmpdir : ".";
+    std::filesystem::create_directories(base);
+    std::string path = base + "/" + prefix + "_XXXXXX";
+    if (!::mkdtemp(path.data())) {
+        throw std::runtime_error("Cannot create temporary directory in " + base + ": " + std::strerror(errno));
+    }
+    return path;
+}
+
+#endif // STORAGE_BACKEND_HPP
@@ -0,0 +1,175 @@
+#ifndef WINDOWED_SORT_HPP
+#define WINDOWED_SORT_HPP
+
+#include "record_structure.hpp"
+#include "omp_mergesort.hpp"
+#include "input_set.hpp"
+#include "output_format.hpp"
+#include "async_writer.hpp"
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+
+// Bounded-disorder mode, selected with SORT_WINDOW=<records> (0 = off)
+inline size_t disorderWindowRequested() {
+    const char* window = std::getenv("SORT_WINDOW");
+    if (!window) return 0;
+    size_t records = std::stoull(window);
+    if (records == 0) throw std::runtime_error("SORT_WINDOW must be a positive record count");
+    return records;
+}
+
+/**
+ * Single-pass sort of a nearly ordered input whose records are displaced
+ * by at most W positions. A min-heap holds the last W records read, and
+ * its minimum is emitted once the heap overflows. This is O(n log W)
+ * time and O(W) memory. A record below the last emitted one is out of
+ * bound: it is spilled to a late run, which is sorted and merged into the
+ * output at the end.
+ */
+class WindowedSort {
+private:
+    size_t window_;
+    int num_threads_;
+    size_t memory_budget_;
+    std::string temp_dir_;
+
+    struct Pending {
+        uint64_t prefix;        // sortPrefix() of the record
+        RecordPtr record;
+    };
+
+    // Heap order: the smallest record on top
+    static bool later(const Pending& a, const Pending& b) {
+        if (a.prefix != b.prefix) return a.prefix > b.prefix;
+        return wideKeyBytes() && recordLess(b.record.get(), a.record.get());
+    }
+
+    // Budget bytes a pending record is charged, besides its own size
+    static constexpr size_t PENDING_OVERHEAD = sizeof(Pending) + RECORD_OVERHEAD;
+
+    // This instance's spill directory (under TMPDIR), created on first use
+    const std::string& spillDir() {
+        if (temp_dir_.empty()) temp_dir_ = makeTempDir("window_tmp");
+        return temp_dir_;
+    }
+
+    // Removes the spill directory, if this instance created one
+    void removeSpillDir() noexcept {
+        if (temp_dir_.empty()) return;
+        std::error_code ignored;
+        std::filesystem::remove_all(temp_dir_, ignored);
+        temp_dir_.clear();
+    }
+
+public:
+    WindowedSort(size_t window, int threads, size_t memory_budget = MAX_MEMORY_USAGE)
+        : window_(window), num_threads_(threads), memory_budget_(memory_budget) {
+        // Even records of the smallest size must fit W at a time
+        const size_t max_window = memory_budget_ / (PENDING_OVERHEAD + HEADER_SIZE + PAYLOAD_MIN);
+        if (window_ > max_window) {
+            throw std::runtime_error("SORT_WINDOW=" + std::to_string(window_) + " does not fit the " +
+                                     std::to_string(memory_budget_ / MB) + " MB memory budget (at most " +
+                                     std::to_string(max_window) + " records)");
+        }
+    }
+
+    ~WindowedSort() {
+        removeSpillDir();
+    }
+
+    WindowedSort(const WindowedSort&) = delete;
+    WindowedSort& operator=(const WindowedSort&) = delete;
+
+    /**
+     * Sorts the concatenation of the inputs into output. The windowed stream
+     * is written next to output and renamed over it; if records were late,
+     * it is instead merged with the sorted late run into output.
+     * @param inputs Input files, read in order
+     * @param output Path of the sorted records
+     * @param format Layout of the output; an encoded one is produced while
+     *               the stream is moved or merged into place
+     */
+    void sort(const std::vector<std::string>& inputs, const std::string& output,
+              OutputFormat format = OutputFormat::Raw) {
+        Timer timer("Windowed sort (W = " + std::to_string(window_) + ")");
+        PieceReader reader(wholeFiles(inputs));
+        const std::string windowed = output + ".window.tmp";
+        AsyncWriter writer(windowed);
+        RecordBuffer buffer;
+        std::vector<Pending> heap;
+        heap.reserve(window_ + 1);
+        size_t heap_bytes = 0;
+
+        std::string late_run;
+        std::unique_ptr<AsyncWriter> late;
+        RecordBuffer late_buffer;
+        uint64_t records = 0, late_records = 0;
+        RecordPtr last;                 // Last emitted record: the watermark
+
+        auto emitMin = [&] {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            writer.append(buffer, heap.back().record.data(), heap.back().record.size());
+            heap_bytes -= PENDING_OVERHEAD + heap.back().record.size();
+            last = std::move(heap.back().record);
+            heap.pop_back();
+        };
+
+        try {
+            for (RecordPtr r = reader.next(); r.get(); r = reader.next()) {
+                records++;
+                if (last.get() && recordLess(r.get(), last.get())) {
+                    // Displaced further than the window: emitted order is already past it
+                    if (!late) {
+                        late_run = spillDir() + "/late.tmp";
+                        late = std::make_unique<AsyncWriter>(late_run);
+                    }
+                    late->append(late_buffer, r.data(), r.size());
+                    late_records++;
+                    continue;
+                }
+                const uint64_t prefix = sortPrefix(r.get()->key, r.get()->payload);
+                heap_bytes += PENDING_OVERHEAD + r.size();
+                heap.push_back({prefix, std::move(r)});
+                std::push_heap(heap.begin(), heap.end(), later);
+                // Large records narrow the window rather than overrun the budget
+                while (heap.size() > window_ || heap_bytes > memory_budget_) emitMin();
+            }
+            while (!heap.empty()) emitMin();
+            writer.flush(buffer);
+            writer.close();
+
+            if (!late && format == OutputFormat::Raw) {
+                storage().rename(windowed, output);
+            } else if (!late) {
+                AsyncWriter encoded(output, STAGING_BUFFER_SIZE, outputSink(output, format));
+                streamFile(windowed, encoded);
+                encoded.close();
+                storage().remove(windowed);
+            } else {
+                late->flush(late_buffer);
+                late->close();
+                std::cout << late_records << " of " << records << " records were displaced by more than "
+                          << window_ << "; sorting and merging them in" << std::endl;
+
+                // The windowed output is one sorted run, the late records another
+                OpenMPMergeSort sorter(num_threads_, memory_budget_);
+                const std::string late_sorted = spillDir() + "/late_sorted.tmp";
+                sorter.sort(late_run, late_sorted);
+                sorter.kWayMerge({windowed, late_sorted}, output, STAGING_BUFFER_SIZE, format);
+                storage().remove(windowed);
+            }
+        } catch (...) {
+            storage().remove(windowed);
+            removeSpillDir();
+            throw;
+        }
+        removeSpillDir();
+        std::cout << "Windowed sort of " << records << " records, " << late_records << " late" << std::endl;
+    }
+};
+
+#endif // WINDOWED_SORT_HPP